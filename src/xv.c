@@ -16,8 +16,13 @@
 #include "xv_log.h"
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
+// loop load is refreshed once per window
+#define XV_LOOP_LOAD_WINDOW_US 100000
+
 struct xv_io_t {
     int fd;
     int event;
@@ -38,6 +43,12 @@ struct xv_loop_t {
     xv_fired_event_t *fired_events;
     int setsize;
     int start;
+
+    // load stat
+    int load_stat_enable;
+    int64_t busy_us;
+    int64_t idle_us;
+    int load;
 };
 
 xv_loop_t *xv_loop_init(int setsize)
@@ -57,6 +68,11 @@ xv_loop_t *xv_loop_init(int setsize)
     loop->setsize = setsize;
     loop->start = 1;
 
+    loop->load_stat_enable = 0;
+    loop->busy_us = 0;
+    loop->idle_us = 0;
+    loop->load = 0;
+
     return loop;
 }
 
@@ -70,9 +86,15 @@ void xv_loop_destroy(xv_loop_t *loop)
     xv_free(loop);
 }
 
-static void xv_loop_poll(xv_loop_t *loop, int timeout_ms)
+static int64_t xv_loop_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void xv_loop_process_events(xv_loop_t *loop, int count)
 {
-    int count = xv_poller_poll(loop->poller_data, loop->fired_events, timeout_ms);
     for (int i = 0; i < count; ++i) {
         int fd = loop->fired_events[i].fd;
         int event = loop->fired_events[i].event;
@@ -91,6 +113,33 @@ static void xv_loop_poll(xv_loop_t *loop, int timeout_ms)
     }
 }
 
+static void xv_loop_poll(xv_loop_t *loop, int timeout_ms)
+{
+    if (!loop->load_stat_enable) {
+        int count = xv_poller_poll(loop->poller_data, loop->fired_events, timeout_ms);
+        xv_loop_process_events(loop, count);
+        return;
+    }
+
+    int64_t poll_begin = xv_loop_now_us();
+    int count = xv_poller_poll(loop->poller_data, loop->fired_events, timeout_ms);
+    int64_t poll_end = xv_loop_now_us();
+    xv_loop_process_events(loop, count);
+    int64_t process_end = xv_loop_now_us();
+
+    loop->idle_us += poll_end - poll_begin;
+    loop->busy_us += process_end - poll_end;
+
+    int64_t total_us = loop->idle_us + loop->busy_us;
+    if (total_us >= XV_LOOP_LOAD_WINDOW_US) {
+        // smooth with the last window
+        int load = (int)(loop->busy_us * 1000 / total_us);
+        __atomic_store_n(&loop->load, (loop->load + load) / 2, __ATOMIC_RELAXED);
+        loop->idle_us = 0;
+        loop->busy_us = 0;
+    }
+}
+
 void xv_loop_run(xv_loop_t *loop)
 {
     while (loop->start) {
@@ -118,6 +167,16 @@ void xv_loop_break(xv_loop_t *loop)
     xv_memory_barriers();
 }
 
+void xv_loop_enable_load_stat(xv_loop_t *loop)
+{
+    loop->load_stat_enable = 1;
+}
+
+int xv_loop_get_load(xv_loop_t *loop)
+{
+    return __atomic_load_n(&loop->load, __ATOMIC_RELAXED);
+}
+
 static int xv_loop_resize(xv_loop_t *loop, int setsize)
 {
     xv_log_debug("loop resize, setsize: %d -> %d", loop->setsize, setsize);
@@ -134,7 +193,7 @@ static int xv_loop_resize(xv_loop_t *loop, int setsize)
         loop->events[i].read_io = NULL;
         loop->events[i].write_io = NULL;
     }
-    loop->fired_events = (xv_fired_event_t *)xv_realloc(loop->events, sizeof(xv_fired_event_t) * setsize);
+    loop->fired_events = (xv_fired_event_t *)xv_realloc(loop->fired_events, sizeof(xv_fired_event_t) * setsize);
     loop->setsize = setsize;
 
     return XV_OK;
@@ -143,8 +202,12 @@ static int xv_loop_resize(xv_loop_t *loop, int setsize)
 static int xv_loop_add_event(xv_loop_t *loop, xv_io_t *io)
 {
     if (io->fd >= loop->setsize) {
-        if (xv_loop_resize(loop, loop->setsize * 2) == XV_ERR) {
-            xv_log_error("xv_loop_resize to %s failed", loop->setsize * 2);
+        int setsize = loop->setsize;
+        while (io->fd >= setsize) {
+            setsize *= 2;
+        }
+        if (xv_loop_resize(loop, setsize) == XV_ERR) {
+            xv_log_error("xv_loop_resize to %d failed", setsize);
             return XV_ERR;
         }
     }
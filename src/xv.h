@@ -32,6 +32,11 @@ void xv_loop_run_once(xv_loop_t *loop);
 void xv_loop_break(xv_loop_t *loop);
 void xv_loop_destroy(xv_loop_t *loop);
 
+// measure how busy the loop is, cost two clock_gettime per poll
+void xv_loop_enable_load_stat(xv_loop_t *loop);
+// busy permille (0 ~ 1000) of the recent loop time, any thread can read it
+int xv_loop_get_load(xv_loop_t *loop);
+
 // ----------------------------------------------------------------------------------------
 // xv_io_t
 // ----------------------------------------------------------------------------------------
@@ -72,7 +77,10 @@ typedef void (*xv_timer_cb_t)(xv_loop_t *loop, xv_timer_t *);
 void xv_timer_set_userdata(xv_timer_t *timer, void *data);
 void *xv_timer_get_userdata(xv_timer_t *timer);
 
-xv_timer_t *xv_timer_init();
+// fire after `timeout_ms`, then every `repeat_ms` if it > 0
+xv_timer_t *xv_timer_init(xv_timer_cb_t cb, int timeout_ms, int repeat_ms);
+// change the timeout, rearm it if started
+int xv_timer_set(xv_timer_t *timer, int timeout_ms, int repeat_ms);
 int xv_timer_start(xv_loop_t *loop, xv_timer_t *timer);
 int xv_timer_stop(xv_loop_t *loop, xv_timer_t *timer);
 int xv_timer_destroy(xv_timer_t *timer);
@@ -16,9 +16,13 @@
 #include <string.h>
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <libgen.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <sys/time.h>
 
@@ -29,10 +33,135 @@
 
 #define XV_LOG_LINE_MAX  1024
 
+#define XV_LOG_RING_DEFAULT_SIZE (256 * 1024)
+#define XV_LOG_RING_MIN_SIZE     (16 * 1024)
+#define XV_LOG_BATCH_SIZE        (64 * 1024)
+#define XV_LOG_RECORD_PAD        -1
+#define XV_LOG_RECORD_BINARY     -2
+
+#define XV_LOG_SITE_MAX_ARGS     32
+#define XV_LOG_BINARY_MAGIC      "XVLOGBIN"
+#define XV_LOG_BINARY_VERSION    1
+
+// binary log entry type
+#define XV_LOG_ENTRY_SITE        1   // id, level, line, flags, file, func, fmt
+#define XV_LOG_ENTRY_LOG         2   // site id, tid, sec, usec, raw args
+#define XV_LOG_ENTRY_TEXT        3   // formatted line, such as `xv_log()` called directly
+
+// raw arg type of a format conversion
+enum {
+    XV_LOG_ARG_NONE = 0,     // "%%"
+    XV_LOG_ARG_INT,          // 4 bytes, int & promoted char/short
+    XV_LOG_ARG_LONG,         // 8 bytes for all below
+    XV_LOG_ARG_LLONG,
+    XV_LOG_ARG_INTMAX,
+    XV_LOG_ARG_SIZE,
+    XV_LOG_ARG_PTRDIFF,
+    XV_LOG_ARG_PTR,
+    XV_LOG_ARG_DOUBLE,
+    XV_LOG_ARG_LDOUBLE,      // sizeof(long double) bytes
+    XV_LOG_ARG_STR,          // 4 bytes length & chars
+};
+
+// precision of a conversion
+#define XV_LOG_PREC_NONE         -1
+#define XV_LOG_PREC_STAR         -2  // the int arg right before the value
+
+#define XV_LOG_ALIGN(size) (((size) + 7) & ~7)
+
+// a log record in ring, message follow it
+typedef struct xv_log_record_t {
+    uint32_t size;         // whole record size include header, aligned to 8
+    int level;             // XV_LOG_RECORD_PAD means skip to ring end, XV_LOG_RECORD_BINARY means raw args
+    int line;              // site id for XV_LOG_RECORD_BINARY
+    int len;               // message or raw args length
+    const char *file;
+    const char *func;
+    struct timeval tv;
+} xv_log_record_t;
+
+// single producer (owner thread) single consumer (flusher) ring
+typedef struct xv_log_ring_t {
+    uint64_t head __attribute__((aligned(64)));  // written by owner thread
+    uint64_t dropped;                            // written by owner thread
+    uint64_t tail __attribute__((aligned(64)));  // written by flusher
+    uint64_t reported;                           // dropped count already reported
+    char *buf;
+    uint64_t size;
+    int tid;
+    int dead;                                    // owner thread exited, free after drained
+    struct xv_log_ring_t *next;
+} xv_log_ring_t;
+
+// a log call site, args is parsed from fmt once
+typedef struct xv_log_site_t {
+    int id;
+    int level;
+    int line;
+    int raw_text;          // format not supported, record the formatted text
+    const char *file;
+    const char *func;
+    const char *fmt;
+    int arg_count;
+    unsigned char args[XV_LOG_SITE_MAX_ARGS];
+    int precs[XV_LOG_SITE_MAX_ARGS];   // XV_LOG_ARG_STR copy at most precision chars, buffer may not end with '\0'
+} xv_log_site_t;
+
+// a conversion in format, literal before it is [p, start)
+typedef struct xv_log_spec_t {
+    const char *start;     // at '%'
+    int len;               // include conversion char
+    int mod_off;           // offset of length modifier
+    int star_count;        // '*' width & precision, int args before the value
+    int prec;              // digits, XV_LOG_PREC_NONE or XV_LOG_PREC_STAR
+    int type;
+    char conv;
+} xv_log_spec_t;
+
 static FILE *xv_logger_fp = NULL;
 
 xv_log_level_t xv_curr_log_level = XV_LOG_INFO;
 
+#define XV_LOG_RATE_LIMIT_DEFAULT 100
+// max suppressed reports per flusher round, the flusher's own ring must hold them
+#define XV_LOG_SUPPRESS_REPORT_MAX 64
+
+static int xv_log_rate_limit = XV_LOG_RATE_LIMIT_DEFAULT;
+
+static int xv_log_async_running = 0;
+static xv_log_overflow_policy_t xv_log_overflow_policy = XV_LOG_OVERFLOW_DROP;
+static uint64_t xv_log_ring_size = XV_LOG_RING_DEFAULT_SIZE;
+
+// all rings, owner threads add, flusher & exited owner remove
+static pthread_mutex_t xv_log_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static xv_log_ring_t *xv_log_rings = NULL;
+static pthread_key_t xv_log_ring_key;
+static pthread_once_t xv_log_ring_key_once = PTHREAD_ONCE_INIT;
+static __thread xv_log_ring_t *xv_log_local_ring = NULL;
+
+static pthread_t xv_log_flusher_id;
+static pthread_mutex_t xv_log_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t xv_log_flush_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t xv_log_flush_req = 0;
+static uint64_t xv_log_flush_done = 0;
+static int xv_log_flusher_alive = 0;
+
+// log file change vs flusher write
+static pthread_mutex_t xv_log_fp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// sites with suppressed logs not reported, report them even if the site don't log again
+static pthread_mutex_t xv_log_suppress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static xv_log_site_slot_t *xv_log_suppressed_slots = NULL;
+
+// binary log, sites are written to file before logs reference them
+static int xv_log_binary = 0;
+static FILE *xv_log_binary_fp = NULL;
+static pthread_mutex_t xv_log_site_mutex = PTHREAD_MUTEX_INITIALIZER;
+static xv_log_site_t **xv_log_sites = NULL;
+static int xv_log_site_count = 0;
+static int xv_log_site_capacity = 0;
+static int xv_log_sites_written = 0;
+
 static const char *xv_log_level_str(xv_log_level_t level)
 {
     static const char *level_str[] = {"DEUBG", "INFO", "WARN", "ERROR"};
@@ -43,18 +172,33 @@ static const char *xv_log_level_str(xv_log_level_t level)
     return "UNKNOWN";
 }
 
+// this file use XSI strerror_r, which always fill buf
+const char *xv_strerror(int errnum, char *buf, int len)
+{
+    if (strerror_r(errnum, buf, len) != 0) {
+        snprintf(buf, len, "Unknown error %d", errnum);
+    }
+
+    return buf;
+}
+
 void xv_set_log_file(FILE *pf)
 {
     if (pf) {
+        pthread_mutex_lock(&xv_log_fp_mutex);
         xv_logger_fp = pf;
+        pthread_mutex_unlock(&xv_log_fp_mutex);
     }
 }
 
 static void xv_close_log_file(void)
 {
+    pthread_mutex_lock(&xv_log_fp_mutex);
     if (xv_logger_fp && xv_logger_fp != stderr) {
         fclose(xv_logger_fp);
+        xv_logger_fp = NULL;
     }
+    pthread_mutex_unlock(&xv_log_fp_mutex);
 }
 
 int xv_set_log_filename(const char *filename)
@@ -64,7 +208,7 @@ int xv_set_log_filename(const char *filename)
     if (!fp) {
         return XV_ERR;
     }
-    xv_logger_fp = fp;
+    xv_set_log_file(fp);
 
     // fclose log file when exit
     atexit(xv_close_log_file);
@@ -77,39 +221,1158 @@ void xv_set_log_level(xv_log_level_t level)
     xv_curr_log_level = level;
 }
 
-void xv_log(xv_log_level_t level, const char *file, int line, const char *func, const char *fmt, ...)
+void xv_set_log_rate_limit(int count_per_second)
+{
+    xv_log_rate_limit = count_per_second > 0 ? count_per_second : 0;
+}
+
+static FILE *xv_log_file(void)
+{
+    if (!xv_logger_fp) {
+        xv_logger_fp = stderr;
+    }
+
+    return xv_logger_fp;
+}
+
+// gettid once per thread
+static int xv_log_gettid(void)
+{
+    static __thread int tid = 0;
+    if (tid == 0) {
+        tid = syscall(SYS_gettid);
+    }
+
+    return tid;
+}
+
+// [datetime] level func(file:line) [tid] ...
+static int xv_log_format(char *buf, int size, const struct timeval *tv, xv_log_level_t level,
+        const char *file, int line, const char *func, int tid, const char *msg, int len)
+{
+    // logs of a thread are in time order mostly, so cache the formatted second part,
+    // refresh it only when the second changes
+    static __thread time_t last_sec = -1;
+    static __thread char last_datetime[32];
+
+    if (tv->tv_sec != last_sec) {
+        time_t time_s = tv->tv_sec;
+        struct tm now_tm;
+        localtime_r(&time_s, &now_tm);
+        strftime(last_datetime, sizeof(last_datetime), "%Y-%m-%d %H:%M:%S", &now_tm);
+        last_sec = tv->tv_sec;
+    }
+
+    int n = snprintf(buf, size, "[%s.%06d] %s %s(%s:%d) [%d] %.*s\n", last_datetime, (int)tv->tv_usec,
+            xv_log_level_str(level), func, basename((char *)file), line, tid, len, msg);
+    if (n >= size) {
+        // truncated, keep the line end
+        n = size - 1;
+        buf[n - 1] = '\n';
+    }
+
+    return n;
+}
+
+// ----------------------------------------------------------------------------------------
+// binary log format & call site
+// ----------------------------------------------------------------------------------------
+
+// find next conversion from p, return XV_AGAIN at the end, XV_ERR if not supported,
+// such as "%n", "%m", "%1$d", wide char & string
+static int xv_log_next_spec(const char *p, xv_log_spec_t *spec)
+{
+    while (*p && *p != '%') {
+        ++p;
+    }
+    if (!*p) {
+        spec->start = p;
+        return XV_AGAIN;
+    }
+
+    const char *q = p + 1;
+    spec->start = p;
+    spec->star_count = 0;
+    spec->prec = XV_LOG_PREC_NONE;
+    if (*q == '%') {
+        spec->len = 2;
+        spec->mod_off = 1;
+        spec->type = XV_LOG_ARG_NONE;
+        spec->conv = '%';
+        return XV_OK;
+    }
+
+    // flags, width, precision
+    while (*q && strchr("-+ #0'", *q)) {
+        ++q;
+    }
+    if (*q == '*') {
+        ++spec->star_count;
+        ++q;
+    } else {
+        while (*q >= '0' && *q <= '9') {
+            ++q;
+        }
+    }
+    if (*q == '.') {
+        ++q;
+        if (*q == '*') {
+            ++spec->star_count;
+            spec->prec = XV_LOG_PREC_STAR;
+            ++q;
+        } else {
+            spec->prec = 0;
+            while (*q >= '0' && *q <= '9') {
+                if (spec->prec < XV_LOG_LINE_MAX) {
+                    spec->prec = spec->prec * 10 + (*q - '0');
+                }
+                ++q;
+            }
+        }
+    }
+
+    // length modifier
+    spec->mod_off = q - p;
+    char mod = 0;
+    if (*q == 'h' || *q == 'l') {
+        mod = *q++;
+        if (*q == mod) {
+            mod = (mod == 'l') ? 'q' : 'H';
+            ++q;
+        }
+    } else if (*q && strchr("Lqjzt", *q)) {
+        mod = *q++;
+    }
+
+    spec->conv = *q;
+    spec->len = q + 1 - p;
+    switch (*q) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        switch (mod) {
+        case 0: case 'h': case 'H': spec->type = XV_LOG_ARG_INT; break;
+        case 'l': spec->type = XV_LOG_ARG_LONG; break;
+        case 'q': spec->type = XV_LOG_ARG_LLONG; break;
+        case 'j': spec->type = XV_LOG_ARG_INTMAX; break;
+        case 'z': spec->type = XV_LOG_ARG_SIZE; break;
+        case 't': spec->type = XV_LOG_ARG_PTRDIFF; break;
+        default: return XV_ERR;
+        }
+        return XV_OK;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        if (mod == 'L') {
+            spec->type = XV_LOG_ARG_LDOUBLE;
+        } else if (mod == 0 || mod == 'l') {
+            spec->type = XV_LOG_ARG_DOUBLE;
+        } else {
+            return XV_ERR;
+        }
+        return XV_OK;
+    case 'c':
+        spec->type = XV_LOG_ARG_INT;
+        return mod == 0 ? XV_OK : XV_ERR;
+    case 's':
+        spec->type = XV_LOG_ARG_STR;
+        return mod == 0 ? XV_OK : XV_ERR;
+    case 'p':
+        spec->type = XV_LOG_ARG_PTR;
+        return mod == 0 ? XV_OK : XV_ERR;
+    default:
+        return XV_ERR;
+    }
+}
+
+static int xv_log_parse_format(xv_log_site_t *site)
+{
+    xv_log_spec_t spec;
+    const char *p = site->fmt;
+    int ret;
+
+    site->arg_count = 0;
+    while ((ret = xv_log_next_spec(p, &spec)) == XV_OK) {
+        if (site->arg_count + spec.star_count + 1 > XV_LOG_SITE_MAX_ARGS) {
+            return XV_ERR;
+        }
+        for (int i = 0; i < spec.star_count; ++i) {
+            site->precs[site->arg_count] = XV_LOG_PREC_NONE;
+            site->args[site->arg_count++] = XV_LOG_ARG_INT;
+        }
+        if (spec.type != XV_LOG_ARG_NONE) {
+            site->precs[site->arg_count] = spec.prec;
+            site->args[site->arg_count++] = spec.type;
+        }
+        p = spec.start + spec.len;
+    }
+
+    return ret == XV_AGAIN ? XV_OK : XV_ERR;
+}
+
+static xv_log_site_t *xv_log_site_register(xv_log_site_slot_t *slot, xv_log_level_t level, const char *file, int line,
+        const char *func, const char *fmt)
+{
+    pthread_mutex_lock(&xv_log_site_mutex);
+    xv_log_site_t *site = (xv_log_site_t *)slot->site;
+    if (site) {
+        pthread_mutex_unlock(&xv_log_site_mutex);
+        return site;
+    }
+
+    if (xv_log_site_count == xv_log_site_capacity) {
+        int capacity = xv_log_site_capacity ? xv_log_site_capacity * 2 : 256;
+        xv_log_site_t **sites = (xv_log_site_t **)xv_realloc(xv_log_sites, capacity * sizeof(xv_log_site_t *));
+        if (!sites) {
+            pthread_mutex_unlock(&xv_log_site_mutex);
+            return NULL;
+        }
+        xv_log_sites = sites;
+        xv_log_site_capacity = capacity;
+    }
+
+    site = (xv_log_site_t *)xv_malloc(sizeof(xv_log_site_t));
+    if (!site) {
+        pthread_mutex_unlock(&xv_log_site_mutex);
+        return NULL;
+    }
+    site->id = xv_log_site_count;
+    site->level = level;
+    site->line = line;
+    site->file = file;
+    site->func = func;
+    site->fmt = fmt;
+    site->raw_text = (xv_log_parse_format(site) != XV_OK);
+    xv_log_sites[xv_log_site_count++] = site;
+
+    __atomic_store_n(&slot->site, site, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&xv_log_site_mutex);
+
+    return site;
+}
+
+#define XV_LOG_PUT_ARG(type, value) do {\
+    type v = (value);\
+    if (off + (int)sizeof(v) > size) {\
+        return off;\
+    }\
+    memcpy(buf + off, &v, sizeof(v));\
+    off += sizeof(v);\
+} while(0)
+
+// copy raw args, strings are copied too as they may not live until flush,
+// stop at the first arg which not fit, decoder print it truncated
+static int xv_log_encode_args(xv_log_site_t *site, char *buf, int size, va_list ap)
+{
+    int off = 0;
+    int last_int = 0;
+
+    for (int i = 0; i < site->arg_count; ++i) {
+        switch (site->args[i]) {
+        case XV_LOG_ARG_INT: last_int = va_arg(ap, int); XV_LOG_PUT_ARG(int, last_int); break;
+        case XV_LOG_ARG_LONG: XV_LOG_PUT_ARG(int64_t, va_arg(ap, long)); break;
+        case XV_LOG_ARG_LLONG: XV_LOG_PUT_ARG(int64_t, va_arg(ap, long long)); break;
+        case XV_LOG_ARG_INTMAX: XV_LOG_PUT_ARG(int64_t, va_arg(ap, intmax_t)); break;
+        case XV_LOG_ARG_SIZE: XV_LOG_PUT_ARG(int64_t, va_arg(ap, size_t)); break;
+        case XV_LOG_ARG_PTRDIFF: XV_LOG_PUT_ARG(int64_t, va_arg(ap, ptrdiff_t)); break;
+        case XV_LOG_ARG_PTR: XV_LOG_PUT_ARG(int64_t, (uintptr_t)va_arg(ap, void *)); break;
+        case XV_LOG_ARG_DOUBLE: XV_LOG_PUT_ARG(double, va_arg(ap, double)); break;
+        case XV_LOG_ARG_LDOUBLE: XV_LOG_PUT_ARG(long double, va_arg(ap, long double)); break;
+        case XV_LOG_ARG_STR: {
+            const char *str = va_arg(ap, const char *);
+            if (!str) {
+                str = "(null)";
+            }
+            // negative '*' precision is taken as omitted
+            int prec = site->precs[i] == XV_LOG_PREC_STAR ? last_int : site->precs[i];
+            uint32_t len = prec >= 0 ? strnlen(str, prec) : strlen(str);
+            if (off + (int)sizeof(len) > size) {
+                return off;
+            }
+            if (len > size - off - sizeof(len)) {
+                len = size - off - sizeof(len);
+            }
+            memcpy(buf + off, &len, sizeof(len));
+            memcpy(buf + off + sizeof(len), str, len);
+            off += sizeof(len) + len;
+            break;
+        }
+        }
+    }
+
+    return off;
+}
+
+// ----------------------------------------------------------------------------------------
+// async log
+// ----------------------------------------------------------------------------------------
+
+static void xv_log_ring_free(xv_log_ring_t *ring)
+{
+    xv_free(ring->buf);
+    xv_free(ring);
+}
+
+// owner thread exit, flusher free the ring after drained
+static void xv_log_ring_release(void *arg)
+{
+    xv_log_ring_t *ring = (xv_log_ring_t *)arg;
+
+    pthread_mutex_lock(&xv_log_ring_mutex);
+    if (xv_log_flusher_alive) {
+        ring->dead = 1;
+    } else {
+        xv_log_ring_t **pp = &xv_log_rings;
+        while (*pp != ring) {
+            pp = &(*pp)->next;
+        }
+        *pp = ring->next;
+        xv_log_ring_free(ring);
+    }
+    pthread_mutex_unlock(&xv_log_ring_mutex);
+
+    xv_log_local_ring = NULL;
+}
+
+static void xv_log_ring_key_create(void)
+{
+    pthread_key_create(&xv_log_ring_key, xv_log_ring_release);
+}
+
+static xv_log_ring_t *xv_log_get_ring(void)
+{
+    if (xv_log_local_ring) {
+        return xv_log_local_ring;
+    }
+
+    pthread_once(&xv_log_ring_key_once, xv_log_ring_key_create);
+
+    xv_log_ring_t *ring = (xv_log_ring_t *)xv_malloc(sizeof(xv_log_ring_t));
+    if (!ring) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(xv_log_ring_t));
+    ring->size = xv_log_ring_size;
+    ring->buf = (char *)xv_malloc(ring->size);
+    if (!ring->buf) {
+        xv_free(ring);
+        return NULL;
+    }
+    ring->tid = xv_log_gettid();
+
+    pthread_mutex_lock(&xv_log_ring_mutex);
+    ring->next = xv_log_rings;
+    xv_log_rings = ring;
+    pthread_mutex_unlock(&xv_log_ring_mutex);
+
+    pthread_setspecific(xv_log_ring_key, ring);
+    xv_log_local_ring = ring;
+
+    return ring;
+}
+
+static int xv_log_ring_push(xv_log_ring_t *ring, int level, const char *file, int line,
+        const char *func, const struct timeval *tv, const char *msg, int len)
+{
+    uint32_t size = XV_LOG_ALIGN(sizeof(xv_log_record_t) + len);
+
+    while (1) {
+        uint64_t head = ring->head;
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint64_t pos = head & (ring->size - 1);
+        uint64_t contig = ring->size - pos;
+        uint64_t need = size + (contig < size ? contig : 0);
+
+        if (head + need - tail <= ring->size) {
+            // record never wraps, pad the ring end
+            if (contig < size) {
+                xv_log_record_t *pad = (xv_log_record_t *)(ring->buf + pos);
+                pad->size = contig;
+                pad->level = XV_LOG_RECORD_PAD;
+                head += contig;
+                pos = 0;
+            }
+            xv_log_record_t *record = (xv_log_record_t *)(ring->buf + pos);
+            record->size = size;
+            record->level = level;
+            record->line = line;
+            record->len = len;
+            record->file = file;
+            record->func = func;
+            record->tv = *tv;
+            memcpy(record + 1, msg, len);
+
+            __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+            return XV_OK;
+        }
+
+        if (xv_log_overflow_policy == XV_LOG_OVERFLOW_DROP
+                || !__atomic_load_n(&xv_log_async_running, __ATOMIC_ACQUIRE)) {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return XV_ERR;
+        }
+        usleep(100);
+    }
+}
+
+typedef struct xv_log_batch_t {
+    char buf[XV_LOG_BATCH_SIZE];
+    int len;
+} xv_log_batch_t;
+
+static void xv_log_write_site(FILE *fp, xv_log_site_t *site)
+{
+    unsigned char type = XV_LOG_ENTRY_SITE;
+    int32_t head[4] = {site->id, site->level, site->line, site->raw_text};
+    fwrite(&type, 1, sizeof(type), fp);
+    fwrite(head, 1, sizeof(head), fp);
+
+    const char *strs[3] = {site->file, site->func, site->fmt};
+    for (int i = 0; i < 3; ++i) {
+        uint32_t len = strlen(strs[i]);
+        fwrite(&len, 1, sizeof(len), fp);
+        fwrite(strs[i], 1, len, fp);
+    }
+}
+
+static void xv_log_batch_write(xv_log_batch_t *batch)
+{
+    if (batch->len > 0) {
+        pthread_mutex_lock(&xv_log_fp_mutex);
+        FILE *fp = xv_log_binary ? xv_log_binary_fp : xv_log_file();
+        if (xv_log_binary) {
+            // sites of logs in batch are registered before the logs pushed
+            pthread_mutex_lock(&xv_log_site_mutex);
+            while (xv_log_sites_written < xv_log_site_count) {
+                xv_log_write_site(fp, xv_log_sites[xv_log_sites_written++]);
+            }
+            pthread_mutex_unlock(&xv_log_site_mutex);
+        }
+        fwrite(batch->buf, 1, batch->len, fp);
+        fflush(fp);
+        pthread_mutex_unlock(&xv_log_fp_mutex);
+        batch->len = 0;
+    }
+}
+
+static void xv_log_batch_put(xv_log_batch_t *batch, const void *data, int len)
+{
+    memcpy(batch->buf + batch->len, data, len);
+    batch->len += len;
+}
+
+static void xv_log_batch_append(xv_log_batch_t *batch, const struct timeval *tv, xv_log_level_t level,
+        const char *file, int line, const char *func, int tid, const char *msg, int len)
+{
+    if (XV_LOG_BATCH_SIZE - batch->len < XV_LOG_LINE_MAX * 3) {
+        xv_log_batch_write(batch);
+    }
+
+    if (!xv_log_binary) {
+        batch->len += xv_log_format(batch->buf + batch->len, XV_LOG_BATCH_SIZE - batch->len,
+                tv, level, file, line, func, tid, msg, len);
+        return;
+    }
+
+    // formatted line in binary log
+    unsigned char type = XV_LOG_ENTRY_TEXT;
+    xv_log_batch_put(batch, &type, sizeof(type));
+    uint32_t n = 0;
+    int n_off = batch->len;
+    batch->len += sizeof(n);
+    n = xv_log_format(batch->buf + batch->len, XV_LOG_LINE_MAX * 2, tv, level, file, line, func, tid, msg, len);
+    memcpy(batch->buf + n_off, &n, sizeof(n));
+    batch->len += n;
+}
+
+static void xv_log_batch_append_binary(xv_log_batch_t *batch, xv_log_record_t *record, int tid)
+{
+    if (XV_LOG_BATCH_SIZE - batch->len < XV_LOG_LINE_MAX * 3) {
+        xv_log_batch_write(batch);
+    }
+
+    unsigned char type = XV_LOG_ENTRY_LOG;
+    int32_t head[2] = {record->line, tid};
+    int64_t sec = record->tv.tv_sec;
+    int32_t usec = record->tv.tv_usec;
+    uint32_t len = record->len;
+    xv_log_batch_put(batch, &type, sizeof(type));
+    xv_log_batch_put(batch, head, sizeof(head));
+    xv_log_batch_put(batch, &sec, sizeof(sec));
+    xv_log_batch_put(batch, &usec, sizeof(usec));
+    xv_log_batch_put(batch, &len, sizeof(len));
+    xv_log_batch_put(batch, record + 1, len);
+}
+
+// return count of records written
+static int xv_log_ring_drain(xv_log_ring_t *ring, xv_log_batch_t *batch)
+{
+    int count = 0;
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        xv_log_record_t *record = (xv_log_record_t *)(ring->buf + (tail & (ring->size - 1)));
+        if (record->level == XV_LOG_RECORD_BINARY) {
+            xv_log_batch_append_binary(batch, record, ring->tid);
+            ++count;
+        } else if (record->level != XV_LOG_RECORD_PAD) {
+            xv_log_batch_append(batch, &record->tv, record->level, record->file, record->line,
+                    record->func, ring->tid, (const char *)(record + 1), record->len);
+            ++count;
+        }
+        tail += record->size;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->reported) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "%lu logs dropped, ring full", (unsigned long)(dropped - ring->reported));
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        xv_log_batch_append(batch, &tv, XV_LOG_WARNING, __FILE__, __LINE__, __FUNCTION__, ring->tid, msg, len);
+        ring->reported = dropped;
+    }
+
+    return count;
+}
+
+static int xv_log_drain_all(xv_log_batch_t *batch)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&xv_log_ring_mutex);
+    xv_log_ring_t **pp = &xv_log_rings;
+    while (*pp) {
+        xv_log_ring_t *ring = *pp;
+        count += xv_log_ring_drain(ring, batch);
+        if (ring->dead) {
+            *pp = ring->next;
+            xv_log_ring_free(ring);
+        } else {
+            pp = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&xv_log_ring_mutex);
+
+    xv_log_batch_write(batch);
+
+    return count;
+}
+
+static void xv_log_report_suppressed(int all, int max);
+
+static void *xv_log_flusher_fun(void *arg)
+{
+    xv_log_batch_t *batch = (xv_log_batch_t *)arg;
+
+    while (1) {
+        // logs pushed before these reads are written by this round
+        int running = __atomic_load_n(&xv_log_async_running, __ATOMIC_ACQUIRE);
+        pthread_mutex_lock(&xv_log_flush_mutex);
+        uint64_t req = xv_log_flush_req;
+        pthread_mutex_unlock(&xv_log_flush_mutex);
+
+        // silent sites' suppressed count of last windows
+        xv_log_report_suppressed(0, XV_LOG_SUPPRESS_REPORT_MAX);
+        int count = xv_log_drain_all(batch);
+
+        pthread_mutex_lock(&xv_log_flush_mutex);
+        if (xv_log_flush_done != req) {
+            xv_log_flush_done = req;
+            pthread_cond_broadcast(&xv_log_flush_cond);
+        }
+        pthread_mutex_unlock(&xv_log_flush_mutex);
+
+        if (!running) {
+            break;
+        }
+        if (count == 0) {
+            usleep(1000);
+        }
+    }
+
+    pthread_mutex_lock(&xv_log_ring_mutex);
+    pthread_mutex_lock(&xv_log_flush_mutex);
+    xv_log_flusher_alive = 0;
+    pthread_cond_broadcast(&xv_log_flush_cond);
+    pthread_mutex_unlock(&xv_log_flush_mutex);
+    pthread_mutex_unlock(&xv_log_ring_mutex);
+
+    xv_free(batch);
+
+    return NULL;
+}
+
+int xv_log_async_start(int ring_size, xv_log_overflow_policy_t policy)
+{
+    static int atexit_registered = 0;
+
+    if (__atomic_load_n(&xv_log_async_running, __ATOMIC_ACQUIRE) || xv_log_flusher_alive) {
+        return XV_ERR;
+    }
+
+    uint64_t size = XV_LOG_RING_DEFAULT_SIZE;
+    if (ring_size > 0) {
+        size = XV_LOG_RING_MIN_SIZE;
+        while (size < (uint64_t)ring_size) {
+            size <<= 1;
+        }
+    }
+    xv_log_ring_size = size;
+    xv_log_overflow_policy = policy;
+
+    xv_log_batch_t *batch = (xv_log_batch_t *)xv_malloc(sizeof(xv_log_batch_t));
+    if (!batch) {
+        return XV_ERR;
+    }
+    batch->len = 0;
+
+    pthread_mutex_lock(&xv_log_ring_mutex);
+    xv_log_flusher_alive = 1;
+    pthread_mutex_unlock(&xv_log_ring_mutex);
+    __atomic_store_n(&xv_log_async_running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&xv_log_flusher_id, NULL, xv_log_flusher_fun, batch) != 0) {
+        __atomic_store_n(&xv_log_async_running, 0, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&xv_log_ring_mutex);
+        xv_log_flusher_alive = 0;
+        pthread_mutex_unlock(&xv_log_ring_mutex);
+        xv_free(batch);
+        return XV_ERR;
+    }
+
+    // write remain logs when exit
+    if (!atexit_registered) {
+        atexit_registered = 1;
+        atexit(xv_log_async_stop);
+    }
+
+    return XV_OK;
+}
+
+int xv_log_binary_start(const char *filename, int ring_size, xv_log_overflow_policy_t policy)
+{
+    if (__atomic_load_n(&xv_log_async_running, __ATOMIC_ACQUIRE) || xv_log_flusher_alive) {
+        return XV_ERR;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        return XV_ERR;
+    }
+    uint32_t version = XV_LOG_BINARY_VERSION;
+    fwrite(XV_LOG_BINARY_MAGIC, 1, strlen(XV_LOG_BINARY_MAGIC), fp);
+    fwrite(&version, 1, sizeof(version), fp);
+
+    // a new file, write all sites again
+    pthread_mutex_lock(&xv_log_site_mutex);
+    xv_log_sites_written = 0;
+    pthread_mutex_unlock(&xv_log_site_mutex);
+
+    xv_log_binary_fp = fp;
+    xv_log_binary = 1;
+    if (xv_log_async_start(ring_size, policy) != XV_OK) {
+        xv_log_binary = 0;
+        xv_log_binary_fp = NULL;
+        fclose(fp);
+        return XV_ERR;
+    }
+
+    return XV_OK;
+}
+
+void xv_log_async_stop(void)
+{
+    if (!__atomic_exchange_n(&xv_log_async_running, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    pthread_join(xv_log_flusher_id, NULL);
+
+    if (xv_log_binary) {
+        pthread_mutex_lock(&xv_log_fp_mutex);
+        xv_log_binary = 0;
+        fclose(xv_log_binary_fp);
+        xv_log_binary_fp = NULL;
+        pthread_mutex_unlock(&xv_log_fp_mutex);
+    }
+}
+
+void xv_log_flush(void)
+{
+    xv_log_report_suppressed(1, INT_MAX);
+
+    pthread_mutex_lock(&xv_log_flush_mutex);
+    if (xv_log_flusher_alive) {
+        uint64_t req = ++xv_log_flush_req;
+        while (xv_log_flush_done < req && xv_log_flusher_alive) {
+            pthread_cond_wait(&xv_log_flush_cond, &xv_log_flush_mutex);
+        }
+    }
+    pthread_mutex_unlock(&xv_log_flush_mutex);
+
+    pthread_mutex_lock(&xv_log_fp_mutex);
+    fflush(xv_log_file());
+    pthread_mutex_unlock(&xv_log_fp_mutex);
+}
+
+// ----------------------------------------------------------------------------------------
+// binary log decode
+// ----------------------------------------------------------------------------------------
+
+#define XV_LOG_GET_ARG(type, var) do {\
+    if (pos + (int)sizeof(type) > args_len) {\
+        goto truncated;\
+    }\
+    memcpy(&var, args + pos, sizeof(type));\
+    pos += sizeof(type);\
+} while(0)
+
+#define XV_LOG_SPRINTF(value) do {\
+    int n;\
+    if (spec.star_count == 0) {\
+        n = snprintf(buf + off, size - off, conv, value);\
+    } else if (spec.star_count == 1) {\
+        n = snprintf(buf + off, size - off, conv, stars[0], value);\
+    } else {\
+        n = snprintf(buf + off, size - off, conv, stars[0], stars[1], value);\
+    }\
+    off += (n < size - off) ? n : size - off - 1;\
+} while(0)
+
+static int xv_log_append(char *buf, int size, int off, const char *data, int len)
+{
+    if (len > size - off - 1) {
+        len = size - off - 1;
+    }
+    memcpy(buf + off, data, len);
+
+    return off + len;
+}
+
+// rebuild message by the site format & raw args
+static int xv_log_decode_args(xv_log_site_t *site, const char *args, int args_len, char *buf, int size)
+{
+    int off = 0;
+    int pos = 0;
+
+    if (site->raw_text) {
+        off = xv_log_append(buf, size, off, args, args_len);
+        buf[off] = '\0';
+        return off;
+    }
+
+    const char *p = site->fmt;
+    xv_log_spec_t spec;
+    while (1) {
+        int ret = xv_log_next_spec(p, &spec);
+        off = xv_log_append(buf, size, off, p, spec.start - p);
+        if (ret != XV_OK) {
+            break;
+        }
+        p = spec.start + spec.len;
+        if (spec.type == XV_LOG_ARG_NONE) {
+            off = xv_log_append(buf, size, off, "%", 1);
+            continue;
+        }
+
+        int stars[2] = {0, 0};
+        for (int i = 0; i < spec.star_count; ++i) {
+            XV_LOG_GET_ARG(int, stars[i]);
+        }
+
+        // all 8 bytes integers print as long long
+        char conv[64];
+        int mod_off = spec.mod_off < 48 ? spec.mod_off : 48;
+        memcpy(conv, spec.start, mod_off);
+        const char *mod = "";
+        if (spec.type >= XV_LOG_ARG_LONG && spec.type <= XV_LOG_ARG_PTRDIFF) {
+            mod = "ll";
+        } else if (spec.type == XV_LOG_ARG_LDOUBLE) {
+            mod = "L";
+        }
+        snprintf(conv + mod_off, sizeof(conv) - mod_off, "%s%c", mod, spec.conv);
+
+        switch (spec.type) {
+        case XV_LOG_ARG_INT: {
+            int v;
+            XV_LOG_GET_ARG(int, v);
+            XV_LOG_SPRINTF(v);
+            break;
+        }
+        case XV_LOG_ARG_PTR: {
+            int64_t v;
+            XV_LOG_GET_ARG(int64_t, v);
+            XV_LOG_SPRINTF((void *)(uintptr_t)v);
+            break;
+        }
+        case XV_LOG_ARG_DOUBLE: {
+            double v;
+            XV_LOG_GET_ARG(double, v);
+            XV_LOG_SPRINTF(v);
+            break;
+        }
+        case XV_LOG_ARG_LDOUBLE: {
+            long double v;
+            XV_LOG_GET_ARG(long double, v);
+            XV_LOG_SPRINTF(v);
+            break;
+        }
+        case XV_LOG_ARG_STR: {
+            uint32_t len;
+            char str[XV_LOG_LINE_MAX + 1];
+            XV_LOG_GET_ARG(uint32_t, len);
+            if (len > (uint32_t)(args_len - pos) || len > XV_LOG_LINE_MAX) {
+                goto truncated;
+            }
+            memcpy(str, args + pos, len);
+            str[len] = '\0';
+            pos += len;
+            XV_LOG_SPRINTF(str);
+            break;
+        }
+        default: {
+            long long v;
+            XV_LOG_GET_ARG(int64_t, v);
+            XV_LOG_SPRINTF(v);
+            break;
+        }
+        }
+    }
+    buf[off] = '\0';
+
+    return off;
+
+truncated:
+    off = xv_log_append(buf, size, off, "<truncated>", strlen("<truncated>"));
+    buf[off] = '\0';
+
+    return off;
+}
+
+static int xv_log_read_str(FILE *in, const char **str)
+{
+    uint32_t len;
+    if (fread(&len, sizeof(len), 1, in) != 1 || len > 64 * 1024) {
+        return XV_ERR;
+    }
+    char *s = (char *)xv_malloc(len + 1);
+    if (!s) {
+        return XV_ERR;
+    }
+    if (len > 0 && fread(s, len, 1, in) != 1) {
+        xv_free(s);
+        return XV_ERR;
+    }
+    s[len] = '\0';
+    *str = s;
+
+    return XV_OK;
+}
+
+static void xv_log_decode_site_free(xv_log_site_t *site)
+{
+    if (site) {
+        xv_free((char *)site->file);
+        xv_free((char *)site->func);
+        xv_free((char *)site->fmt);
+        xv_free(site);
+    }
+}
+
+static xv_log_site_t *xv_log_decode_site(FILE *in)
+{
+    int32_t head[4];
+    if (fread(head, sizeof(head), 1, in) != 1 || head[0] < 0) {
+        return NULL;
+    }
+
+    xv_log_site_t *site = (xv_log_site_t *)xv_malloc(sizeof(xv_log_site_t));
+    if (!site) {
+        return NULL;
+    }
+    memset(site, 0, sizeof(xv_log_site_t));
+    site->id = head[0];
+    site->level = head[1];
+    site->line = head[2];
+    site->raw_text = head[3];
+    if (xv_log_read_str(in, &site->file) != XV_OK || xv_log_read_str(in, &site->func) != XV_OK
+            || xv_log_read_str(in, &site->fmt) != XV_OK) {
+        xv_log_decode_site_free(site);
+        return NULL;
+    }
+    if (!site->raw_text && xv_log_parse_format(site) != XV_OK) {
+        site->raw_text = 1;
+    }
+
+    return site;
+}
+
+int xv_log_binary_decode(FILE *in, FILE *out)
+{
+    char magic[8];
+    uint32_t version;
+    if (fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, XV_LOG_BINARY_MAGIC, sizeof(magic)) != 0
+            || fread(&version, sizeof(version), 1, in) != 1 || version != XV_LOG_BINARY_VERSION) {
+        return XV_ERR;
+    }
+
+    int ret = XV_OK;
+    int site_count = 0;
+    xv_log_site_t **sites = NULL;
+    char args[XV_LOG_LINE_MAX * 2];
+    char msg[XV_LOG_LINE_MAX];
+    char line[XV_LOG_LINE_MAX * 2];
+
+    unsigned char type;
+    while (ret == XV_OK && fread(&type, sizeof(type), 1, in) == 1) {
+        if (type == XV_LOG_ENTRY_SITE) {
+            xv_log_site_t *site = xv_log_decode_site(in);
+            if (!site) {
+                ret = XV_ERR;
+                break;
+            }
+            if (site->id >= site_count) {
+                int count = site->id + 1;
+                xv_log_site_t **new_sites = (xv_log_site_t **)xv_realloc(sites, count * sizeof(xv_log_site_t *));
+                if (!new_sites) {
+                    xv_log_decode_site_free(site);
+                    ret = XV_ERR;
+                    break;
+                }
+                memset(new_sites + site_count, 0, (count - site_count) * sizeof(xv_log_site_t *));
+                sites = new_sites;
+                site_count = count;
+            }
+            xv_log_decode_site_free(sites[site->id]);
+            sites[site->id] = site;
+        } else if (type == XV_LOG_ENTRY_LOG) {
+            int32_t head[2];
+            int64_t sec;
+            int32_t usec;
+            uint32_t len;
+            if (fread(head, sizeof(head), 1, in) != 1 || fread(&sec, sizeof(sec), 1, in) != 1
+                    || fread(&usec, sizeof(usec), 1, in) != 1 || fread(&len, sizeof(len), 1, in) != 1
+                    || len > sizeof(args) || (len > 0 && fread(args, len, 1, in) != 1)
+                    || head[0] < 0 || head[0] >= site_count || !sites[head[0]]) {
+                ret = XV_ERR;
+                break;
+            }
+            xv_log_site_t *site = sites[head[0]];
+            struct timeval tv;
+            tv.tv_sec = sec;
+            tv.tv_usec = usec;
+            int msg_len = xv_log_decode_args(site, args, len, msg, sizeof(msg));
+            int n = xv_log_format(line, sizeof(line), &tv, site->level, site->file, site->line,
+                    site->func, head[1], msg, msg_len);
+            fwrite(line, 1, n, out);
+        } else if (type == XV_LOG_ENTRY_TEXT) {
+            uint32_t len;
+            if (fread(&len, sizeof(len), 1, in) != 1 || len > sizeof(line)
+                    || (len > 0 && fread(line, len, 1, in) != 1)) {
+                ret = XV_ERR;
+                break;
+            }
+            fwrite(line, 1, len, out);
+        } else {
+            ret = XV_ERR;
+        }
+    }
+
+    for (int i = 0; i < site_count; ++i) {
+        xv_log_decode_site_free(sites[i]);
+    }
+    xv_free(sites);
+
+    return ret;
+}
+
+// ----------------------------------------------------------------------------------------
+// log entry
+// ----------------------------------------------------------------------------------------
+
+static void xv_log_report_suppressed_at_exit(void)
+{
+    xv_log_report_suppressed(1, INT_MAX);
+}
+
+static void xv_log_site_add_suppressed(xv_log_site_slot_t *slot, xv_log_level_t level, const char *file, int line,
+        const char *func)
+{
+    static int atexit_registered = 0;
+
+    pthread_mutex_lock(&xv_log_suppress_mutex);
+    if (!slot->listed) {
+        slot->level = level;
+        slot->file = file;
+        slot->line = line;
+        slot->func = func;
+        slot->listed = 1;
+        slot->next = xv_log_suppressed_slots;
+        __atomic_store_n(&xv_log_suppressed_slots, slot, __ATOMIC_RELAXED);
+    }
+    if (!atexit_registered) {
+        atexit_registered = 1;
+        atexit(xv_log_report_suppressed_at_exit);
+    }
+    pthread_mutex_unlock(&xv_log_suppress_mutex);
+}
+
+// report suppressed count of listed sites, only whose window passed unless `all`,
+// log out of the lock, slots stay `listed` meanwhile and relink if suppressed again
+static void xv_log_report_suppressed(int all, int max)
+{
+    if (!__atomic_load_n(&xv_log_suppressed_slots, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    xv_log_site_slot_t *reports = NULL;
+    pthread_mutex_lock(&xv_log_suppress_mutex);
+    xv_log_site_slot_t **pp = &xv_log_suppressed_slots;
+    while (*pp && max > 0) {
+        xv_log_site_slot_t *slot = *pp;
+        if (!all && __atomic_load_n(&slot->window, __ATOMIC_RELAXED) == ts.tv_sec) {
+            pp = &slot->next;
+            continue;
+        }
+        *pp = slot->next;
+        slot->next = reports;
+        reports = slot;
+        --max;
+    }
+    pthread_mutex_unlock(&xv_log_suppress_mutex);
+
+    while (reports) {
+        xv_log_site_slot_t *slot = reports;
+        reports = slot->next;
+        int suppressed = __atomic_exchange_n(&slot->suppressed, 0, __ATOMIC_RELAXED);
+        if (suppressed > 0) {
+            xv_log(slot->level, slot->file, slot->line, slot->func, "suppressed %d messages", suppressed);
+        }
+
+        pthread_mutex_lock(&xv_log_suppress_mutex);
+        if (__atomic_load_n(&slot->suppressed, __ATOMIC_RELAXED) > 0) {
+            slot->next = xv_log_suppressed_slots;
+            __atomic_store_n(&xv_log_suppressed_slots, slot, __ATOMIC_RELAXED);
+        } else {
+            slot->listed = 0;
+        }
+        pthread_mutex_unlock(&xv_log_suppress_mutex);
+    }
+}
+
+// fixed one second window per call site, approximate under races which is fine for logs
+static int xv_log_site_allow(xv_log_site_slot_t *slot, xv_log_level_t level, const char *file, int line,
+        const char *func, int *suppressed)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    long window = __atomic_load_n(&slot->window, __ATOMIC_RELAXED);
+    if (ts.tv_sec != window
+            && __atomic_compare_exchange_n(&slot->window, &window, ts.tv_sec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&slot->count, 0, __ATOMIC_RELAXED);
+        *suppressed = __atomic_exchange_n(&slot->suppressed, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED) > xv_log_rate_limit) {
+        if (__atomic_add_fetch(&slot->suppressed, 1, __ATOMIC_RELAXED) == 1) {
+            xv_log_site_add_suppressed(slot, level, file, line, func);
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+static void xv_logv(xv_log_level_t level, const char *file, int line, const char *func, const char *fmt, va_list ap)
 {
     char logger_buf[XV_LOG_LINE_MAX];
 
+    int len = vsnprintf(logger_buf, sizeof(logger_buf), fmt, ap);
+    if (len < 0) {
+        return;
+    }
+    if (len >= (int)sizeof(logger_buf)) {
+        len = sizeof(logger_buf) - 1;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    // async, format & write by flusher
+    if (__atomic_load_n(&xv_log_async_running, __ATOMIC_ACQUIRE)) {
+        xv_log_ring_t *ring = xv_log_get_ring();
+        if (ring) {
+            xv_log_ring_push(ring, level, file, line, func, &tv, logger_buf, len);
+            return;
+        }
+    }
+
+    char line_buf[XV_LOG_LINE_MAX * 2];
+    int n = xv_log_format(line_buf, sizeof(line_buf), &tv, level, file, line, func,
+            xv_log_gettid(), logger_buf, len);
+
+    fwrite(line_buf, 1, n, xv_log_file());
+}
+
+void xv_log(xv_log_level_t level, const char *file, int line, const char *func, const char *fmt, ...)
+{
     // level filter
     if (level < xv_curr_log_level) {
         return;
     }
-    
+
     va_list ap;
     va_start(ap, fmt);
-    vsnprintf(logger_buf, sizeof(logger_buf), fmt, ap);
+    xv_logv(level, file, line, func, fmt, ap);
     va_end(ap);
+}
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-
-    time_t time_s = tv.tv_sec;
-    struct tm now_tm;
-    localtime_r(&time_s, &now_tm);
+void xv_log_site(xv_log_site_slot_t *slot, xv_log_level_t level, const char *file, int line, const char *func, const char *fmt, ...)
+{
+    // level is filtered by the macro
+    if (level >= XV_LOG_WARNING && xv_log_rate_limit > 0) {
+        int suppressed = 0;
+        if (!xv_log_site_allow(slot, level, file, line, func, &suppressed)) {
+            return;
+        }
+        if (suppressed > 0) {
+            xv_log(level, file, line, func, "suppressed %d messages", suppressed);
+        }
+    }
 
-    char datetime[64];
-    int off = strftime(datetime, sizeof(datetime), "%Y-%m-%d %H:%M:%S.", &now_tm);
-    snprintf(datetime + off, sizeof(datetime) - off, "%06d", (int)tv.tv_usec);
+    va_list ap;
+    va_start(ap, fmt);
 
-    int tid = syscall(SYS_gettid);
+    // binary, no format here
+    if (xv_log_binary && __atomic_load_n(&xv_log_async_running, __ATOMIC_ACQUIRE)) {
+        xv_log_site_t *site = (xv_log_site_t *)__atomic_load_n(&slot->site, __ATOMIC_ACQUIRE);
+        if (!site) {
+            site = xv_log_site_register(slot, level, file, line, func, fmt);
+        }
+        xv_log_ring_t *ring = xv_log_get_ring();
+        if (site && ring) {
+            char args[XV_LOG_LINE_MAX];
+            int len;
+            if (site->raw_text) {
+                len = vsnprintf(args, sizeof(args), fmt, ap);
+                if (len >= (int)sizeof(args)) {
+                    len = sizeof(args) - 1;
+                }
+            } else {
+                len = xv_log_encode_args(site, args, sizeof(args), ap);
+            }
+            va_end(ap);
 
-    if (!xv_logger_fp) {
-        xv_logger_fp = stderr;
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            if (len >= 0) {
+                xv_log_ring_push(ring, XV_LOG_RECORD_BINARY, NULL, site->id, NULL, &tv, args, len);
+            }
+            return;
+        }
     }
 
-    // [datetime] level func(file:line) [tid] ...
-    fprintf(xv_logger_fp, "[%s] %s %s(%s:%d) [%d] %s\n",
-            datetime, xv_log_level_str(level), func, basename((char *)file), line, tid, logger_buf);
+    xv_logv(level, file, line, func, fmt, ap);
+    va_end(ap);
 }
-
@@ -31,17 +31,52 @@ typedef enum xv_log_level {
 
 extern xv_log_level_t xv_curr_log_level;
 
-#define xv_log_debug(args ...) xv_log(XV_LOG_DEBUG, __FILE__, __LINE__, __FUNCTION__, args)
-#define xv_log_info(args ...) xv_log(XV_LOG_INFO, __FILE__, __LINE__, __FUNCTION__, args)
-#define xv_log_warn(args ...) xv_log(XV_LOG_WARNING, __FILE__, __LINE__, __FUNCTION__, args)
-#define xv_log_error(args ...) xv_log(XV_LOG_ERROR, __FILE__, __LINE__, __FUNCTION__, args)
+// static state of a log call site
+typedef struct xv_log_site_slot_t {
+    void *site;            // registered site for binary log
+    long window;           // rate limit window, in second
+    int count;             // logs in window
+    int suppressed;        // suppressed logs not reported yet
+    // the site for suppressed logs report, set when it suppressed first
+    int level;
+    int line;
+    const char *file;
+    const char *func;
+    int listed;            // in suppressed sites list
+    struct xv_log_site_slot_t *next;
+} xv_log_site_slot_t;
+
+// logs below it compile to nothing, args are not evaluated, such as -DXV_LOG_MIN_LEVEL=1 to remove debug logs
+#ifndef XV_LOG_MIN_LEVEL
+#define XV_LOG_MIN_LEVEL 0
+#endif
+
+#define xv_log_enabled(level) ((level) >= XV_LOG_MIN_LEVEL && (level) >= xv_curr_log_level)
+
+// every call site has a static slot, registered at first call for binary log and
+// rate limited, level is checked before args evaluated and the call
+#define xv_log_at_site(level, args ...) do {\
+    if (xv_log_enabled(level)) {\
+        static xv_log_site_slot_t xv_log_site_slot;\
+        xv_log_site(&xv_log_site_slot, level, __FILE__, __LINE__, __FUNCTION__, args);\
+    }\
+} while(0)
+
+#define xv_log_debug(args ...) xv_log_at_site(XV_LOG_DEBUG, args)
+#define xv_log_info(args ...) xv_log_at_site(XV_LOG_INFO, args)
+#define xv_log_warn(args ...) xv_log_at_site(XV_LOG_WARNING, args)
+#define xv_log_error(args ...) xv_log_at_site(XV_LOG_ERROR, args)
 
 #define xv_log_errno_error(msg) do {\
-    char errbuf[128];\
-        strerror_r(errno, errbuf, sizeof(errbuf));\
-        xv_log_error(msg ": %s", errbuf);\
+    if (xv_log_enabled(XV_LOG_ERROR)) {\
+        char errbuf[128];\
+        xv_log_error(msg ": %s", xv_strerror(errno, errbuf, sizeof(errbuf)));\
+    }\
 } while(0)
 
+// strerror_r which works for both XSI & GNU version callers
+const char *xv_strerror(int errnum, char *buf, int len);
+
 // default to stderr
 void xv_set_log_file(FILE *pf);
 int xv_set_log_filename(const char *filename);
@@ -49,8 +84,36 @@ int xv_set_log_filename(const char *filename);
 // set log level
 void xv_set_log_level(xv_log_level_t level);
 
+// max warn & error logs per second of every call site, others are suppressed and counted,
+// "suppressed N messages" is logged with the next log of the site, or by the async flusher after
+// the window, `xv_log_flush()` and exit if the site is silent, 0 means no limit, default 100
+void xv_set_log_rate_limit(int count_per_second);
+
+// async log, every thread push logs to its own lock-free ring buffer, a background
+// thread format and write them in batches, logs from one thread keep their order
+typedef enum xv_log_overflow_policy_t {
+    XV_LOG_OVERFLOW_DROP = 0,   // drop the log when ring is full, the flusher report drop count later
+    XV_LOG_OVERFLOW_BLOCK = 1,  // wait the flusher until ring has space
+} xv_log_overflow_policy_t;
+
+// ring_size is bytes of every thread's ring, 0 means default, rounded up to power of 2
+int xv_log_async_start(int ring_size, xv_log_overflow_policy_t policy);
+// write all pushed logs and stop the flusher, back to sync log, called at exit too
+void xv_log_async_stop(void);
+// wait until logs pushed before it are written
+void xv_log_flush(void);
+
+// binary log, async log which write only call site id, raw timestamp and raw args, a call site's
+// file, line & format is written once, `xv_log_decode` tool rebuild the text offline;
+// the file is native byte order, `xv_log_async_stop()` close it
+int xv_log_binary_start(const char *filename, int ring_size, xv_log_overflow_policy_t policy);
+// decode binary log to text
+int xv_log_binary_decode(FILE *in, FILE *out);
+
 // log something
 void xv_log(xv_log_level_t level, const char *file, int line, const char *func, const char *fmt, ...);
+// log at a call site, `slot` is the site's static storage
+void xv_log_site(xv_log_site_slot_t *slot, xv_log_level_t level, const char *file, int line, const char *func, const char *fmt, ...);
 
 #ifdef __cplusplus
 }
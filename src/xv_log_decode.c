@@ -0,0 +1,55 @@
+/**
+ * (C) 2007-2019 XiYouF4 Holding Limited
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Version: 1.0: xv_log_decode.c 08/09/2019 $
+ *
+ * Authors:
+ *   hurley25 <liuhuan1992@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "xv_define.h"
+#include "xv_log.h"
+
+// ./xv_log_decode binary_log [text_log], default write to stdout
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s binary_log [text_log]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = stdout;
+    if (argc > 2) {
+        out = fopen(argv[2], "w");
+        if (!out) {
+            perror(argv[2]);
+            fclose(in);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int ret = xv_log_binary_decode(in, out);
+    if (ret != XV_OK) {
+        fprintf(stderr, "%s: bad binary log\n", argv[1]);
+    }
+
+    fclose(in);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return ret == XV_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,192 @@
+/**
+ * (C) 2007-2019 XiYouF4 Holding Limited
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Version: 1.0: xv_pool.c 10/16/2026 $
+ *
+ * Authors:
+ *   hurley25 <liuhuan1992@gmail.com>
+ */
+
+#include "xv_pool.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "xv_log.h"
+
+#define XV_DEFAULT_POOL_CACHE_SIZE 256
+
+// free object, the link is stored in the object itself
+typedef struct xv_pool_obj_t {
+    struct xv_pool_obj_t *next;
+} xv_pool_obj_t;
+
+typedef struct xv_pool_cache_t {
+    xv_pool_t *pool;
+    xv_pool_obj_t *free_list;
+    int free_count;
+    struct xv_pool_cache_t *prev;
+    struct xv_pool_cache_t *next;
+} xv_pool_cache_t;
+
+struct xv_pool_t {
+    int obj_size;
+    int cache_size;
+    pthread_key_t key;
+
+    pthread_mutex_t mutex;          // protect fields below
+    xv_pool_obj_t *free_list;       // shared by all threads
+    int free_count;
+    xv_pool_cache_t *caches;        // all thread caches, free them when pool destroy
+};
+
+static void xv_pool_free_list(xv_pool_obj_t *obj)
+{
+    while (obj) {
+        xv_pool_obj_t *next = obj->next;
+        xv_free(obj);
+        obj = next;
+    }
+}
+
+// thread exit, give the cached objects back to the shared list
+static void xv_pool_cache_destroy(void *args)
+{
+    xv_pool_cache_t *cache = (xv_pool_cache_t *)args;
+    xv_pool_t *pool = cache->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (cache->free_list) {
+        xv_pool_obj_t *obj = cache->free_list;
+        cache->free_list = obj->next;
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+        __atomic_store_n(&pool->free_count, pool->free_count + 1, __ATOMIC_RELAXED);
+    }
+    if (cache->prev) {
+        cache->prev->next = cache->next;
+    } else {
+        pool->caches = cache->next;
+    }
+    if (cache->next) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    xv_free(cache);
+}
+
+static xv_pool_cache_t *xv_pool_get_cache(xv_pool_t *pool)
+{
+    xv_pool_cache_t *cache = (xv_pool_cache_t *)pthread_getspecific(pool->key);
+    if (cache) {
+        return cache;
+    }
+    cache = (xv_pool_cache_t *)xv_malloc(sizeof(xv_pool_cache_t));
+    cache->pool = pool;
+    cache->free_list = NULL;
+    cache->free_count = 0;
+    cache->prev = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    cache->next = pool->caches;
+    if (pool->caches) {
+        pool->caches->prev = cache;
+    }
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->mutex);
+
+    pthread_setspecific(pool->key, cache);
+
+    return cache;
+}
+
+xv_pool_t *xv_pool_init(int obj_size, int cache_size)
+{
+    xv_pool_t *pool = (xv_pool_t *)xv_malloc(sizeof(xv_pool_t));
+    if (pthread_key_create(&pool->key, xv_pool_cache_destroy) != 0) {
+        xv_log_errno_error("pthread_key_create");
+        xv_free(pool);
+        return NULL;
+    }
+    pool->obj_size = obj_size < (int)sizeof(xv_pool_obj_t) ? (int)sizeof(xv_pool_obj_t) : obj_size;
+    pool->cache_size = cache_size > 0 ? cache_size : XV_DEFAULT_POOL_CACHE_SIZE;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->free_list = NULL;
+    pool->free_count = 0;
+    pool->caches = NULL;
+
+    return pool;
+}
+
+void xv_pool_destroy(xv_pool_t *pool)
+{
+    // no destructor run after key deleted, free the caches of alive threads here
+    pthread_key_delete(pool->key);
+
+    xv_pool_cache_t *cache = pool->caches;
+    while (cache) {
+        xv_pool_cache_t *next = cache->next;
+        xv_pool_free_list(cache->free_list);
+        xv_free(cache);
+        cache = next;
+    }
+    xv_pool_free_list(pool->free_list);
+    pthread_mutex_destroy(&pool->mutex);
+    xv_free(pool);
+}
+
+void *xv_pool_alloc(xv_pool_t *pool)
+{
+    xv_pool_cache_t *cache = xv_pool_get_cache(pool);
+    if (!cache->free_list && __atomic_load_n(&pool->free_count, __ATOMIC_RELAXED) > 0) {
+        // refill half cache from the shared list
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->free_list && cache->free_count < pool->cache_size / 2) {
+            xv_pool_obj_t *obj = pool->free_list;
+            pool->free_list = obj->next;
+            __atomic_store_n(&pool->free_count, pool->free_count - 1, __ATOMIC_RELAXED);
+            obj->next = cache->free_list;
+            cache->free_list = obj;
+            cache->free_count++;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    xv_pool_obj_t *obj = cache->free_list;
+    if (!obj) {
+        // pool is empty, alloc new one
+        return xv_malloc(pool->obj_size);
+    }
+    cache->free_list = obj->next;
+    cache->free_count--;
+
+    return obj;
+}
+
+void xv_pool_free(xv_pool_t *pool, void *obj)
+{
+    xv_pool_cache_t *cache = xv_pool_get_cache(pool);
+    xv_pool_obj_t *node = (xv_pool_obj_t *)obj;
+    node->next = cache->free_list;
+    cache->free_list = node;
+    cache->free_count++;
+
+    if (cache->free_count <= pool->cache_size) {
+        return;
+    }
+    // cache is full, move half to the shared list for other threads
+    pthread_mutex_lock(&pool->mutex);
+    while (cache->free_count > pool->cache_size / 2) {
+        node = cache->free_list;
+        cache->free_list = node->next;
+        cache->free_count--;
+        node->next = pool->free_list;
+        pool->free_list = node;
+        __atomic_store_n(&pool->free_count, pool->free_count + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
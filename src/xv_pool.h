@@ -0,0 +1,42 @@
+/**
+ * (C) 2007-2019 XiYouF4 Holding Limited
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Version: 1.0: xv_pool.h 10/16/2026 $
+ *
+ * Authors:
+ *   hurley25 <liuhuan1992@gmail.com>
+ */
+
+#ifndef XV_POOL_H_
+#define XV_POOL_H_
+
+#include "xv_define.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ----------------------------------------------------------------------------------------
+// xv_pool_t: fixed size object pool
+//
+// every thread has its own cache, alloc and free without lock in most time,
+// an object can be freed in any thread, cache overflow move to the shared list
+// ----------------------------------------------------------------------------------------
+typedef struct xv_pool_t xv_pool_t;
+
+// cache_size: max objects cached per thread, 0 means default
+xv_pool_t *xv_pool_init(int obj_size, int cache_size);
+// all threads must stop using the pool before destroy
+void xv_pool_destroy(xv_pool_t *pool);
+void *xv_pool_alloc(xv_pool_t *pool);
+void xv_pool_free(xv_pool_t *pool, void *obj);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // XV_POOL_H_
@@ -11,11 +11,20 @@
  *   hurley25 <liuhuan1992@gmail.com>
  */
 
+// recvmmsg & sendmmsg
+#define _GNU_SOURCE
 #include "xv_service.h"
 
 #include <stdlib.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "xv.h"
 #include "xv_log.h"
@@ -23,10 +32,43 @@
 #include "xv_buffer.h"
 #include "xv_socket.h"
 #include "xv_th_pool.h"
+#include "xv_pool.h"
 
 #define XV_DEFAULT_LOOP_SIZE 1024
 #define XV_DEFAULT_BUFFRT_SIZE 8192
 #define XV_DEFAULT_READ_SIZE 4096
+#define XV_DEFAULT_ACCEPT_BATCH_SIZE 64
+#define XV_DEFAULT_LEADER_SERVE_ACCEPT_BATCH_SIZE 16
+#define XV_DEFAULT_INLINE_COST_US 20
+#define XV_DEFAULT_ENCODE_BUFFER_SIZE 512
+#define XV_DEFAULT_CONCURRENCY_LIMIT 1024
+#define XV_DEFAULT_TARGET_LATENCY_US 10000
+#define XV_RATE_LIMIT_TICK_MS 10
+#define XV_ACCEPT_RETRY_TICK_MS 10
+#define XV_ACCEPT_BACKOFF_MIN_MS 10
+#define XV_ACCEPT_BACKOFF_MAX_MS 1000
+#define XV_ADDR_LIMIT_BUCKET_SIZE 1024
+#define XV_GROUP_BUCKET_SIZE 1024
+#define XV_MAX_CONN_SLOT_SIZE (1 << 20)
+#define XV_DEFAULT_UDP_BATCH_SIZE 64
+#define XV_MAX_UDP_BATCH_SIZE 1024
+#define XV_DEFAULT_UDP_DATAGRAM_SIZE 2048
+#define XV_DEFAULT_CONNECT_TIMEOUT_MS 3000
+#define XV_UPSTREAM_RETRY_MS 100
+#define XV_UPSTREAM_BUCKET_SIZE 256
+#define XV_UNIX_ADDR_PREFIX "unix:"
+#define XV_UNIX_CONN_ADDR "unix"
+#define XV_LISTEN_ADDR_LEN (XV_UNIX_PATH_MAX + 8)
+
+// connection id: generation << 32 | fd
+#define XV_CONN_ID(gen, fd) (((uint64_t)(gen) << 32) | (uint32_t)(fd))
+#define XV_CONN_ID_GEN(id) ((uint32_t)((id) >> 32))
+#define XV_CONN_ID_FD(id) ((int)((id) & 0xffffffff))
+
+// connection slot state: generation << 32 | owner io thread idx + 1, owner is 0 when closed
+#define XV_SLOT_STATE(gen, owner) (((uint64_t)(gen) << 32) | (uint32_t)(owner))
+#define XV_SLOT_GEN(state) ((uint32_t)((state) >> 32))
+#define XV_SLOT_OWNER(state) ((int)((state) & 0xffffffff))
 
 // ----------------------------------------------------------------------------------------
 // xv_connection_t
@@ -36,18 +78,106 @@ typedef enum xv_connection_status_t {
     XV_CONN_CLOSED = 2,
 } xv_connection_status_t;
 
+typedef struct xv_group_t xv_group_t;
+typedef struct xv_group_member_t xv_group_member_t;
+typedef struct xv_addr_limit_t xv_addr_limit_t;
+typedef struct xv_udp_t xv_udp_t;
+typedef struct xv_upstream_conn_t xv_upstream_conn_t;
+
+// ----------------------------------------------------------------------------------------
+// xv_token_bucket_t, refill `rate` tokens per second, burst is one second
+// ----------------------------------------------------------------------------------------
+typedef struct xv_token_bucket_t {
+    int64_t rate;       // 0 means no limit
+    double tokens;      // may be negative after a big read, wait it refill
+    int64_t last_ns;
+} xv_token_bucket_t;
+
+static void xv_token_bucket_init(xv_token_bucket_t *bucket, int64_t rate, int64_t now_ns)
+{
+    bucket->rate = rate;
+    bucket->tokens = (double)rate;
+    bucket->last_ns = now_ns;
+}
+
+// refill and return if any token left
+static int xv_token_bucket_ready(xv_token_bucket_t *bucket, int64_t now_ns)
+{
+    if (bucket->rate == 0) {
+        return 1;
+    }
+    if (now_ns > bucket->last_ns) {
+        bucket->tokens += (double)bucket->rate * (now_ns - bucket->last_ns) / 1000000000;
+        if (bucket->tokens > bucket->rate) {
+            bucket->tokens = (double)bucket->rate;
+        }
+        bucket->last_ns = now_ns;
+    }
+    return bucket->tokens > 0;
+}
+
+// refilled to the burst, as a new bucket
+static int xv_token_bucket_full(xv_token_bucket_t *bucket, int64_t now_ns)
+{
+    xv_token_bucket_ready(bucket, now_ns);
+    return bucket->tokens >= bucket->rate;
+}
+
+static void xv_token_bucket_take(xv_token_bucket_t *bucket, int count)
+{
+    if (bucket->rate != 0) {
+        bucket->tokens -= count;
+    }
+}
+
 typedef struct xv_connection_t {
     char addr[XV_ADDR_LEN];
     int port;
     int fd;
+    uint64_t id;
     xv_io_t *read_io;
     xv_io_t *write_io;
     xv_buffer_t *read_buffer;
     xv_buffer_t *write_buffer;
     xv_service_handle_t *handle;
-    xv_io_thread_t *io_thread;
+    xv_listener_t *listener;
+    xv_io_thread_t *io_thread;             // owner io thread, may change by migration, read by `xv_connection_io_thread`
     xv_connection_status_t status;
     xv_atomic_t ref_count;
+    xv_atomic_t pending_count;             // messages processing out of io thread
+
+    // direct write from worker thread, `write_lock` guard socket write & `write_buffer` change
+    int write_lock_enable;
+    int write_lock;
+    xv_atomic_t handoff_count;             // responses push to io thread but not write yet
+
+    // rate limit, only owner io thread touch it
+    xv_token_bucket_t request_bucket;
+    xv_token_bucket_t byte_bucket;
+    xv_addr_limit_t *addr_limit;           // shared by connections from the same address
+    int rate_paused;                       // read stopped, in owner io thread's paused list
+    struct xv_connection_t *paused_prev;
+    struct xv_connection_t *paused_next;
+
+    // migrate after all pending messages returned, keep responses in order
+    xv_io_thread_t *migrate_target;
+
+    // link in owner io thread's connection list, only owner io thread touch it
+    struct xv_connection_t *prev;
+    struct xv_connection_t *next;
+
+    // groups joined, only owner io thread touch it
+    xv_group_member_t *groups;
+
+    // udp socket of a udp listener, not in slot table, never closed or migrated
+    xv_udp_t *udp;
+
+    // outbound connection by `xv_service_connect`, has no listener, write event wait for connect complete,
+    // `connecting` is cleared under write lock
+    int connecting;
+    xv_timer_t *connect_timer;
+    int64_t process_cost_ns;               // average cost of `handle.process`, for XV_EXEC_ADAPTIVE
+    xv_upstream_conn_t *upstream;          // connection of a upstream pool, decoded packets are responses
 } xv_connection_t;
 
 static xv_connection_t *xv_connection_init(const char *addr, int port, int fd,
@@ -57,8 +187,23 @@ static xv_connection_t *xv_connection_init(const char *addr, int port, int fd,
     strncpy(conn->addr, addr, XV_ADDR_LEN);
     conn->port = port;
     conn->fd = fd;
+    conn->id = 0;
     conn->handle = handle;
+    conn->listener = NULL;
     conn->io_thread = NULL;
+    xv_atomic_set(&conn->pending_count, 0);
+    conn->migrate_target = NULL;
+
+    conn->write_lock_enable = 0;
+    conn->write_lock = 0;
+    xv_atomic_set(&conn->handoff_count, 0);
+
+    xv_token_bucket_init(&conn->request_bucket, 0, 0);
+    xv_token_bucket_init(&conn->byte_bucket, 0, 0);
+    conn->addr_limit = NULL;
+    conn->rate_paused = 0;
+    conn->paused_prev = NULL;
+    conn->paused_next = NULL;
 
     conn->read_io = xv_io_init(fd, XV_READ, read_cb);
     xv_io_set_userdata(conn->read_io, conn);
@@ -72,17 +217,73 @@ static xv_connection_t *xv_connection_init(const char *addr, int port, int fd,
     conn->status = XV_CONN_OPEN;
     xv_atomic_set(&conn->ref_count, 1);
 
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->groups = NULL;
+    conn->udp = NULL;
+    conn->connecting = 0;
+    conn->connect_timer = NULL;
+    conn->process_cost_ns = 0;
+    conn->upstream = NULL;
+
     return conn;
 }
 
+// io thread wait the lock, worker thread hold it just for a write
+static void xv_connection_write_lock(xv_connection_t *conn)
+{
+    if (!conn->write_lock_enable) {
+        return;
+    }
+    while (__atomic_exchange_n(&conn->write_lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&conn->write_lock, __ATOMIC_RELAXED)) {
+            ;
+        }
+    }
+}
+
+static int xv_connection_write_trylock(xv_connection_t *conn)
+{
+    return __atomic_exchange_n(&conn->write_lock, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static void xv_connection_write_unlock(xv_connection_t *conn)
+{
+    if (conn->write_lock_enable) {
+        __atomic_store_n(&conn->write_lock, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// connect finished, failed or stopped, free the timerfd at once
+static void xv_connection_destroy_connect_timer(xv_loop_t *loop, xv_connection_t *conn)
+{
+    if (conn->connect_timer) {
+        xv_timer_stop(loop, conn->connect_timer);
+        xv_timer_destroy(conn->connect_timer);
+        conn->connect_timer = NULL;
+    }
+}
+
 static void xv_connection_stop(xv_loop_t *loop, xv_connection_t *conn)
 {
     xv_io_stop(loop, conn->read_io);
     xv_io_stop(loop, conn->write_io);
+    xv_connection_destroy_connect_timer(loop, conn);
 }
 
+static void xv_connection_free_groups(xv_connection_t *conn);
+static void xv_udp_destroy(xv_udp_t *udp);
+
 static void xv_connection_destroy(xv_connection_t *conn)
 {
+    // not attached to any group here, closed or never started
+    xv_connection_free_groups(conn);
+    if (conn->udp) {
+        xv_udp_destroy(conn->udp);
+    }
+    if (conn->connect_timer) {
+        xv_timer_destroy(conn->connect_timer);
+    }
     xv_io_destroy(conn->read_io);
     xv_io_destroy(conn->write_io);
     xv_buffer_destroy(conn->read_buffer);
@@ -105,6 +306,22 @@ int xv_connection_get_fd(xv_connection_t *conn)
     return conn->fd;
 }
 
+uint64_t xv_connection_get_id(xv_connection_t *conn)
+{
+    return conn->id;
+}
+
+// owner io thread of conn, worker threads read it when return message
+static xv_io_thread_t *xv_connection_io_thread(xv_connection_t *conn)
+{
+    return __atomic_load_n(&conn->io_thread, __ATOMIC_ACQUIRE);
+}
+
+static void xv_connection_set_io_thread(xv_connection_t *conn, xv_io_thread_t *io_thread)
+{
+    __atomic_store_n(&conn->io_thread, io_thread, __ATOMIC_RELEASE);
+}
+
 void xv_connection_incr_ref(xv_connection_t *conn)
 {
     xv_atomic_incr(&conn->ref_count);
@@ -119,28 +336,56 @@ void xv_connection_decr_ref(xv_connection_t *conn)
 // xv_listener_t
 // ----------------------------------------------------------------------------------------
 struct xv_listener_t {
-    char addr[XV_ADDR_LEN];        // bind addr
-    int port;                      // listen port
+    char addr[XV_LISTEN_ADDR_LEN]; // bind addr, or unix socket path
+    int port;                      // listen port, 0 for unix socket
+    int is_unix;                   // AF_UNIX listener
     int listen_fd;
     xv_io_t *listen_io;            // listen_fd readable cb
     xv_service_handle_t handle;    // user cb handle
+    int io_thread_idx;             // which io thread should accept on this listener
     xv_io_thread_t *io_thread;     // which io thread call `xv_io_start`
+    int64_t process_cost_ns;       // average cost of `handle.process`, for XV_EXEC_ADAPTIVE
+    xv_socket_options_t options;   // socket options, set on listen_fd, and on accepted fd if not inherited
+    int accepted_options;          // some options need set on accepted fd
+
+    // out of fds, listen_io stopped until some connections closed or backoff timeout
+    xv_timer_t *accept_timer;
+    int accept_paused_ms;
+    int accept_backoff_ms;
+    int closed_snapshot;           // service closed connections when paused
+
+    xv_connection_t *udp_conn;     // udp listener read & write datagrams by it, NULL for stream listener
 
     xv_listener_t *next;
 };
 
-static xv_listener_t *xv_listener_init(const char *addr, int port, int fd, xv_service_handle_t handle, xv_io_cb_t new_conn_cb)
+static void listener_accept_timer_cb(xv_loop_t *loop, xv_timer_t *timer);
+
+static xv_listener_t *xv_listener_init(const char *addr, int port, int fd, xv_service_handle_t handle,
+                    const xv_socket_options_t *options, int io_thread_idx, xv_io_cb_t new_conn_cb)
 {
     xv_listener_t *listener = (xv_listener_t *)xv_malloc(sizeof(xv_listener_t));
 
-    strncpy(listener->addr, addr, XV_ADDR_LEN);
+    strncpy(listener->addr, addr, XV_LISTEN_ADDR_LEN - 1);
+    listener->addr[XV_LISTEN_ADDR_LEN - 1] = '\0';
     listener->port = port;
+    listener->is_unix = 0;
     listener->listen_fd = fd;
     listener->listen_io = xv_io_init(fd, XV_READ, new_conn_cb);
     listener->handle = handle;
+    listener->io_thread_idx = io_thread_idx;
     listener->io_thread = NULL;
+    listener->process_cost_ns = 0;
+    listener->options = *options;
+    listener->accepted_options = (options->tcp_quickack != 0);
+    listener->accept_timer = xv_timer_init(listener_accept_timer_cb, XV_ACCEPT_RETRY_TICK_MS, XV_ACCEPT_RETRY_TICK_MS);
+    listener->accept_paused_ms = 0;
+    listener->accept_backoff_ms = XV_ACCEPT_BACKOFF_MIN_MS;
+    listener->closed_snapshot = 0;
+    listener->udp_conn = NULL;
 
     xv_io_set_userdata(listener->listen_io, listener);
+    xv_timer_set_userdata(listener->accept_timer, listener);
 
     return listener;
 }
@@ -148,34 +393,153 @@ static xv_listener_t *xv_listener_init(const char *addr, int port, int fd, xv_se
 static void xv_listener_stop(xv_loop_t *loop, xv_listener_t *listener)
 {
     xv_io_stop(loop, listener->listen_io);
+    xv_timer_stop(loop, listener->accept_timer);
+    if (listener->udp_conn) {
+        xv_connection_stop(loop, listener->udp_conn);
+    }
     xv_close(listener->listen_fd);
+    if (listener->is_unix && listener->addr[0] != '@') {
+        unlink(listener->addr);
+    }
 }
 
 static void xv_listener_destroy(xv_listener_t *listener)
 {
     xv_io_destroy(listener->listen_io);
+    xv_timer_destroy(listener->accept_timer);
+    if (listener->udp_conn) {
+        // fd is closed by `xv_listener_stop`
+        xv_connection_destroy(listener->udp_conn);
+    }
     xv_free(listener);
 }
 
+// ----------------------------------------------------------------------------------------
+// xv_frame_t, encoded bytes shared by many connections
+// ----------------------------------------------------------------------------------------
+typedef struct xv_frame_t {
+    xv_atomic_t ref_count;
+    xv_buffer_t *buffer;
+} xv_frame_t;
+
+static xv_frame_t *xv_frame_init(int (*encode)(xv_buffer_t *, void *), void *packet)
+{
+    xv_frame_t *frame = (xv_frame_t *)xv_malloc(sizeof(xv_frame_t));
+    frame->buffer = xv_buffer_init(XV_DEFAULT_BUFFRT_SIZE);
+    xv_atomic_set(&frame->ref_count, 1);
+
+    if (encode(frame->buffer, packet) != XV_OK) {
+        xv_buffer_destroy(frame->buffer);
+        xv_free(frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+static void xv_frame_incr_ref(xv_frame_t *frame)
+{
+    xv_atomic_incr(&frame->ref_count);
+}
+
+static void xv_frame_decr_ref(xv_frame_t *frame)
+{
+    if (xv_atomic_decr(&frame->ref_count) == 0) {
+        xv_buffer_destroy(frame->buffer);
+        xv_free(frame);
+    }
+}
+
+static const char *xv_frame_data(xv_frame_t *frame)
+{
+    return xv_buffer_read_begin(frame->buffer);
+}
+
+static int xv_frame_size(xv_frame_t *frame)
+{
+    return xv_buffer_readable_size(frame->buffer);
+}
+
+// ----------------------------------------------------------------------------------------
+// xv_udp_t, batch datagrams by recvmmsg & sendmmsg, only owner io thread touch it
+// ----------------------------------------------------------------------------------------
+typedef struct xv_udp_packet_t {
+    xv_buffer_t *buffer;
+    struct sockaddr_in addr;
+} xv_udp_packet_t;
+
+struct xv_udp_t {
+    int batch_size;                 // max datagrams per syscall
+    int datagram_size;              // max request size, truncated datagrams are dropped
+    xv_udp_packet_t *recv_packets;
+    struct mmsghdr *recv_msgs;
+    struct iovec *recv_iovs;
+    xv_udp_packet_t *send_packets;  // encoded responses wait for `sendmmsg`
+    struct mmsghdr *send_msgs;
+    struct iovec *send_iovs;
+    int send_count;
+    int write_started;              // socket buffer was full, wait for write event
+    const struct sockaddr_in *peer; // source of the datagram in decoding
+    xv_connection_t *next;          // link in owner io thread's udp list
+};
+
 // ----------------------------------------------------------------------------------------
 // xv_message_t
 // ----------------------------------------------------------------------------------------
 struct xv_message_t {
-    xv_connection_t *conn;
+    xv_connection_t *conn;          // NULL when send by connection id
+    uint64_t conn_id;
+    xv_service_handle_t *handle;    // for cleanup when send by id failed
+    xv_pool_t *pool;                // message alloc from service message pool
+    int pending;                    // counted in conn->pending_count
+    int handoff;                    // counted in conn->handoff_count
+    int admitted;                   // counted in service->pending_requests
+    int64_t admit_ns;               // for request latency
     void *request;
     void *response;
+    xv_buffer_t *encoded;           // response encoded out of io thread, `response` is cleaned up then
+    struct sockaddr_in peer;        // request datagram source of udp listener, response send to it
 };
 
-static xv_message_t *xv_message_init(xv_connection_t *conn)
+static xv_message_t *xv_message_init(xv_pool_t *pool, xv_connection_t *conn)
 {
-    xv_message_t *message = (xv_message_t *)xv_malloc(sizeof(xv_message_t));
+    xv_message_t *message = (xv_message_t *)xv_pool_alloc(pool);
 
+    message->pool = pool;
     message->conn = conn;
     // incr conn ref_count
     xv_connection_incr_ref(conn);
 
+    message->conn_id = conn->id;
+    message->handle = conn->handle;
+    message->pending = 0;
+    message->handoff = 0;
+    message->admitted = 0;
+    message->request = NULL;
+    message->response = NULL;
+    message->encoded = NULL;
+    if (conn->udp) {
+        message->peer = *conn->udp->peer;
+    }
+
+    return message;
+}
+
+// message hold no ref, io thread find the connection by id
+static xv_message_t *xv_message_init_by_id(xv_pool_t *pool, uint64_t conn_id, xv_service_handle_t *handle)
+{
+    xv_message_t *message = (xv_message_t *)xv_pool_alloc(pool);
+
+    message->pool = pool;
+    message->conn = NULL;
+    message->conn_id = conn_id;
+    message->handle = handle;
+    message->pending = 0;
+    message->handoff = 0;
+    message->admitted = 0;
     message->request = NULL;
     message->response = NULL;
+    message->encoded = NULL;
 
     return message;
 }
@@ -190,10 +554,22 @@ static void xv_message_destroy(xv_message_t *message, void (*packet_cleanup)(voi
             packet_cleanup(message->response);
         }
     }
+    if (message->encoded) {
+        xv_buffer_destroy(message->encoded);
+    }
     // decr conn ref_count when message destroy
-    xv_connection_decr_ref(message->conn);
+    if (message->conn) {
+        xv_connection_decr_ref(message->conn);
+    }
+
+    xv_pool_free(message->pool, message);
+}
 
-    xv_free(message);
+// destroy the message left in queue
+static void xv_message_drop(void *args)
+{
+    xv_message_t *message = (xv_message_t *)args;
+    xv_message_destroy(message, message->handle->packet_cleanup);
 }
 
 xv_connection_t *xv_message_get_connection(xv_message_t *message)
@@ -221,6 +597,167 @@ void xv_message_set_response(xv_message_t *message, void *response)
     message->response = response;
 }
 
+int xv_message_get_peer_addr(xv_message_t *message, char *addr, int addr_len, int *port)
+{
+    if (!message->conn || !message->conn->udp) {
+        return XV_ERR;
+    }
+    if (addr) {
+        inet_ntop(AF_INET, &message->peer.sin_addr, addr, addr_len);
+    }
+    if (port) {
+        *port = ntohs(message->peer.sin_port);
+    }
+    return XV_OK;
+}
+
+// worker thread hash, requests of a connection or a udp peer run in one worker, keep them in order
+static int xv_message_hash(xv_message_t *message)
+{
+    xv_connection_t *conn = message->conn;
+    if (!conn->udp) {
+        return conn->fd;
+    }
+    uint32_t hash = (message->peer.sin_addr.s_addr ^ message->peer.sin_port) * 2654435761u;
+    return (int)(hash >> 1);
+}
+
+static xv_udp_t *xv_udp_init(int batch_size, int datagram_size)
+{
+    xv_udp_t *udp = (xv_udp_t *)xv_malloc(sizeof(xv_udp_t));
+    udp->batch_size = batch_size;
+    udp->datagram_size = datagram_size;
+    udp->recv_packets = (xv_udp_packet_t *)xv_malloc(sizeof(xv_udp_packet_t) * batch_size);
+    udp->recv_msgs = (struct mmsghdr *)xv_malloc(sizeof(struct mmsghdr) * batch_size);
+    udp->recv_iovs = (struct iovec *)xv_malloc(sizeof(struct iovec) * batch_size);
+    udp->send_packets = (xv_udp_packet_t *)xv_malloc(sizeof(xv_udp_packet_t) * batch_size);
+    udp->send_msgs = (struct mmsghdr *)xv_malloc(sizeof(struct mmsghdr) * batch_size);
+    udp->send_iovs = (struct iovec *)xv_malloc(sizeof(struct iovec) * batch_size);
+    memset(udp->recv_msgs, 0, sizeof(struct mmsghdr) * batch_size);
+    memset(udp->send_msgs, 0, sizeof(struct mmsghdr) * batch_size);
+
+    for (int i = 0; i < batch_size; ++i) {
+        udp->recv_packets[i].buffer = xv_buffer_init(datagram_size);
+        udp->recv_msgs[i].msg_hdr.msg_iov = &udp->recv_iovs[i];
+        udp->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+        udp->recv_msgs[i].msg_hdr.msg_name = &udp->recv_packets[i].addr;
+        udp->send_packets[i].buffer = xv_buffer_init(XV_DEFAULT_ENCODE_BUFFER_SIZE);
+    }
+    udp->send_count = 0;
+    udp->write_started = 0;
+    udp->peer = NULL;
+    udp->next = NULL;
+
+    return udp;
+}
+
+static void xv_udp_destroy(xv_udp_t *udp)
+{
+    for (int i = 0; i < udp->batch_size; ++i) {
+        xv_buffer_destroy(udp->recv_packets[i].buffer);
+        xv_buffer_destroy(udp->send_packets[i].buffer);
+    }
+    xv_free(udp->recv_packets);
+    xv_free(udp->recv_msgs);
+    xv_free(udp->recv_iovs);
+    xv_free(udp->send_packets);
+    xv_free(udp->send_msgs);
+    xv_free(udp->send_iovs);
+    xv_free(udp);
+}
+
+// reset the recv slot for next `recvmmsg`
+static void xv_udp_prepare_recv(xv_udp_t *udp, int idx)
+{
+    xv_buffer_t *buffer = udp->recv_packets[idx].buffer;
+    xv_buffer_clear(buffer);
+    xv_buffer_ensure_writeable_size(buffer, udp->datagram_size);
+
+    udp->recv_iovs[idx].iov_base = xv_buffer_write_begin(buffer);
+    udp->recv_iovs[idx].iov_len = udp->datagram_size;
+    udp->recv_msgs[idx].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    udp->recv_msgs[idx].msg_hdr.msg_flags = 0;
+}
+
+// send all waiting responses, keep the rest and start write event if socket buffer is full
+static void xv_udp_flush(xv_loop_t *loop, xv_connection_t *conn)
+{
+    xv_udp_t *udp = conn->udp;
+    if (udp->send_count == 0) {
+        return;
+    }
+    for (int i = 0; i < udp->send_count; ++i) {
+        xv_buffer_t *buffer = udp->send_packets[i].buffer;
+        udp->send_iovs[i].iov_base = xv_buffer_read_begin(buffer);
+        udp->send_iovs[i].iov_len = xv_buffer_readable_size(buffer);
+        udp->send_msgs[i].msg_hdr.msg_iov = &udp->send_iovs[i];
+        udp->send_msgs[i].msg_hdr.msg_iovlen = 1;
+        udp->send_msgs[i].msg_hdr.msg_name = &udp->send_packets[i].addr;
+        udp->send_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    int sent = 0;
+    while (sent < udp->send_count) {
+        int n = sendmmsg(conn->fd, udp->send_msgs + sent, udp->send_count - sent, MSG_DONTWAIT);
+        if (n > 0) {
+            sent += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            // such as EMSGSIZE, this one can't be sent, drop it
+            xv_log_errno_error("sendmmsg return failed, drop a response, error");
+            ++sent;
+        }
+    }
+
+    // move the rest to head, swap buffers so the sent ones are reused
+    int rest = udp->send_count - sent;
+    for (int i = 0; i < rest; ++i) {
+        xv_udp_packet_t tmp = udp->send_packets[i];
+        udp->send_packets[i] = udp->send_packets[sent + i];
+        udp->send_packets[sent + i] = tmp;
+    }
+    udp->send_count = rest;
+    if (rest > 0 && !udp->write_started) {
+        udp->write_started = 1;
+        xv_io_start(loop, conn->write_io);
+    } else if (rest == 0 && udp->write_started) {
+        udp->write_started = 0;
+        xv_io_stop(loop, conn->write_io);
+    }
+}
+
+// encode the response into send batch, udp is lossy, drop it when the batch is full and can't be sent
+static void xv_udp_push_response(xv_loop_t *loop, xv_connection_t *conn, xv_message_t *message)
+{
+    xv_udp_t *udp = conn->udp;
+    void *response = xv_message_get_response(message);
+    if (!message->encoded && (!response || !conn->handle->encode)) {
+        return;
+    }
+    if (udp->send_count == udp->batch_size) {
+        xv_udp_flush(loop, conn);
+        if (udp->send_count == udp->batch_size) {
+            xv_log_debug("udp socket fd: %d send buffer is full, drop response", conn->fd);
+            return;
+        }
+    }
+    xv_udp_packet_t *packet = &udp->send_packets[udp->send_count];
+    xv_buffer_clear(packet->buffer);
+    if (message->encoded) {
+        xv_buffer_write_data(packet->buffer, xv_buffer_read_begin(message->encoded), xv_buffer_readable_size(message->encoded));
+    } else if (conn->handle->encode(packet->buffer, response) != XV_OK) {
+        return;
+    }
+    packet->addr = message->peer;
+    ++udp->send_count;
+}
+
+static void on_udp_write(xv_loop_t *loop, xv_io_t *io)
+{
+    xv_udp_flush(loop, (xv_connection_t *)xv_io_get_userdata(io));
+}
+
 // ----------------------------------------------------------------------------------------
 // xv_io_thread_t
 // ----------------------------------------------------------------------------------------
@@ -233,115 +770,559 @@ struct xv_io_thread_t {
     xv_concurrent_queue_t *conn_queue;
     xv_async_t *async_return_message;
     xv_concurrent_queue_t *message_queue;
+    xv_async_t *async_task;
+    xv_concurrent_queue_t *task_queue;
+    xv_atomic_t conn_count;    // connections dispatched to this io thread and not closed
+    xv_connection_t *conn_list; // open connections running in my loop
+    xv_group_t **groups;        // my shard of group members, group_id hash bucket
+    xv_connection_t *paused_list;   // connections wait for rate limit tokens
+    xv_timer_t *rate_timer;         // check `paused_list`, run only if it is not empty
+    int spare_fd;                   // reserved fd, close it to accept & drop a connection when out of fds
+    xv_connection_t *udp_list;      // udp sockets in my loop, flush their responses after a round of messages
 };
 
-static void io_thread_add_conn_cb(xv_loop_t *loop, xv_async_t *async)
+// ----------------------------------------------------------------------------------------
+// xv_group_t, every io thread keep the members running in its loop, no lock
+// ----------------------------------------------------------------------------------------
+struct xv_group_t {
+    uint64_t id;
+    xv_group_member_t *members;
+    xv_group_t *next;               // next group in the same bucket
+};
+
+struct xv_group_member_t {
+    uint64_t group_id;
+    xv_connection_t *conn;
+    xv_group_t *group;              // NULL when detached, such as migrating
+    xv_group_member_t *prev;        // link in group
+    xv_group_member_t *next;
+    xv_group_member_t *conn_next;   // link in conn->groups
+};
+
+static xv_group_t *xv_io_thread_find_group(xv_io_thread_t *io_thread, uint64_t group_id, int create)
 {
-    xv_io_thread_t *io_thread = (xv_io_thread_t *)xv_async_get_userdata(async);
+    int bucket = group_id % XV_GROUP_BUCKET_SIZE;
+    xv_group_t *group = io_thread->groups[bucket];
+    while (group) {
+        if (group->id == group_id) {
+            return group;
+        }
+        group = group->next;
+    }
+    if (!create) {
+        return NULL;
+    }
+    group = (xv_group_t *)xv_malloc(sizeof(xv_group_t));
+    group->id = group_id;
+    group->members = NULL;
+    group->next = io_thread->groups[bucket];
+    io_thread->groups[bucket] = group;
 
-    // io thread add new connection
-    while (xv_concurrent_queue_size(io_thread->conn_queue) > 0) {
-        xv_connection_t *conn = xv_concurrent_queue_pop(io_thread->conn_queue);
-        if (conn) {
-            xv_log_debug("I'm follow IO Thread No.%d, add conn[%s:%d fd:%d] to my loop",
-                    io_thread->idx, conn->addr, conn->port, conn->fd);
+    return group;
+}
 
-            conn->io_thread = io_thread;
-            // chekck it
-            if (loop != io_thread->loop) {
-                xv_log_error("What? loop != io_thread->loop, check the code!");
-            }
-            xv_io_start(loop, conn->read_io);
+static void xv_io_thread_drop_group(xv_io_thread_t *io_thread, xv_group_t *group)
+{
+    xv_group_t **pp = &io_thread->groups[group->id % XV_GROUP_BUCKET_SIZE];
+    while (*pp) {
+        if (*pp == group) {
+            *pp = group->next;
+            xv_free(group);
+            return;
         }
+        pp = &(*pp)->next;
     }
 }
 
-static void process_message(xv_loop_t *loop, xv_message_t *message, xv_connection_t *conn, xv_service_handle_t *handle);
+static void xv_group_attach_member(xv_io_thread_t *io_thread, xv_group_member_t *member)
+{
+    xv_group_t *group = xv_io_thread_find_group(io_thread, member->group_id, 1);
+    member->group = group;
+    member->prev = NULL;
+    member->next = group->members;
+    if (group->members) {
+        group->members->prev = member;
+    }
+    group->members = member;
+}
 
-static void io_thread_return_message_cb(xv_loop_t *loop, xv_async_t *async)
+static void xv_group_detach_member(xv_io_thread_t *io_thread, xv_group_member_t *member)
 {
-    xv_io_thread_t *io_thread = (xv_io_thread_t *)xv_async_get_userdata(async);
+    xv_group_t *group = member->group;
+    if (!group) {
+        return;
+    }
+    if (member->prev) {
+        member->prev->next = member->next;
+    } else {
+        group->members = member->next;
+    }
+    if (member->next) {
+        member->next->prev = member->prev;
+    }
+    member->group = NULL;
+    member->prev = NULL;
+    member->next = NULL;
 
-    // io thread process all message
-    while (xv_concurrent_queue_size(io_thread->message_queue) > 0) {
-        xv_message_t *message = xv_concurrent_queue_pop(io_thread->message_queue);
-        if (message) {
-            xv_connection_t *conn = xv_message_get_connection(message);
-            xv_log_debug("I'm follow IO Thread No.%d, I got a return message: %p, conn[%s:%d fd:%d] to my loop",
-                    io_thread->idx, message, conn->addr, conn->port, conn->fd);
+    // free empty group
+    if (!group->members) {
+        xv_io_thread_drop_group(io_thread, group);
+    }
+}
 
-            if (conn->status != XV_CONN_CLOSED) {
-                process_message(loop, message, conn, conn->handle);
-                xv_message_destroy(message, conn->handle->packet_cleanup);
-            } else {
-                xv_message_destroy(message, conn->handle->packet_cleanup);
-                xv_connection_destroy(conn);
-            }
+static int xv_connection_join_group(xv_io_thread_t *io_thread, xv_connection_t *conn, uint64_t group_id)
+{
+    xv_group_member_t *member = conn->groups;
+    while (member) {
+        if (member->group_id == group_id) {
+            return XV_OK;
         }
+        member = member->conn_next;
     }
+    member = (xv_group_member_t *)xv_malloc(sizeof(xv_group_member_t));
+    member->group_id = group_id;
+    member->conn = conn;
+    member->group = NULL;
+    member->conn_next = conn->groups;
+    conn->groups = member;
+
+    // not running in my loop yet, `xv_io_thread_link_conn` will attach it
+    if (conn->prev || io_thread->conn_list == conn) {
+        xv_group_attach_member(io_thread, member);
+    }
+
+    return XV_OK;
 }
 
-static xv_io_thread_t *xv_io_thread_init(int i, xv_service_t *service)
+static int xv_connection_leave_group(xv_io_thread_t *io_thread, xv_connection_t *conn, uint64_t group_id)
 {
-    xv_io_thread_t *io_thread = (xv_io_thread_t *)xv_malloc(sizeof(xv_io_thread_t));
-    io_thread->idx = i;
-    io_thread->loop = xv_loop_init(XV_DEFAULT_LOOP_SIZE);
-    io_thread->service = service;
+    xv_group_member_t **pp = &conn->groups;
+    while (*pp) {
+        xv_group_member_t *member = *pp;
+        if (member->group_id == group_id) {
+            *pp = member->conn_next;
+            xv_group_detach_member(io_thread, member);
+            xv_free(member);
+            return XV_OK;
+        }
+        pp = &member->conn_next;
+    }
 
-    // when new connection distribute to myself
-    io_thread->conn_queue = xv_concurrent_queue_init();
-    io_thread->async_add_conn = xv_async_init(io_thread_add_conn_cb);
-    xv_async_set_userdata(io_thread->async_add_conn, io_thread);
+    return XV_ERR;
+}
 
-    // when worker thread pool return the message
-    io_thread->message_queue = xv_concurrent_queue_init();
-    io_thread->async_return_message = xv_async_init(io_thread_return_message_cb);
-    xv_async_set_userdata(io_thread->async_return_message, io_thread);
+static void xv_connection_free_groups(xv_connection_t *conn)
+{
+    while (conn->groups) {
+        xv_group_member_t *member = conn->groups;
+        conn->groups = member->conn_next;
+        xv_free(member);
+    }
+}
 
-    return io_thread;
+static void xv_connection_leave_all_groups(xv_io_thread_t *io_thread, xv_connection_t *conn)
+{
+    while (conn->groups) {
+        xv_group_member_t *member = conn->groups;
+        conn->groups = member->conn_next;
+        xv_group_detach_member(io_thread, member);
+        xv_free(member);
+    }
 }
 
-static void xv_io_thread_stop(xv_io_thread_t *io_thread)
+// conn start running in io thread's loop, its groups membership move to my shard too
+static void xv_io_thread_link_conn(xv_io_thread_t *io_thread, xv_connection_t *conn)
 {
-    xv_async_stop(io_thread->loop, io_thread->async_add_conn);
-    xv_async_stop(io_thread->loop, io_thread->async_return_message);
+    xv_group_member_t *member = conn->groups;
+    while (member) {
+        if (!member->group) {
+            xv_group_attach_member(io_thread, member);
+        }
+        member = member->conn_next;
+    }
 
-    // break loop
-    xv_loop_break(io_thread->loop);
+    conn->prev = NULL;
+    conn->next = io_thread->conn_list;
+    if (io_thread->conn_list) {
+        io_thread->conn_list->prev = conn;
+    }
+    io_thread->conn_list = conn;
 }
 
-static void xv_io_thread_destroy(xv_io_thread_t *io_thread)
+static void xv_io_thread_unlink_conn(xv_io_thread_t *io_thread, xv_connection_t *conn)
 {
-    xv_concurrent_queue_destroy(io_thread->conn_queue, (xv_queue_data_destroy_cb_t)xv_connection_destroy);
-    xv_async_destroy(io_thread->async_add_conn);
-    xv_concurrent_queue_destroy(io_thread->message_queue, (xv_queue_data_destroy_cb_t)xv_message_destroy);
-    xv_async_destroy(io_thread->async_return_message);
-    xv_loop_destroy(io_thread->loop);
-    xv_free(io_thread);
+    xv_group_member_t *member = conn->groups;
+    while (member) {
+        xv_group_detach_member(io_thread, member);
+        member = member->conn_next;
+    }
+
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else if (io_thread->conn_list == conn) {
+        io_thread->conn_list = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = NULL;
+    conn->next = NULL;
+
+    // paused by rate limit, new owner read it again
+    if (conn->rate_paused) {
+        if (conn->paused_prev) {
+            conn->paused_prev->paused_next = conn->paused_next;
+        } else {
+            io_thread->paused_list = conn->paused_next;
+        }
+        if (conn->paused_next) {
+            conn->paused_next->paused_prev = conn->paused_prev;
+        }
+        conn->paused_prev = NULL;
+        conn->paused_next = NULL;
+        conn->rate_paused = 0;
+    }
 }
 
+typedef struct xv_io_thread_task_t {
+    void (*cb)(xv_io_thread_t *, void *);
+    void (*drop)(void *);   // release args if the task never run
+    void *args;
+} xv_io_thread_task_t;
+
+// run `cb` in io thread's loop, any thread can call this function
+static void xv_io_thread_post_task(xv_io_thread_t *io_thread, void (*cb)(xv_io_thread_t *, void *),
+                void (*drop)(void *), void *args)
+{
+    xv_io_thread_task_t *task = (xv_io_thread_task_t *)xv_malloc(sizeof(xv_io_thread_task_t));
+    task->cb = cb;
+    task->drop = drop;
+    task->args = args;
+    xv_concurrent_queue_push(io_thread->task_queue, task);
+    xv_async_send(io_thread->async_task);
+}
+
+static void io_thread_task_cb(xv_loop_t *loop, xv_async_t *async)
+{
+    xv_io_thread_t *io_thread = (xv_io_thread_t *)xv_async_get_userdata(async);
+
+    while (xv_concurrent_queue_size(io_thread->task_queue) > 0) {
+        xv_io_thread_task_t *task = xv_concurrent_queue_pop(io_thread->task_queue);
+        if (task) {
+            task->cb(io_thread, task->args);
+            xv_free(task);
+        }
+    }
+}
+
+// destroy the task left in queue, io thread is stopped
+static void xv_io_thread_task_drop(void *args)
+{
+    xv_io_thread_task_t *task = (xv_io_thread_task_t *)args;
+    task->drop(task->args);
+    xv_free(task);
+}
+
+static void xv_io_thread_push_message(xv_io_thread_t *io_thread, xv_message_t *message)
+{
+    xv_concurrent_queue_push(io_thread->message_queue, message);
+    xv_async_send(io_thread->async_return_message);
+}
+
+static void xv_connection_start_connect(xv_loop_t *loop, xv_connection_t *conn);
+static void process_read_buffer(xv_loop_t *loop, xv_connection_t *conn, xv_service_handle_t *handle);
+
+static void io_thread_add_conn_cb(xv_loop_t *loop, xv_async_t *async)
+{
+    xv_io_thread_t *io_thread = (xv_io_thread_t *)xv_async_get_userdata(async);
+
+    // io thread add new connection
+    while (xv_concurrent_queue_size(io_thread->conn_queue) > 0) {
+        xv_connection_t *conn = xv_concurrent_queue_pop(io_thread->conn_queue);
+        if (conn) {
+            xv_log_debug("I'm follow IO Thread No.%d, add conn[%s:%d fd:%d] to my loop",
+                    io_thread->idx, conn->addr, conn->port, conn->fd);
+
+            // migrated to other io thread before we start it
+            if (xv_connection_io_thread(conn) != io_thread) {
+                continue;
+            }
+            // chekck it
+            if (loop != io_thread->loop) {
+                xv_log_error("What? loop != io_thread->loop, check the code!");
+            }
+            xv_io_thread_link_conn(io_thread, conn);
+            if (conn->connecting) {
+                xv_connection_start_connect(loop, conn);
+                continue;
+            }
+            xv_io_start(loop, conn->read_io);
+            // migrated connection may have data wait to write
+            if (xv_buffer_readable_size(conn->write_buffer) > 0) {
+                xv_io_start(loop, conn->write_io);
+            }
+            // and requests read before, such as paused by rate limit, no read event for them
+            if (xv_buffer_readable_size(conn->read_buffer) > 0) {
+                process_read_buffer(loop, conn, conn->handle);
+            }
+        }
+    }
+}
+
+static void process_message(xv_loop_t *loop, xv_message_t *message, xv_connection_t *conn, xv_service_handle_t *handle);
+static void xv_connection_close(xv_connection_t *conn);
+static int xv_service_lookup_connection(xv_service_t *service, uint64_t conn_id, xv_service_handle_t **handle);
+static xv_connection_t *xv_service_get_connection(xv_service_t *service, uint64_t conn_id);
+static xv_io_thread_t *xv_service_get_io_thread(xv_service_t *service, int idx);
+
+// message send by connection id, resolve it in the owner io thread
+static void io_thread_process_id_message(xv_io_thread_t *io_thread, xv_message_t *message)
+{
+    xv_service_t *service = io_thread->service;
+    int owner_idx = xv_service_lookup_connection(service, message->conn_id, NULL);
+    if (owner_idx == XV_ERR) {
+        xv_log_debug("conn id: %llu is gone, drop message: %p", (unsigned long long)message->conn_id, message);
+
+        if (message->handle->on_send_failed && message->response) {
+            message->handle->on_send_failed(message->response);
+        }
+        xv_message_destroy(message, message->handle->packet_cleanup);
+        return;
+    }
+    if (owner_idx != io_thread->idx) {
+        // migrated, follow it
+        xv_io_thread_push_message(xv_service_get_io_thread(service, owner_idx), message);
+        return;
+    }
+    // conn may be freed in `process_message` when write failed, message hold no ref
+    xv_connection_t *conn = xv_service_get_connection(service, message->conn_id);
+    process_message(io_thread->loop, message, conn, message->handle);
+    xv_message_destroy(message, message->handle->packet_cleanup);
+}
+
+static void xv_connection_finish_migrate(xv_io_thread_t *io_thread, xv_connection_t *conn);
+
+static void io_thread_return_message_cb(xv_loop_t *loop, xv_async_t *async)
+{
+    xv_io_thread_t *io_thread = (xv_io_thread_t *)xv_async_get_userdata(async);
+
+    // io thread process all message
+    while (xv_concurrent_queue_size(io_thread->message_queue) > 0) {
+        xv_message_t *message = xv_concurrent_queue_pop(io_thread->message_queue);
+        if (message) {
+            xv_connection_t *conn = xv_message_get_connection(message);
+            if (!conn) {
+                io_thread_process_id_message(io_thread, message);
+                continue;
+            }
+            xv_log_debug("I'm follow IO Thread No.%d, I got a return message: %p, conn[%s:%d fd:%d] to my loop",
+                    io_thread->idx, message, conn->addr, conn->port, conn->fd);
+
+            // connection migrated after the message was sent, follow it
+            xv_io_thread_t *owner = xv_connection_io_thread(conn);
+            if (owner != io_thread) {
+                xv_io_thread_push_message(owner, message);
+                continue;
+            }
+            if (message->pending) {
+                xv_atomic_decr(&conn->pending_count);
+            }
+            if (conn->status != XV_CONN_CLOSED) {
+                process_message(loop, message, conn, conn->handle);
+                if (message->handoff) {
+                    // bytes are in `write_buffer` or socket now
+                    xv_atomic_decr(&conn->handoff_count);
+                }
+                xv_connection_finish_migrate(io_thread, conn);
+                xv_message_destroy(message, conn->handle->packet_cleanup);
+                if (conn->status == XV_CONN_CLOSED) {
+                    // closed by the write, release it if this is the last message ref
+                    xv_connection_close(conn);
+                }
+            } else {
+                if (message->handoff) {
+                    xv_atomic_decr(&conn->handoff_count);
+                }
+                xv_connection_finish_migrate(io_thread, conn);
+                xv_message_destroy(message, conn->handle->packet_cleanup);
+                // release the connection if this is the last message ref to it
+                xv_connection_close(conn);
+            }
+        }
+    }
+
+    // responses of udp listeners are batched, one `sendmmsg` for all of them
+    xv_connection_t *udp_conn = io_thread->udp_list;
+    while (udp_conn) {
+        xv_udp_flush(loop, udp_conn);
+        udp_conn = udp_conn->udp->next;
+    }
+}
+
+static void io_thread_rate_timer_cb(xv_loop_t *loop, xv_timer_t *timer);
+
+static xv_io_thread_t *xv_io_thread_init(int i, xv_service_t *service)
+{
+    xv_io_thread_t *io_thread = (xv_io_thread_t *)xv_malloc(sizeof(xv_io_thread_t));
+    io_thread->idx = i;
+    io_thread->loop = xv_loop_init(XV_DEFAULT_LOOP_SIZE);
+    io_thread->service = service;
+    xv_atomic_set(&io_thread->conn_count, 0);
+    io_thread->conn_list = NULL;
+    io_thread->groups = (xv_group_t **)xv_malloc(sizeof(xv_group_t *) * XV_GROUP_BUCKET_SIZE);
+    memset(io_thread->groups, 0, sizeof(xv_group_t *) * XV_GROUP_BUCKET_SIZE);
+
+    // resume connections paused by rate limit
+    io_thread->paused_list = NULL;
+    io_thread->rate_timer = xv_timer_init(io_thread_rate_timer_cb, XV_RATE_LIMIT_TICK_MS, XV_RATE_LIMIT_TICK_MS);
+    xv_timer_set_userdata(io_thread->rate_timer, io_thread);
+
+    io_thread->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    io_thread->udp_list = NULL;
+
+    // when new connection distribute to myself
+    io_thread->conn_queue = xv_concurrent_queue_init();
+    io_thread->async_add_conn = xv_async_init(io_thread_add_conn_cb);
+    xv_async_set_userdata(io_thread->async_add_conn, io_thread);
+
+    // when worker thread pool return the message
+    io_thread->message_queue = xv_concurrent_queue_init();
+    io_thread->async_return_message = xv_async_init(io_thread_return_message_cb);
+    xv_async_set_userdata(io_thread->async_return_message, io_thread);
+
+    // when other thread want run something in my loop
+    io_thread->task_queue = xv_concurrent_queue_init();
+    io_thread->async_task = xv_async_init(io_thread_task_cb);
+    xv_async_set_userdata(io_thread->async_task, io_thread);
+
+    return io_thread;
+}
+
+static void xv_io_thread_stop(xv_io_thread_t *io_thread)
+{
+    xv_async_stop(io_thread->loop, io_thread->async_add_conn);
+    xv_async_stop(io_thread->loop, io_thread->async_return_message);
+    xv_async_stop(io_thread->loop, io_thread->async_task);
+
+    // break loop
+    xv_loop_break(io_thread->loop);
+}
+
+// drop tasks never run, must be called after io thread exit
+static void xv_io_thread_drop_tasks(xv_io_thread_t *io_thread)
+{
+    while (xv_concurrent_queue_size(io_thread->task_queue) > 0) {
+        xv_io_thread_task_t *task = xv_concurrent_queue_pop(io_thread->task_queue);
+        if (task) {
+            xv_io_thread_task_drop(task);
+        }
+    }
+}
+
+static void xv_io_thread_destroy(xv_io_thread_t *io_thread)
+{
+    xv_concurrent_queue_destroy(io_thread->conn_queue, (xv_queue_data_destroy_cb_t)xv_connection_destroy);
+    xv_async_destroy(io_thread->async_add_conn);
+    xv_concurrent_queue_destroy(io_thread->message_queue, xv_message_drop);
+    xv_async_destroy(io_thread->async_return_message);
+    xv_concurrent_queue_destroy(io_thread->task_queue, xv_io_thread_task_drop);
+    xv_async_destroy(io_thread->async_task);
+    for (int i = 0; i < XV_GROUP_BUCKET_SIZE; ++i) {
+        xv_group_t *group = io_thread->groups[i];
+        while (group) {
+            xv_group_t *next = group->next;
+            xv_free(group);
+            group = next;
+        }
+    }
+    xv_free(io_thread->groups);
+    xv_timer_destroy(io_thread->rate_timer);
+    if (io_thread->spare_fd >= 0) {
+        xv_close(io_thread->spare_fd);
+    }
+    xv_loop_destroy(io_thread->loop);
+    xv_free(io_thread);
+}
+
+// ----------------------------------------------------------------------------------------
+// xv_service_t
 // ----------------------------------------------------------------------------------------
-// xv_service_t
-// ----------------------------------------------------------------------------------------
+
+// fd is unique among open connections, so the slot of a connection is its fd,
+// the generation tell a new connection from the old one which had the same fd
+typedef struct xv_handle_node_t {
+    xv_service_handle_t handle;
+    struct xv_handle_node_t *next;
+} xv_handle_node_t;
+
+typedef struct xv_conn_slot_t {
+    uint64_t state;                 // XV_SLOT_STATE, any thread read it
+    xv_service_handle_t *handle;    // any thread read it, check `state` again after read
+    xv_connection_t *conn;          // just owner io thread use it
+} xv_conn_slot_t;
+
+// slot table grow by chunk when fd reach it, chunks never move or free until service destroy,
+// so any thread can read them without lock
+#define XV_CONN_SLOT_CHUNK_BITS 10
+#define XV_CONN_SLOT_CHUNK_SIZE (1 << XV_CONN_SLOT_CHUNK_BITS)
+
 struct xv_service_t {
     xv_service_config_t config;
     xv_io_thread_t **io_threads;
     xv_thread_pool_t *worker_threads;
+    xv_pool_t *message_pool;
     xv_listener_t *listeners;
-    int conn_setsize;
-    xv_connection_t **connections;
+    xv_atomic_t dispatch_rr;       // XV_DISPATCH_ROUND_ROBIN cursor
+
+    // admission control, any thread update them
+    int limit_enable;
+    xv_atomic_t pending_requests;  // requests queued or running in worker threads
+    xv_atomic_t queued_requests;   // requests waiting in worker queues, counted when `max_queued_requests` set
+    int concurrency_limit;
+    int min_limit;
+    int max_limit;
+    xv_atomic_t limit_success;     // requests under target latency since limit changed
+    int64_t limit_decrease_ns;     // last time limit decrease
+
+    // rate limit
+    int rate_limit_enable;
+    xv_addr_limit_t **addr_limits;  // client address hash bucket
+    pthread_mutex_t addr_limit_mutex;
+    int slot_count;                // max fd + 1 of connections
+    int slot_chunk_count;
+    xv_conn_slot_t **slot_chunks;  // connection slot table, index by fd, chunk is NULL before used
+    pthread_mutex_t slot_mutex;    // chunk alloc
     xv_atomic_t conn_count;
+    xv_atomic_t closed_count;      // connections closed ever, paused listeners resume when it changes
+
+    // handles of outbound connections, live until service destroy as listeners' handles,
+    // `xv_service_send_message_by_id` may use it after the connection closed
+    xv_handle_node_t *connect_handles;
+    pthread_mutex_t connect_handle_mutex;
     int start;
 };
 
-// not thread safe, but just leader io call this function
-static void xv_service_add_connection(xv_service_t *service, xv_connection_t *conn);
+static int xv_service_add_connection(xv_service_t *service, xv_connection_t *conn, int owner_idx);
+static void xv_service_release_addr_limit(xv_service_t *service, xv_addr_limit_t *limit);
 static int xv_service_del_connection(xv_service_t *service, xv_connection_t *conn);
+static void xv_service_set_connection_owner(xv_service_t *service, xv_connection_t *conn, int owner_idx);
 
 static void xv_connection_close(xv_connection_t *conn)
 {
     if (conn->status != XV_CONN_CLOSED) {
+        // worker thread check status & drop its ref under the lock, see `xv_message_direct_write`
+        xv_connection_write_lock(conn);
         conn->status = XV_CONN_CLOSED;
+        xv_connection_write_unlock(conn);
+        // conn id is invalid from now
+        xv_service_set_connection_owner(conn->io_thread->service, conn, XV_ERR);
+        xv_atomic_decr(&conn->io_thread->conn_count);
+        xv_io_thread_unlink_conn(conn->io_thread, conn);
+        xv_connection_leave_all_groups(conn->io_thread, conn);
+        if (conn->addr_limit) {
+            xv_service_release_addr_limit(conn->io_thread->service, conn->addr_limit);
+            conn->addr_limit = NULL;
+        }
         // call user on_disconnect
         if (conn->handle->on_disconnect) {
             conn->handle->on_disconnect(conn);
@@ -363,350 +1344,2196 @@ static void xv_connection_close(xv_connection_t *conn)
 
 int xv_service_send_message(xv_connection_t *conn, void *package)
 {
-    if (!conn || conn->status == XV_CONN_CLOSED) {
-        xv_log_error("conn is closed, cannot send message!");
+    if (!conn) {
+        xv_log_error("conn is NULL, cannot send message!");
+        return XV_ERR;
+    }
+    return xv_service_send_message_by_id(xv_connection_io_thread(conn)->service, conn->id, package);
+}
+
+int xv_service_send_message_by_id(xv_service_t *service, uint64_t conn_id, void *package)
+{
+    xv_service_handle_t *handle = NULL;
+    int owner_idx = xv_service_lookup_connection(service, conn_id, &handle);
+    if (owner_idx == XV_ERR) {
+        xv_log_debug("conn id: %llu is closed, cannot send message!", (unsigned long long)conn_id);
         return XV_ERR;
     }
-    xv_message_t *message = xv_message_init(conn);
+    xv_message_t *message = xv_message_init_by_id(service->message_pool, conn_id, handle);
     xv_message_set_response(message, package);  // set response, ignore request
 
-    // push message to io thread
-    xv_io_thread_t *io_thread = conn->io_thread;
-    xv_concurrent_queue_push(io_thread->message_queue, message);
-    xv_async_send(io_thread->async_return_message);
+    // push message to io thread
+    xv_io_thread_push_message(service->io_threads[owner_idx], message);
+
+    return XV_OK;
+}
+
+// drop a ref in owner io thread, release the closed connection if it is the last one
+static void xv_connection_release(xv_connection_t *conn)
+{
+    xv_connection_decr_ref(conn);
+    if (conn->status == XV_CONN_CLOSED) {
+        xv_connection_close(conn);
+    }
+}
+
+// write data in owner io thread, buffer what the kernel can't take now
+static void xv_connection_write_data(xv_loop_t *loop, xv_connection_t *conn, const char *data, int len)
+{
+    if (conn->status != XV_CONN_OPEN || len <= 0) {
+        return;
+    }
+    xv_connection_write_lock(conn);
+    if (xv_buffer_readable_size(conn->write_buffer) > 0 || conn->connecting) {
+        // write event already started, append to keep the order
+        xv_buffer_write_data(conn->write_buffer, data, len);
+        xv_connection_write_unlock(conn);
+        return;
+    }
+    int nwritten = write(conn->fd, data, len);
+    if (nwritten == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            xv_connection_write_unlock(conn);
+            xv_log_errno_error("xv_write return failed, close connection now, error");
+            xv_connection_close(conn);
+            return;
+        }
+        nwritten = 0;
+    }
+    if (nwritten < len) {
+        // unhappy, kernel socket buffer is full, start write event
+        xv_buffer_write_data(conn->write_buffer, data + nwritten, len - nwritten);
+        xv_connection_write_unlock(conn);
+        xv_io_start(loop, conn->write_io);
+        return;
+    }
+    xv_connection_write_unlock(conn);
+}
+
+// ----------------------------------------------------------------------------------------
+// broadcast, encode once and share the frame in every io thread
+// ----------------------------------------------------------------------------------------
+typedef struct xv_broadcast_task_t {
+    xv_frame_t *frame;
+    xv_connection_t **conns;    // NULL means all connections of the io thread
+    int count;
+} xv_broadcast_task_t;
+
+static void xv_broadcast_task_drop(void *args)
+{
+    xv_broadcast_task_t *task = (xv_broadcast_task_t *)args;
+    for (int i = 0; task->conns && i < task->count; ++i) {
+        xv_connection_decr_ref(task->conns[i]);
+    }
+    xv_free(task->conns);
+    xv_frame_decr_ref(task->frame);
+    xv_free(task);
+}
+
+static void io_thread_broadcast_cb(xv_io_thread_t *io_thread, void *args)
+{
+    xv_broadcast_task_t *task = (xv_broadcast_task_t *)args;
+    const char *data = xv_frame_data(task->frame);
+    int len = xv_frame_size(task->frame);
+
+    if (!task->conns) {
+        xv_connection_t *conn = io_thread->conn_list;
+        while (conn) {
+            // conn may unlink itself when write failed
+            xv_connection_t *next = conn->next;
+            xv_connection_write_data(io_thread->loop, conn, data, len);
+            conn = next;
+        }
+    } else {
+        for (int i = 0; i < task->count; ++i) {
+            xv_connection_t *conn = task->conns[i];
+            xv_io_thread_t *owner = xv_connection_io_thread(conn);
+            if (owner != io_thread) {
+                // migrated after grouping, hand this one to the new owner
+                xv_broadcast_task_t *forward = (xv_broadcast_task_t *)xv_malloc(sizeof(xv_broadcast_task_t));
+                forward->frame = task->frame;
+                forward->conns = (xv_connection_t **)xv_malloc(sizeof(xv_connection_t *));
+                forward->conns[0] = conn;
+                forward->count = 1;
+                xv_frame_incr_ref(task->frame);
+                xv_io_thread_post_task(owner, io_thread_broadcast_cb, xv_broadcast_task_drop, forward);
+                continue;
+            }
+            xv_connection_write_data(io_thread->loop, conn, data, len);
+            xv_connection_release(conn);
+        }
+        xv_free(task->conns);
+    }
+
+    xv_frame_decr_ref(task->frame);
+    xv_free(task);
+}
+
+int xv_service_broadcast(xv_service_t *service, int (*encode)(xv_buffer_t *, void *), void *packet)
+{
+    xv_frame_t *frame = xv_frame_init(encode, packet);
+    if (!frame) {
+        xv_log_error("broadcast encode failed!");
+        return XV_ERR;
+    }
+    for (int i = 0; i < service->config.io_thread_count; ++i) {
+        xv_broadcast_task_t *task = (xv_broadcast_task_t *)xv_malloc(sizeof(xv_broadcast_task_t));
+        task->frame = frame;
+        task->conns = NULL;
+        task->count = 0;
+        xv_frame_incr_ref(frame);
+        xv_io_thread_post_task(service->io_threads[i], io_thread_broadcast_cb, xv_broadcast_task_drop, task);
+    }
+    xv_frame_decr_ref(frame);
+
+    return XV_OK;
+}
+
+int xv_service_broadcast_list(xv_service_t *service, xv_connection_t **conns, int count,
+                int (*encode)(xv_buffer_t *, void *), void *packet)
+{
+    xv_frame_t *frame = xv_frame_init(encode, packet);
+    if (!frame) {
+        xv_log_error("broadcast encode failed!");
+        return XV_ERR;
+    }
+
+    // group connections by owner io thread, one task per io thread
+    int io_thread_count = service->config.io_thread_count;
+    xv_broadcast_task_t **tasks = (xv_broadcast_task_t **)xv_malloc(sizeof(xv_broadcast_task_t *) * io_thread_count);
+    memset(tasks, 0, sizeof(xv_broadcast_task_t *) * io_thread_count);
+
+    for (int i = 0; i < count; ++i) {
+        xv_connection_t *conn = conns[i];
+        if (!conn || conn->status == XV_CONN_CLOSED || conn->udp) {
+            continue;
+        }
+        int idx = xv_connection_io_thread(conn)->idx;
+        if (!tasks[idx]) {
+            tasks[idx] = (xv_broadcast_task_t *)xv_malloc(sizeof(xv_broadcast_task_t));
+            tasks[idx]->frame = frame;
+            tasks[idx]->conns = (xv_connection_t **)xv_malloc(sizeof(xv_connection_t *) * count);
+            tasks[idx]->count = 0;
+        }
+        // hold conn until its io thread write it
+        xv_connection_incr_ref(conn);
+        tasks[idx]->conns[tasks[idx]->count++] = conn;
+    }
+    for (int i = 0; i < io_thread_count; ++i) {
+        if (tasks[i]) {
+            xv_frame_incr_ref(frame);
+            xv_io_thread_post_task(service->io_threads[i], io_thread_broadcast_cb, xv_broadcast_task_drop, tasks[i]);
+        }
+    }
+    xv_free(tasks);
+    xv_frame_decr_ref(frame);
+
+    return XV_OK;
+}
+
+// ----------------------------------------------------------------------------------------
+// group join/leave/publish
+// ----------------------------------------------------------------------------------------
+typedef struct xv_group_task_t {
+    xv_connection_t *conn;
+    uint64_t group_id;
+    int join;
+    xv_frame_t *frame;
+} xv_group_task_t;
+
+static void xv_group_task_drop(void *args)
+{
+    xv_group_task_t *task = (xv_group_task_t *)args;
+    if (task->conn) {
+        xv_connection_decr_ref(task->conn);
+    }
+    if (task->frame) {
+        xv_frame_decr_ref(task->frame);
+    }
+    xv_free(task);
+}
+
+static void io_thread_group_member_cb(xv_io_thread_t *io_thread, void *args)
+{
+    xv_group_task_t *task = (xv_group_task_t *)args;
+    xv_connection_t *conn = task->conn;
+
+    // migrated, do it in the new owner
+    xv_io_thread_t *owner = xv_connection_io_thread(conn);
+    if (owner != io_thread) {
+        xv_io_thread_post_task(owner, io_thread_group_member_cb, xv_group_task_drop, task);
+        return;
+    }
+    if (conn->status == XV_CONN_OPEN) {
+        if (task->join) {
+            xv_connection_join_group(io_thread, conn, task->group_id);
+        } else {
+            xv_connection_leave_group(io_thread, conn, task->group_id);
+        }
+    }
+    xv_connection_release(conn);
+    xv_free(task);
+}
+
+static int xv_service_group_member_op(xv_connection_t *conn, uint64_t group_id, int join)
+{
+    if (!conn || conn->status == XV_CONN_CLOSED || conn->udp) {
+        xv_log_error("conn is closed or udp, cannot join/leave group!");
+        return XV_ERR;
+    }
+    xv_group_task_t *task = (xv_group_task_t *)xv_malloc(sizeof(xv_group_task_t));
+    task->conn = conn;
+    task->group_id = group_id;
+    task->join = join;
+    task->frame = NULL;
+
+    // membership is sharded by io thread, change it in the owner io thread
+    xv_connection_incr_ref(conn);
+    xv_io_thread_post_task(xv_connection_io_thread(conn), io_thread_group_member_cb, xv_group_task_drop, task);
+
+    return XV_OK;
+}
+
+int xv_service_group_join(xv_connection_t *conn, uint64_t group_id)
+{
+    return xv_service_group_member_op(conn, group_id, 1);
+}
+
+int xv_service_group_leave(xv_connection_t *conn, uint64_t group_id)
+{
+    return xv_service_group_member_op(conn, group_id, 0);
+}
+
+static void io_thread_group_publish_cb(xv_io_thread_t *io_thread, void *args)
+{
+    xv_group_task_t *task = (xv_group_task_t *)args;
+    const char *data = xv_frame_data(task->frame);
+    int len = xv_frame_size(task->frame);
+
+    xv_group_t *group = xv_io_thread_find_group(io_thread, task->group_id, 0);
+    xv_group_member_t *member = group ? group->members : NULL;
+    while (member) {
+        // member is freed when write failed and conn closed
+        xv_group_member_t *next = member->next;
+        xv_connection_write_data(io_thread->loop, member->conn, data, len);
+        member = next;
+    }
+
+    xv_frame_decr_ref(task->frame);
+    xv_free(task);
+}
+
+int xv_service_group_publish(xv_service_t *service, uint64_t group_id,
+                int (*encode)(xv_buffer_t *, void *), void *packet)
+{
+    xv_frame_t *frame = xv_frame_init(encode, packet);
+    if (!frame) {
+        xv_log_error("group publish encode failed!");
+        return XV_ERR;
+    }
+    // one task per io thread, every io thread fan out to its own members
+    for (int i = 0; i < service->config.io_thread_count; ++i) {
+        xv_group_task_t *task = (xv_group_task_t *)xv_malloc(sizeof(xv_group_task_t));
+        task->conn = NULL;
+        task->group_id = group_id;
+        task->join = 0;
+        task->frame = frame;
+        xv_frame_incr_ref(frame);
+        xv_io_thread_post_task(service->io_threads[i], io_thread_group_publish_cb, xv_group_task_drop, task);
+    }
+    xv_frame_decr_ref(frame);
+
+    return XV_OK;
+}
+
+static void xv_connection_migrate(xv_io_thread_t *io_thread, xv_connection_t *conn, xv_io_thread_t *target)
+{
+    xv_log_debug("migrate conn[%s:%d fd:%d] from IO Thread No.%d to No.%d",
+            conn->addr, conn->port, conn->fd, io_thread->idx, target->idx);
+
+    // buffers move with conn, messages arrive at the old io thread
+    // are forwarded by `io_thread_return_message_cb`
+    xv_connection_stop(io_thread->loop, conn);
+    xv_io_thread_unlink_conn(io_thread, conn);
+    xv_atomic_decr(&io_thread->conn_count);
+    xv_atomic_incr(&target->conn_count);
+    xv_connection_set_io_thread(conn, target);
+    xv_service_set_connection_owner(io_thread->service, conn, target->idx);
+
+    xv_concurrent_queue_push(target->conn_queue, conn);
+    xv_async_send(target->async_add_conn);
+}
+
+// the last pending message returned, do the waiting migration
+static void xv_connection_finish_migrate(xv_io_thread_t *io_thread, xv_connection_t *conn)
+{
+    if (!conn->migrate_target || xv_atomic_get(&conn->pending_count) > 0) {
+        return;
+    }
+    xv_io_thread_t *target = conn->migrate_target;
+    conn->migrate_target = NULL;
+    if (conn->status == XV_CONN_OPEN && target != io_thread) {
+        xv_connection_migrate(io_thread, conn, target);
+    }
+    // the ref of `xv_service_migrate_connection`, caller hold a message ref still
+    xv_connection_decr_ref(conn);
+}
+
+typedef struct xv_migrate_task_t {
+    xv_connection_t *conn;
+    xv_io_thread_t *target;
+} xv_migrate_task_t;
+
+static void xv_migrate_task_drop(void *args)
+{
+    xv_migrate_task_t *task = (xv_migrate_task_t *)args;
+    xv_connection_decr_ref(task->conn);
+    xv_free(task);
+}
+
+// run in the connection's owner io thread
+static void io_thread_migrate_cb(xv_io_thread_t *io_thread, void *args)
+{
+    xv_migrate_task_t *task = (xv_migrate_task_t *)args;
+    xv_connection_t *conn = task->conn;
+    xv_io_thread_t *target = task->target;
+
+    // migrated again before this task run, forward to the new owner
+    xv_io_thread_t *owner = xv_connection_io_thread(conn);
+    if (owner != io_thread) {
+        xv_io_thread_post_task(owner, io_thread_migrate_cb, xv_migrate_task_drop, task);
+        return;
+    }
+    xv_free(task);
+
+    if (conn->status == XV_CONN_OPEN && target != io_thread) {
+        // responses of pending messages must not be overtaken in the new io thread,
+        // worker thread check `migrate_target` under the lock before direct write
+        xv_connection_write_lock(conn);
+        if (xv_atomic_get(&conn->pending_count) > 0) {
+            int waiting = (conn->migrate_target != NULL);
+            conn->migrate_target = target;
+            xv_connection_write_unlock(conn);
+            if (waiting) {
+                // keep the ref of first migrate request only
+                xv_connection_release(conn);
+            }
+            return;
+        }
+        xv_connection_write_unlock(conn);
+        xv_connection_migrate(io_thread, conn, target);
+    }
+
+    // release the ref of `xv_service_migrate_connection`
+    xv_connection_release(conn);
+}
+
+int xv_service_migrate_connection(xv_connection_t *conn, int io_thread_idx)
+{
+    if (!conn || conn->status == XV_CONN_CLOSED || conn->udp || conn->connecting || conn->upstream) {
+        xv_log_error("conn is closed, udp, connecting or upstream, cannot migrate!");
+        return XV_ERR;
+    }
+    xv_io_thread_t *owner = xv_connection_io_thread(conn);
+    xv_service_t *service = owner->service;
+    if (io_thread_idx < 0 || io_thread_idx >= service->config.io_thread_count) {
+        xv_log_error("io_thread_idx: %d is invalid, io_thread_count: %d", io_thread_idx, service->config.io_thread_count);
+        return XV_ERR;
+    }
+
+    xv_migrate_task_t *task = (xv_migrate_task_t *)xv_malloc(sizeof(xv_migrate_task_t));
+    task->conn = conn;
+    task->target = service->io_threads[io_thread_idx];
+
+    // hold conn until the owner io thread handle it
+    xv_connection_incr_ref(conn);
+    xv_io_thread_post_task(owner, io_thread_migrate_cb, xv_migrate_task_drop, task);
+
+    return XV_OK;
+}
+
+int xv_connection_get_io_thread_idx(xv_connection_t *conn)
+{
+    return xv_connection_io_thread(conn)->idx;
+}
+
+static int64_t xv_service_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// shared by connections of a listener, outbound connection has its own
+static int64_t *xv_connection_process_cost(xv_connection_t *conn)
+{
+    return conn->listener ? &conn->listener->process_cost_ns : &conn->process_cost_ns;
+}
+
+// run `process`, measure its cost if the listener is XV_EXEC_ADAPTIVE
+static int xv_service_run_process(xv_connection_t *conn, xv_message_t *message)
+{
+    xv_service_handle_t *handle = message->handle;
+    if (handle->exec_mode != XV_EXEC_ADAPTIVE) {
+        return handle->process(message);
+    }
+    int64_t *process_cost_ns = xv_connection_process_cost(conn);
+    int64_t begin = xv_service_now_ns();
+    int ret = handle->process(message);
+    int64_t cost = xv_service_now_ns() - begin;
+
+    // ewma, 1/8 weight of new sample, io threads and workers update it without lock
+    int64_t avg = __atomic_load_n(process_cost_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(process_cost_ns, avg + (cost - avg) / 8, __ATOMIC_RELAXED);
+
+    return ret;
+}
+
+// run `process` in io thread or not
+static int xv_service_exec_inline(xv_service_t *service, xv_connection_t *conn, xv_message_t *message)
+{
+    if (!service->worker_threads) {
+        return 1;
+    }
+    if (xv_atomic_get(&conn->pending_count) > 0) {
+        // earlier requests are still out, keep responses in order
+        return 0;
+    }
+    xv_service_handle_t *handle = conn->handle;
+    int mode = handle->exec_mode;
+    if (handle->exec_hint) {
+        int hint = handle->exec_hint(message->request);
+        if (hint != XV_EXEC_DEFAULT) {
+            mode = hint;
+        }
+    }
+    if (mode == XV_EXEC_INLINE) {
+        return 1;
+    }
+    if (mode == XV_EXEC_ADAPTIVE) {
+        int inline_cost_us = service->config.inline_cost_us > 0 ? service->config.inline_cost_us : XV_DEFAULT_INLINE_COST_US;
+        return __atomic_load_n(xv_connection_process_cost(conn), __ATOMIC_RELAXED) < (int64_t)inline_cost_us * 1000;
+    }
+
+    return 0;
+}
+
+// encode response in current thread, so io thread only write the bytes
+static void xv_message_encode(xv_message_t *message)
+{
+    xv_service_handle_t *handle = message->handle;
+    if (!message->response || !handle->encode) {
+        return;
+    }
+    xv_buffer_t *encoded = xv_buffer_init(XV_DEFAULT_ENCODE_BUFFER_SIZE);
+    if (handle->encode(encoded, message->response) != XV_OK) {
+        // let io thread try again as usual
+        xv_buffer_destroy(encoded);
+        return;
+    }
+    message->encoded = encoded;
+    if (handle->packet_cleanup) {
+        handle->packet_cleanup(message->response);
+    }
+    message->response = NULL;
+}
+
+// io thread call it before push request to worker threads
+static int xv_service_admit(xv_service_t *service)
+{
+    int limit = __atomic_load_n(&service->concurrency_limit, __ATOMIC_RELAXED);
+    if (xv_atomic_incr(&service->pending_requests) > limit) {
+        xv_atomic_decr(&service->pending_requests);
+        return 0;
+    }
+    int max_queued = service->config.max_queued_requests;
+    if (max_queued > 0 && xv_atomic_incr(&service->queued_requests) > max_queued) {
+        xv_atomic_decr(&service->queued_requests);
+        xv_atomic_decr(&service->pending_requests);
+        return 0;
+    }
+    return 1;
+}
+
+// request finished in any thread, AIMD: decrease 1/10 when slow, increase 1 after `limit` fast requests
+static void xv_service_release(xv_service_t *service, int64_t latency_ns)
+{
+    xv_atomic_decr(&service->pending_requests);
+    if (!service->config.adaptive_limit_enable) {
+        return;
+    }
+    int limit = __atomic_load_n(&service->concurrency_limit, __ATOMIC_RELAXED);
+    int target_us = service->config.target_latency_us > 0 ? service->config.target_latency_us : XV_DEFAULT_TARGET_LATENCY_US;
+    int64_t target_ns = (int64_t)target_us * 1000;
+    if (latency_ns > target_ns) {
+        // decrease once per target latency, requests admitted before see the old limit
+        int64_t now = xv_service_now_ns();
+        int64_t last = __atomic_load_n(&service->limit_decrease_ns, __ATOMIC_RELAXED);
+        if (now - last > target_ns && __atomic_compare_exchange_n(&service->limit_decrease_ns, &last, now,
+                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            int new_limit = limit * 9 / 10;
+            new_limit = new_limit < service->min_limit ? service->min_limit : new_limit;
+            __atomic_store_n(&service->concurrency_limit, new_limit, __ATOMIC_RELAXED);
+            xv_atomic_set(&service->limit_success, 0);
+            xv_log_debug("request latency %lld ns, concurrency limit %d -> %d", (long long)latency_ns, limit, new_limit);
+        }
+    } else if (xv_atomic_incr(&service->limit_success) >= limit) {
+        xv_atomic_set(&service->limit_success, 0);
+        if (limit < service->max_limit) {
+            __atomic_store_n(&service->concurrency_limit, limit + 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// write encoded response to socket out of io thread, return XV_AGAIN if io thread should do it
+static int xv_message_direct_write(xv_message_t *message)
+{
+    xv_connection_t *conn = message->conn;
+    if (!message->encoded || !xv_connection_write_trylock(conn)) {
+        return XV_AGAIN;
+    }
+    // earlier responses wait in io thread or `write_buffer`, don't jump the queue
+    if (conn->status != XV_CONN_OPEN || xv_atomic_get(&conn->handoff_count) > 0
+            || xv_buffer_readable_size(conn->write_buffer) > 0 || conn->migrate_target || conn->connecting) {
+        xv_connection_write_unlock(conn);
+        return XV_AGAIN;
+    }
+    // message hold a ref, fd is not closed yet
+    int len = xv_buffer_readable_size(message->encoded);
+    int nwritten = write(conn->fd, xv_buffer_read_begin(message->encoded), len);
+    if (nwritten > 0) {
+        xv_buffer_incr_read_index(message->encoded, nwritten);
+    }
+    if (nwritten != len) {
+        // EAGAIN or error, io thread write the rest or close it, count it before unlock
+        message->handoff = 1;
+        xv_atomic_incr(&conn->handoff_count);
+        xv_connection_write_unlock(conn);
+        return XV_AGAIN;
+    }
+    if (message->pending) {
+        xv_atomic_decr(&conn->pending_count);
+    }
+    // drop ref under the lock, io thread close it will see the new ref_count
+    xv_connection_decr_ref(conn);
+    message->conn = NULL;
+    xv_connection_write_unlock(conn);
+
+    xv_message_destroy(message, message->handle->packet_cleanup);
+
+    return XV_OK;
+}
+
+// response is ready out of io thread, write it directly or push to io thread
+static void xv_message_return(xv_message_t *message)
+{
+    xv_io_thread_t *io_thread = xv_connection_io_thread(xv_message_get_connection(message));
+    xv_service_config_t *config = &io_thread->service->config;
+    if (message->admitted) {
+        message->admitted = 0;
+        xv_service_release(io_thread->service, xv_service_now_ns() - message->admit_ns);
+    }
+    if (config->worker_encode_enable || config->direct_write_enable) {
+        xv_message_encode(message);
+    }
+    // udp response need the batch in io thread, worker just encode it
+    if (config->direct_write_enable && !message->conn->udp) {
+        if (xv_message_direct_write(message) == XV_OK) {
+            return;
+        }
+        if (!message->handoff) {
+            message->handoff = 1;
+            xv_atomic_incr(&message->conn->handoff_count);
+        }
+    }
+    // message hold a ref of conn, io thread drop it if conn closed
+    xv_io_thread_push_message(io_thread, message);
+}
+
+static void thread_pool_task_cb(void *args)
+{
+    xv_message_t *message = (xv_message_t *)args;
+    xv_service_t *service = xv_connection_io_thread(xv_message_get_connection(message))->service;
+    if (message->admitted && service->config.max_queued_requests > 0) {
+        // leave the queue, running request is bound by the concurrency limit only
+        xv_atomic_decr(&service->queued_requests);
+    }
+    if (xv_service_run_process(xv_message_get_connection(message), message) == XV_AGAIN) {
+        // deferred, `xv_message_complete` return it later
+        return;
+    }
+    xv_message_return(message);
+}
+
+// rejected message wait for earlier requests of the connection in worker thread
+static void thread_pool_reject_cb(void *args)
+{
+    xv_message_return((xv_message_t *)args);
+}
+
+void xv_message_complete(xv_message_t *message, void *response)
+{
+    if (response) {
+        xv_message_set_response(message, response);
+    }
+    xv_message_return(message);
+}
+
+static void xv_connection_write_packet(xv_loop_t *loop, xv_connection_t *conn, int (*encode)(xv_buffer_t *, void *), void *packet);
+
+static void process_message(xv_loop_t *loop, xv_message_t *message, xv_connection_t *conn, xv_service_handle_t *handle)
+{
+    if (conn->udp) {
+        xv_udp_push_response(loop, conn, message);
+        return;
+    }
+    if (message->encoded) {
+        xv_connection_write_data(loop, conn, xv_buffer_read_begin(message->encoded), xv_buffer_readable_size(message->encoded));
+        return;
+    }
+    void *response = xv_message_get_response(message);
+    if (!response || !handle->encode) {
+        xv_log_debug("response: %p, handle->encode: %p, cannot process message, return", response, handle->encode);
+        return;
+    }
+    xv_connection_write_packet(loop, conn, handle->encode, response);
+}
+
+// encode `packet` into write buffer of conn and write it, in owner io thread
+static void xv_connection_write_packet(xv_loop_t *loop, xv_connection_t *conn, int (*encode)(xv_buffer_t *, void *), void *packet)
+{
+    xv_connection_write_lock(conn);
+    int pending_size = xv_buffer_readable_size(conn->write_buffer);
+    encode(conn->write_buffer, packet);
+    int want_write_size = xv_buffer_readable_size(conn->write_buffer);
+    if (want_write_size == 0 || pending_size > 0 || conn->connecting) {
+        // nothing to write, or write event already started and will flush it
+        xv_connection_write_unlock(conn);
+        return;
+    }
+    int nwritten = write(conn->fd, xv_buffer_read_begin(conn->write_buffer), want_write_size);
+    if (nwritten == -1 && errno != EAGAIN && errno != EINTR) {
+        xv_connection_write_unlock(conn);
+        xv_log_errno_error("xv_write return failed, close connection now, error");
+        xv_connection_close(conn);
+    } else {
+        if (nwritten > 0) {
+            // incr buffer index
+            xv_buffer_incr_read_index(conn->write_buffer, nwritten);
+        }
+        xv_connection_write_unlock(conn);
+        // check write size
+        if (nwritten < want_write_size && conn->status == XV_CONN_OPEN) {
+            // unhappy, kernel socket buffer is full, start write event
+            xv_io_start(loop, conn->write_io);
+        }
+    }
+}
+
+// message processed in io thread, release conn if it closed by the write
+static void process_local_message(xv_loop_t *loop, xv_message_t *message, xv_connection_t *conn, xv_service_handle_t *handle)
+{
+    process_message(loop, message, conn, handle);
+    xv_message_destroy(message, handle->packet_cleanup);
+    if (conn->status == XV_CONN_CLOSED) {
+        xv_connection_close(conn);
+    }
+}
+
+static void process_request(xv_loop_t *loop, xv_connection_t *conn, xv_service_handle_t *handle, void *request)
+{
+    xv_service_t *service = conn->io_thread->service;
+    xv_message_t *message = xv_message_init(service->message_pool, conn);
+    xv_message_set_request(message, request);
+
+    if (xv_service_exec_inline(service, conn, message)) {
+        // do process in self io thread, count it first, `xv_message_complete` may be
+        // called before `process` return
+        message->pending = 1;
+        xv_atomic_incr(&conn->pending_count);
+        if (xv_service_run_process(conn, message) == XV_AGAIN) {
+            // deferred, `xv_message_complete` return it later
+            return;
+        }
+        message->pending = 0;
+        xv_atomic_decr(&conn->pending_count);
+        process_local_message(loop, message, conn, handle);
+    } else if (service->limit_enable && !xv_service_admit(service)) {
+        // overload, let user send a busy response
+        xv_log_debug("pending requests over limit %d, reject request", service->concurrency_limit);
+        if (handle->on_reject) {
+            handle->on_reject(message);
+        }
+        if (xv_atomic_get(&conn->pending_count) == 0) {
+            process_local_message(loop, message, conn, handle);
+        } else {
+            // keep responses in order, worker just return it
+            message->pending = 1;
+            xv_atomic_incr(&conn->pending_count);
+            xv_thread_pool_push_task(service->worker_threads, thread_pool_reject_cb, message, xv_message_hash(message));
+        }
+    } else {
+        xv_log_debug("we have worker threa pool, now push task");
+        if (service->limit_enable) {
+            message->admitted = 1;
+            message->admit_ns = service->config.adaptive_limit_enable ? xv_service_now_ns() : 0;
+        }
+        message->pending = 1;
+        xv_atomic_incr(&conn->pending_count);
+        // move message to worker thread pool, message is the task, hash by fd (or udp peer)
+        // keep requests of one connection in one worker, so responses keep the order
+        xv_thread_pool_push_task(service->worker_threads, thread_pool_task_cb, message, xv_message_hash(message));
+    }
+}
+
+// ----------------------------------------------------------------------------------------
+// rate limit, connection stop reading when tokens run out, rate timer resume it
+// ----------------------------------------------------------------------------------------
+struct xv_addr_limit_t {
+    char addr[XV_ADDR_LEN];
+    int ref_count;                  // connections from this address, protect by `addr_limit_mutex`
+    int lock;                       // spin lock of buckets, io threads share them
+    xv_token_bucket_t request_bucket;
+    xv_token_bucket_t byte_bucket;
+    xv_addr_limit_t *next;
+};
+
+static int xv_connection_rate_ready(xv_connection_t *conn, int64_t now_ns)
+{
+    if (!xv_token_bucket_ready(&conn->request_bucket, now_ns) || !xv_token_bucket_ready(&conn->byte_bucket, now_ns)) {
+        return 0;
+    }
+    xv_addr_limit_t *limit = conn->addr_limit;
+    if (!limit) {
+        return 1;
+    }
+    while (__atomic_exchange_n(&limit->lock, 1, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+    int ready = xv_token_bucket_ready(&limit->request_bucket, now_ns) && xv_token_bucket_ready(&limit->byte_bucket, now_ns);
+    __atomic_store_n(&limit->lock, 0, __ATOMIC_RELEASE);
+
+    return ready;
+}
+
+static void xv_connection_rate_take(xv_connection_t *conn, int requests, int bytes)
+{
+    xv_token_bucket_take(&conn->request_bucket, requests);
+    xv_token_bucket_take(&conn->byte_bucket, bytes);
+
+    xv_addr_limit_t *limit = conn->addr_limit;
+    if (!limit) {
+        return;
+    }
+    while (__atomic_exchange_n(&limit->lock, 1, __ATOMIC_ACQUIRE)) {
+        ;
+    }
+    xv_token_bucket_take(&limit->request_bucket, requests);
+    xv_token_bucket_take(&limit->byte_bucket, bytes);
+    __atomic_store_n(&limit->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void xv_connection_rate_pause(xv_connection_t *conn)
+{
+    xv_io_thread_t *io_thread = conn->io_thread;
+
+    xv_log_debug("conn[%s:%d fd:%d] over rate limit, pause reading", conn->addr, conn->port, conn->fd);
+
+    xv_io_stop(io_thread->loop, conn->read_io);
+    conn->rate_paused = 1;
+    conn->paused_prev = NULL;
+    conn->paused_next = io_thread->paused_list;
+    if (io_thread->paused_list) {
+        io_thread->paused_list->paused_prev = conn;
+    } else {
+        xv_timer_start(io_thread->loop, io_thread->rate_timer);
+    }
+    io_thread->paused_list = conn;
+}
+
+static int xv_upstream_conn_response(xv_connection_t *conn, void *response);
+
+// decode and process all requests in read buffer, unless rate limit
+static void process_read_buffer(xv_loop_t *loop, xv_connection_t *conn, xv_service_handle_t *handle)
+{
+    // do user decode
+    if (!handle->decode || (!handle->process && !conn->upstream)) {
+        xv_log_debug("handle->decode: %p, handle->process: %p, read buffer drop and return", handle->decode, handle->process);
+        // clear buffer, drop data and return
+        xv_buffer_clear(conn->read_buffer);
+        return;
+    }
+    int rate_limit_enable = conn->io_thread->service->rate_limit_enable;
+    while (conn->status == XV_CONN_OPEN && !conn->rate_paused) {
+        int size = xv_buffer_readable_size(conn->read_buffer);
+        if (size == 0) {
+            return;
+        }
+        if (rate_limit_enable && !xv_connection_rate_ready(conn, xv_service_now_ns())) {
+            xv_connection_rate_pause(conn);
+            return;
+        }
+        void *request = NULL;
+        int ret = handle->decode(conn->read_buffer, &request);
+        if (ret == XV_OK) {
+            if (rate_limit_enable) {
+                xv_connection_rate_take(conn, 1, 0);
+            }
+            if (conn->upstream) {
+                // response of a upstream request, callback in io thread
+                if (xv_upstream_conn_response(conn, request) != XV_OK) {
+                    xv_connection_close(conn);
+                    return;
+                }
+            } else {
+                //  do user process
+                process_request(loop, conn, handle, request);
+            }
+            if (xv_buffer_readable_size(conn->read_buffer) >= size) {
+                // decode take nothing, wait more data
+                return;
+            }
+        } else if (ret == XV_ERR) {
+            // decode failed! close it
+            xv_connection_close(conn);
+            return;
+        } else {
+            // if XV_AGAIN, wait more data
+            return;
+        }
+    }
+}
+
+static void io_thread_rate_timer_cb(xv_loop_t *loop, xv_timer_t *timer)
+{
+    xv_io_thread_t *io_thread = (xv_io_thread_t *)xv_timer_get_userdata(timer);
+    int64_t now_ns = xv_service_now_ns();
+
+    xv_connection_t *conn = io_thread->paused_list;
+    while (conn) {
+        xv_connection_t *next = conn->paused_next;
+        if (xv_connection_rate_ready(conn, now_ns)) {
+            xv_log_debug("conn[%s:%d fd:%d] tokens refilled, resume reading", conn->addr, conn->port, conn->fd);
+
+            if (conn->paused_prev) {
+                conn->paused_prev->paused_next = conn->paused_next;
+            } else {
+                io_thread->paused_list = conn->paused_next;
+            }
+            if (conn->paused_next) {
+                conn->paused_next->paused_prev = conn->paused_prev;
+            }
+            conn->paused_prev = NULL;
+            conn->paused_next = NULL;
+            conn->rate_paused = 0;
+
+            xv_io_start(loop, conn->read_io);
+            // requests read before pause, may pause again and link to list head
+            process_read_buffer(loop, conn, conn->handle);
+        }
+        conn = next;
+    }
+    if (!io_thread->paused_list) {
+        xv_timer_stop(loop, timer);
+    }
+}
+
+static int xv_addr_limit_hash(const char *addr)
+{
+    uint32_t hash = 5381;
+    for (const char *p = addr; *p; ++p) {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+    return hash % XV_ADDR_LIMIT_BUCKET_SIZE;
+}
+
+static xv_addr_limit_t *xv_service_acquire_addr_limit(xv_service_t *service, const char *addr)
+{
+    int idx = xv_addr_limit_hash(addr);
+
+    int64_t now_ns = xv_service_now_ns();
+    pthread_mutex_lock(&service->addr_limit_mutex);
+    xv_addr_limit_t **prev = &service->addr_limits[idx];
+    xv_addr_limit_t *limit = *prev;
+    while (limit && strcmp(limit->addr, addr) != 0) {
+        if (limit->ref_count == 0 && xv_token_bucket_full(&limit->request_bucket, now_ns)
+                && xv_token_bucket_full(&limit->byte_bucket, now_ns)) {
+            // idle address refilled, forget it
+            *prev = limit->next;
+            xv_free(limit);
+        } else {
+            prev = &limit->next;
+        }
+        limit = *prev;
+    }
+    if (!limit) {
+        limit = (xv_addr_limit_t *)xv_malloc(sizeof(xv_addr_limit_t));
+        strncpy(limit->addr, addr, XV_ADDR_LEN);
+        limit->ref_count = 0;
+        limit->lock = 0;
+        xv_token_bucket_init(&limit->request_bucket, service->config.addr_request_rate, now_ns);
+        xv_token_bucket_init(&limit->byte_bucket, service->config.addr_byte_rate, now_ns);
+        limit->next = service->addr_limits[idx];
+        service->addr_limits[idx] = limit;
+    }
+    limit->ref_count++;
+    pthread_mutex_unlock(&service->addr_limit_mutex);
+
+    return limit;
+}
+
+// keep it after the last connection of the address closed, reconnect don't get a new burst,
+// `xv_service_acquire_addr_limit` forget it once the buckets refill
+static void xv_service_release_addr_limit(xv_service_t *service, xv_addr_limit_t *limit)
+{
+    pthread_mutex_lock(&service->addr_limit_mutex);
+    limit->ref_count--;
+    pthread_mutex_unlock(&service->addr_limit_mutex);
+}
+
+// ----------------------------------------------------------------------------------------
+// outbound connection, connect complete or fail in owner io thread
+// ----------------------------------------------------------------------------------------
+static void connection_connect_timer_cb(xv_loop_t *loop, xv_timer_t *timer)
+{
+    xv_connection_t *conn = (xv_connection_t *)xv_timer_get_userdata(timer);
+
+    xv_log_error("connect to %s:%d timeout, close it", conn->addr, conn->port);
+    // timer cb don't touch the timer after return
+    xv_connection_destroy_connect_timer(loop, conn);
+    xv_connection_close(conn);
+}
+
+// wait for writable, it means connect complete or fail
+static void xv_connection_start_connect(xv_loop_t *loop, xv_connection_t *conn)
+{
+    xv_service_t *service = conn->io_thread->service;
+    int timeout_ms = service->config.connect_timeout_ms > 0 ? service->config.connect_timeout_ms : XV_DEFAULT_CONNECT_TIMEOUT_MS;
+
+    conn->connect_timer = xv_timer_init(connection_connect_timer_cb, timeout_ms, 0);
+    if (!conn->connect_timer) {
+        // no fd for the timerfd, fail it as a connect error
+        xv_log_error("connect to %s:%d no timer, close it", conn->addr, conn->port);
+        xv_connection_close(conn);
+        return;
+    }
+    xv_timer_set_userdata(conn->connect_timer, conn);
+    xv_timer_start(loop, conn->connect_timer);
+    xv_io_start(loop, conn->write_io);
+}
+
+// call `on_connect` and start reading if connected, close it if not
+static int xv_connection_finish_connect(xv_loop_t *loop, xv_connection_t *conn)
+{
+    xv_connection_destroy_connect_timer(loop, conn);
+
+    int err = xv_socket_error(conn->fd);
+    if (err != 0) {
+        char errbuf[128];
+        xv_log_error("connect to %s:%d failed: %s", conn->addr, conn->port, xv_strerror(err, errbuf, sizeof(errbuf)));
+        xv_connection_close(conn);
+        return XV_ERR;
+    }
+    xv_log_debug("connect to %s:%d fd: %d success", conn->addr, conn->port, conn->fd);
+
+    // worker threads can write it directly from now
+    xv_connection_write_lock(conn);
+    conn->connecting = 0;
+    xv_connection_write_unlock(conn);
+
+    if (conn->handle->on_connect) {
+        conn->handle->on_connect(conn);
+    }
+    xv_io_start(loop, conn->read_io);
+
+    return XV_OK;
+}
+
+static void on_connection_read(xv_loop_t *loop, xv_io_t *io)
+{
+    int fd = xv_io_get_fd(io);
+    xv_connection_t *conn = (xv_connection_t *)xv_io_get_userdata(io);
+    xv_service_handle_t *handle = conn->handle;
+
+    if (conn->status == XV_CONN_CLOSED) {
+        return;
+    }
+
+    // no token, don't read, kernel buffer and tcp window push back the client
+    if (conn->io_thread->service->rate_limit_enable && !xv_connection_rate_ready(conn, xv_service_now_ns())) {
+        xv_connection_rate_pause(conn);
+        return;
+    }
+
+    // max read `XV_DEFAULT_READ_SIZE` bytes
+    xv_buffer_ensure_writeable_size(conn->read_buffer, XV_DEFAULT_READ_SIZE);
+
+    int nread = read(fd, xv_buffer_write_begin(conn->read_buffer), XV_DEFAULT_READ_SIZE);
+    if (nread <= 0) {
+        if (nread == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        xv_log_errno_error("xv_read return failed, close connection now, error");
+
+        // will close it
+        xv_connection_close(conn);
+    } else {
+        xv_log_debug("read from fd: %d, nread: %d", conn->fd, nread);
+
+        // ret > 0, incr buffer index
+        xv_buffer_incr_write_index(conn->read_buffer, nread);
+        if (conn->io_thread->service->rate_limit_enable) {
+            xv_connection_rate_take(conn, 0, nread);
+        }
+        process_read_buffer(loop, conn, handle);
+    }
+}
+
+static void on_connection_write(xv_loop_t *loop, xv_io_t *io)
+{
+    xv_connection_t *conn = (xv_connection_t *)xv_io_get_userdata(io);
+
+    if (conn->connecting && xv_connection_finish_connect(loop, conn) != XV_OK) {
+        return;
+    }
+
+    int buffer_size = xv_buffer_readable_size(conn->write_buffer);
+    if (buffer_size > 0) {
+        xv_connection_write_lock(conn);
+        int nwritten = write(conn->fd, xv_buffer_read_begin(conn->write_buffer), buffer_size);
+        if (nwritten == 0 || (nwritten == -1 && errno != EAGAIN && errno != EINTR)) {
+            xv_connection_write_unlock(conn);
+            xv_log_errno_error("xv_write return failed, close connection now, error");
+
+            xv_connection_close(conn);
+        } else {
+            if (nwritten > 0) {
+                // incr buffer index
+                xv_buffer_incr_read_index(conn->write_buffer, nwritten);
+            }
+            xv_connection_write_unlock(conn);
+            if (nwritten == buffer_size) {
+                // happy, write all data success, stop write event
+                xv_io_stop(loop, conn->write_io);
+            }
+        }
+    } else {
+        xv_io_stop(loop, conn->write_io);
+    }
+}
+
+// one datagram is one or more whole requests, what decode leave is dropped, no rate limit for udp
+static void on_udp_read(xv_loop_t *loop, xv_io_t *io)
+{
+    xv_connection_t *conn = (xv_connection_t *)xv_io_get_userdata(io);
+    xv_service_handle_t *handle = conn->handle;
+    xv_udp_t *udp = conn->udp;
+
+    int n = recvmmsg(conn->fd, udp->recv_msgs, udp->batch_size, MSG_DONTWAIT, NULL);
+    if (n <= 0) {
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            xv_log_errno_error("recvmmsg return failed, error");
+        }
+        return;
+    }
+    xv_log_debug("recvmmsg from fd: %d, datagrams: %d", conn->fd, n);
+
+    for (int i = 0; i < n; ++i) {
+        xv_buffer_t *buffer = udp->recv_packets[i].buffer;
+        if (udp->recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            xv_log_debug("datagram over %d bytes, drop it", udp->datagram_size);
+        } else if (handle->decode && handle->process) {
+            xv_buffer_incr_write_index(buffer, udp->recv_msgs[i].msg_len);
+            udp->peer = &udp->recv_packets[i].addr;
+            while (xv_buffer_readable_size(buffer) > 0) {
+                int size = xv_buffer_readable_size(buffer);
+                void *request = NULL;
+                if (handle->decode(buffer, &request) != XV_OK) {
+                    break;
+                }
+                process_request(loop, conn, handle, request);
+                if (xv_buffer_readable_size(buffer) >= size) {
+                    break;
+                }
+            }
+            udp->peer = NULL;
+        }
+        xv_udp_prepare_recv(udp, i);
+    }
+
+    // responses of inline process
+    xv_udp_flush(loop, conn);
+}
+
+// ----------------------------------------------------------------------------------------
+// connection dispatch policy, choose a io thread in [first, first + count)
+// ----------------------------------------------------------------------------------------
+typedef int (*xv_dispatch_cb_t)(xv_service_t *service, xv_connection_t *conn, int first, int count);
+
+static int dispatch_fd_hash(xv_service_t *service, xv_connection_t *conn, int first, int count)
+{
+    return first + conn->fd % count;
+}
+
+static int dispatch_round_robin(xv_service_t *service, xv_connection_t *conn, int first, int count)
+{
+    return first + (unsigned int)xv_atomic_incr(&service->dispatch_rr) % count;
+}
+
+static int dispatch_least_conn(xv_service_t *service, xv_connection_t *conn, int first, int count)
+{
+    int best = first;
+    int best_count = xv_atomic_get(&service->io_threads[first]->conn_count);
+    for (int i = first + 1; i < first + count; ++i) {
+        int conn_count = xv_atomic_get(&service->io_threads[i]->conn_count);
+        if (conn_count < best_count) {
+            best = i;
+            best_count = conn_count;
+        }
+    }
+    return best;
+}
+
+static int dispatch_least_load(xv_service_t *service, xv_connection_t *conn, int first, int count)
+{
+    // loop load only refresh every 100ms, break ties by connection count so
+    // a burst of new connections doesn't all land on the same io thread
+    int best = first;
+    int best_load = xv_loop_get_load(service->io_threads[first]->loop);
+    int best_count = xv_atomic_get(&service->io_threads[first]->conn_count);
+    for (int i = first + 1; i < first + count; ++i) {
+        int load = xv_loop_get_load(service->io_threads[i]->loop);
+        int conn_count = xv_atomic_get(&service->io_threads[i]->conn_count);
+        if (load < best_load || (load == best_load && conn_count < best_count)) {
+            best = i;
+            best_load = load;
+            best_count = conn_count;
+        }
+    }
+    return best;
+}
+
+static const xv_dispatch_cb_t xv_dispatch_policies[] = {
+    [XV_DISPATCH_FD_HASH] = dispatch_fd_hash,
+    [XV_DISPATCH_ROUND_ROBIN] = dispatch_round_robin,
+    [XV_DISPATCH_LEAST_CONN] = dispatch_least_conn,
+    [XV_DISPATCH_LEAST_LOAD] = dispatch_least_load,
+};
+
+static xv_io_thread_t *xv_service_dispatch_io_thread(xv_service_t *service, xv_connection_t *conn)
+{
+    // leader only accept, unless `leader_serve_enable`
+    int first = service->config.leader_serve_enable ? 0 : 1;
+    int count = service->config.io_thread_count - first;
+    int idx = xv_dispatch_policies[service->config.dispatch_policy](service, conn, first, count);
+
+    xv_log_debug("dispatch conn[%s:%d fd:%d] to IO Thread No.%d", conn->addr, conn->port, conn->fd, idx);
+
+    return service->io_threads[idx];
+}
+
+static void xv_listener_add_connection(xv_loop_t *loop, xv_listener_t *listener, int client_fd, const char *addr, int port)
+{
+    xv_service_t *service = listener->io_thread->service;
+    xv_service_handle_t *handle = &listener->handle;
+    xv_connection_t *conn = xv_connection_init(addr, port, client_fd, handle, on_connection_read, on_connection_write);
+    conn->listener = listener;
+    conn->write_lock_enable = service->config.direct_write_enable;
+    if (service->rate_limit_enable) {
+        int64_t now_ns = xv_service_now_ns();
+        xv_token_bucket_init(&conn->request_bucket, service->config.conn_request_rate, now_ns);
+        xv_token_bucket_init(&conn->byte_bucket, service->config.conn_byte_rate, now_ns);
+        if (service->config.addr_request_rate > 0 || service->config.addr_byte_rate > 0) {
+            conn->addr_limit = xv_service_acquire_addr_limit(service, addr);
+        }
+    }
+
+    // keep conn in myself loop or send conn to other io thread
+    int io_thread_count = service->config.io_thread_count;
+    int keep_local = (io_thread_count == 1 || (service->config.reuseport_enable && !listener->is_unix));
+    xv_io_thread_t *io_thread = keep_local ? listener->io_thread : xv_service_dispatch_io_thread(service, conn);
+    if (io_thread == listener->io_thread) {
+        keep_local = 1;
+    }
+
+    // add conn to service
+    if (xv_service_add_connection(service, conn, io_thread->idx) != XV_OK) {
+        if (conn->addr_limit) {
+            xv_service_release_addr_limit(service, conn->addr_limit);
+            conn->addr_limit = NULL;
+        }
+        xv_close(client_fd);
+        xv_connection_destroy(conn);
+        return;
+    }
+    xv_atomic_incr(&io_thread->conn_count);
+    xv_connection_set_io_thread(conn, io_thread);
+
+    // user on_conn callback
+    if (handle->on_connect) {
+        handle->on_connect(conn);
+    }
+
+    if (keep_local) {
+        // start socket READ event to myself loop
+        xv_io_thread_link_conn(io_thread, conn);
+        xv_io_start(loop, conn->read_io);
+    } else {
+        xv_concurrent_queue_push(io_thread->conn_queue, conn);
+        xv_async_send(io_thread->async_add_conn);
+    }
+}
+
+// out of fds, the level-triggered listen fd would fire again at once, so drop the pending
+// connections by the spare fd, then stop accept until a connection closed or backoff timeout
+static void xv_listener_pause_accept(xv_loop_t *loop, xv_listener_t *listener)
+{
+    xv_io_thread_t *io_thread = listener->io_thread;
+    xv_service_t *service = io_thread->service;
+
+    // reject the backlog, clients see close at once rather than hang
+    if (io_thread->spare_fd >= 0) {
+        xv_close(io_thread->spare_fd);
+        for (int i = 0; i < XV_DEFAULT_ACCEPT_BATCH_SIZE; ++i) {
+            int fd = accept(listener->listen_fd, NULL, NULL);
+            if (fd < 0) {
+                break;
+            }
+            xv_close(fd);
+        }
+        io_thread->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    xv_log_warn("out of fds, pause accept on %s:%d for %dms, connections: %d",
+            listener->addr, listener->port, listener->accept_backoff_ms, xv_atomic_get(&service->conn_count));
+
+    xv_io_stop(loop, listener->listen_io);
+    listener->accept_paused_ms = 0;
+    listener->closed_snapshot = xv_atomic_get(&service->closed_count);
+    xv_timer_start(loop, listener->accept_timer);
+}
+
+static void listener_accept_timer_cb(xv_loop_t *loop, xv_timer_t *timer)
+{
+    xv_listener_t *listener = (xv_listener_t *)xv_timer_get_userdata(timer);
+    xv_service_t *service = listener->io_thread->service;
+
+    listener->accept_paused_ms += XV_ACCEPT_RETRY_TICK_MS;
+    if (xv_atomic_get(&service->closed_count) == listener->closed_snapshot
+            && listener->accept_paused_ms < listener->accept_backoff_ms) {
+        return;
+    }
+
+    // fds released or backoff timeout, try again, wait longer if still out of fds
+    xv_timer_stop(loop, timer);
+    if (service->start) {
+        xv_io_start(loop, listener->listen_io);
+    }
+    if (listener->accept_backoff_ms < XV_ACCEPT_BACKOFF_MAX_MS) {
+        listener->accept_backoff_ms *= 2;
+    }
+}
+
+// leader io thread call this function, or every io thread when `reuseport_enable`
+static void on_new_connection(xv_loop_t *loop, xv_io_t *io)
+{
+    int listen_fd = xv_io_get_fd(io);
+    xv_listener_t *listener = (xv_listener_t *)xv_io_get_userdata(io);
+    xv_service_t *service = listener->io_thread->service;
+
+    int batch_size = service->config.accept_batch_size;
+    if (batch_size <= 0) {
+        // leader serve its own connections too, a smaller batch keep the accept
+        // work bounded per loop round so a connect storm can't starve them
+        batch_size = service->config.leader_serve_enable ?
+                XV_DEFAULT_LEADER_SERVE_ACCEPT_BATCH_SIZE : XV_DEFAULT_ACCEPT_BATCH_SIZE;
+    }
+
+    // drain the backlog until EAGAIN, but accept at most `batch_size` connections per
+    // event so the other fds in this loop still get their turn during a connect storm.
+    // socket options were set on listen_fd, accepted sockets inherit most of them
+    for (int i = 0; i < batch_size; ++i) {
+        char addr[XV_ADDR_LEN] = XV_UNIX_CONN_ADDR;
+        int port = 0;
+        int client_fd = listener->is_unix ? xv_unix_nonblock_accept(listen_fd)
+                : xv_tcp_nonblock_accept(listen_fd, addr, sizeof(addr), &port);
+        if (client_fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                xv_listener_pause_accept(loop, listener);
+            }
+            break;
+        }
+        listener->accept_backoff_ms = XV_ACCEPT_BACKOFF_MIN_MS;
+        xv_log_debug("xv_tcp_accept new connection: %s:%d", addr, port);
+
+        if (listener->accepted_options && xv_tcp_set_accepted_options(client_fd, &listener->options) != XV_OK) {
+            xv_close(client_fd);
+            continue;
+        }
+
+        xv_listener_add_connection(loop, listener, client_fd, addr, port);
+    }
+}
+
+static void xv_io_thread_start_listeners(xv_io_thread_t *io_thread)
+{
+    xv_listener_t *listener = io_thread->service->listeners;
+    while (listener) {
+        if (listener->io_thread_idx == io_thread->idx) {
+            xv_log_debug("IO Thread No.%d add listener, addr: %s:%d", io_thread->idx, listener->addr, listener->port);
+
+            listener->io_thread = io_thread;
+            xv_connection_t *udp_conn = listener->udp_conn;
+            if (udp_conn) {
+                xv_connection_set_io_thread(udp_conn, io_thread);
+                udp_conn->udp->next = io_thread->udp_list;
+                io_thread->udp_list = udp_conn;
+                xv_io_start(io_thread->loop, udp_conn->read_io);
+            } else {
+                xv_io_start(io_thread->loop, listener->listen_io);
+            }
+        }
+        listener = listener->next;
+    }
+}
+
+static void xv_io_thread_stop_listeners(xv_io_thread_t *io_thread)
+{
+    xv_listener_t *listener = io_thread->service->listeners;
+    while (listener) {
+        if (listener->io_thread == io_thread) {
+            xv_log_debug("IO Thread No.%d del listener, addr: %s:%d", io_thread->idx, listener->addr, listener->port);
+
+            xv_io_stop(io_thread->loop, listener->listen_io);
+            xv_timer_stop(io_thread->loop, listener->accept_timer);
+            if (listener->udp_conn) {
+                xv_connection_stop(io_thread->loop, listener->udp_conn);
+            }
+            listener->io_thread = NULL;
+        }
+        listener = listener->next;
+    }
+}
+
+static void *io_thread_entry(void *args)
+{
+    xv_io_thread_t *io_thread = (xv_io_thread_t *)args;
+
+    // start all async
+    xv_async_start(io_thread->loop, io_thread->async_add_conn);
+    xv_async_start(io_thread->loop, io_thread->async_return_message);
+    xv_async_start(io_thread->loop, io_thread->async_task);
+
+    if (io_thread->idx == 0) {
+        xv_log_debug("I'am leader IO Thread, add all listen fd event");
+    } else {
+        xv_log_debug("I'am follower IO Thread No.%d, wait Leader send xv_connection_t", io_thread->idx);
+    }
+    // the leader owns all listeners, unless every io thread has its own reuseport listener
+    xv_io_thread_start_listeners(io_thread);
+
+    // loop run until service stop
+    xv_loop_run_timeout(io_thread->loop, 10);  // 100 times per second
+
+    xv_io_thread_stop_listeners(io_thread);
+    xv_timer_stop(io_thread->loop, io_thread->rate_timer);
+
+    if (io_thread->idx == 0) {
+        xv_log_debug("leader IO Thread exit");
+    } else {
+        xv_log_debug("follower IO Thread exit");
+    }
+
+    return NULL;
+}
+
+xv_service_t *xv_service_init(xv_service_config_t config)
+{
+    if (config.io_thread_count <= 0 || config.worker_thread_count < 0) {
+        xv_log_error("config.io_thread_count must > 0, config.worker_thread_count must >= 0");
+        return NULL;
+    }
+    if (config.dispatch_policy < XV_DISPATCH_FD_HASH || config.dispatch_policy > XV_DISPATCH_LEAST_LOAD) {
+        xv_log_error("config.dispatch_policy: %d is invalid", config.dispatch_policy);
+        return NULL;
+    }
+    xv_service_t *service = (xv_service_t *)xv_malloc(sizeof(xv_service_t));
+    service->io_threads = (xv_io_thread_t **)xv_malloc(sizeof(xv_io_thread_t *) * config.io_thread_count);
+    for (int i = 0; i < config.io_thread_count; ++i) {
+        service->io_threads[i] = xv_io_thread_init(i, service);
+        if (config.dispatch_policy == XV_DISPATCH_LEAST_LOAD) {
+            xv_loop_enable_load_stat(service->io_threads[i]->loop);
+        }
+    }
+    if (config.worker_thread_count > 0) {
+        service->worker_threads = xv_thread_pool_init(config.worker_thread_count);
+    } else {
+        service->worker_threads = NULL;
+    }
+    service->message_pool = xv_pool_init(sizeof(xv_message_t), 0);
+    service->config = config;
+    service->listeners = NULL;
+    xv_atomic_set(&service->dispatch_rr, 0);
+
+    service->limit_enable = (config.max_pending_requests > 0 || config.max_queued_requests > 0
+            || config.adaptive_limit_enable);
+    xv_atomic_set(&service->pending_requests, 0);
+    xv_atomic_set(&service->queued_requests, 0);
+    service->max_limit = config.max_pending_requests > 0 ? config.max_pending_requests : XV_DEFAULT_CONCURRENCY_LIMIT;
+    service->min_limit = config.worker_thread_count < service->max_limit ? config.worker_thread_count : service->max_limit;
+    if (service->min_limit < 1) {
+        service->min_limit = 1;
+    }
+    service->concurrency_limit = service->max_limit;
+    xv_atomic_set(&service->limit_success, 0);
+    service->limit_decrease_ns = 0;
+
+    service->rate_limit_enable = (config.conn_request_rate > 0 || config.conn_byte_rate > 0
+            || config.addr_request_rate > 0 || config.addr_byte_rate > 0);
+    service->addr_limits = (xv_addr_limit_t **)xv_malloc(sizeof(xv_addr_limit_t *) * XV_ADDR_LIMIT_BUCKET_SIZE);
+    memset(service->addr_limits, 0, sizeof(xv_addr_limit_t *) * XV_ADDR_LIMIT_BUCKET_SIZE);
+    pthread_mutex_init(&service->addr_limit_mutex, NULL);
+
+    // init connection slot table, only chunk pointers, chunks alloc on demand
+    int slot_count = config.max_connections;
+    if (slot_count <= 0) {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+            slot_count = limit.rlim_cur < XV_MAX_CONN_SLOT_SIZE ? (int)limit.rlim_cur : XV_MAX_CONN_SLOT_SIZE;
+        } else {
+            slot_count = XV_MAX_CONN_SLOT_SIZE;
+        }
+    }
+    service->slot_count = slot_count;
+    service->slot_chunk_count = (slot_count + XV_CONN_SLOT_CHUNK_SIZE - 1) / XV_CONN_SLOT_CHUNK_SIZE;
+    service->slot_chunks = (xv_conn_slot_t **)xv_malloc(sizeof(xv_conn_slot_t *) * service->slot_chunk_count);
+    memset(service->slot_chunks, 0, sizeof(xv_conn_slot_t *) * service->slot_chunk_count);
+    pthread_mutex_init(&service->slot_mutex, NULL);
+    xv_atomic_set(&service->conn_count, 0);
+    xv_atomic_set(&service->closed_count, 0);
+
+    service->connect_handles = NULL;
+    pthread_mutex_init(&service->connect_handle_mutex, NULL);
+
+    service->start = 0;
+
+    return service;
+}
+
+static int xv_service_add_listener(xv_service_t *service, const char *addr, int port,
+                    xv_service_handle_t handle, const xv_socket_options_t *options, int io_thread_idx)
+{
+    // set once here, accepted sockets inherit them (such as TCP_NODELAY) from the listen socket
+    int reuseport = service->config.reuseport_enable;
+    int listen_fd = xv_tcp_listen_with_options(addr, port, reuseport, options);
+    if (listen_fd < 0) {
+        xv_log_error("listen on %s:%d failed!", addr, port);
+        return XV_ERR;
+    }
+    int ret = xv_nonblock(listen_fd);
+    if (ret != XV_OK) {
+        xv_close(listen_fd);
+        return XV_ERR;
+    }
+
+    xv_listener_t *listener = xv_listener_init(addr, port, listen_fd, handle, options, io_thread_idx, on_new_connection);
+
+    // link to service->listeners's head
+    listener->next = service->listeners;
+    service->listeners = listener;
+
+    return XV_OK;
+}
+
+int xv_service_add_listen(xv_service_t *service, const char *addr, int port, xv_service_handle_t handle)
+{
+    xv_socket_options_t options;
+    memset(&options, 0, sizeof(options));
+
+    return xv_service_add_listen_with_options(service, addr, port, handle, options);
+}
+
+// leader io thread accept on it, the same as no `reuseport_enable`
+static int xv_service_add_unix_listener(xv_service_t *service, const char *path,
+                    xv_service_handle_t handle, const xv_socket_options_t *options)
+{
+    int backlog = options->backlog > 0 ? options->backlog : XV_DEFAULT_LISTEN_BACKLOG;
+    int listen_fd = xv_unix_listen(path, backlog);
+    if (listen_fd < 0) {
+        xv_log_error("listen on unix:%s failed!", path);
+        return XV_ERR;
+    }
+    int ret = xv_nonblock(listen_fd);
+    if (ret != XV_OK) {
+        xv_close(listen_fd);
+        return XV_ERR;
+    }
+
+    // tcp options don't apply
+    xv_socket_options_t unix_options;
+    memset(&unix_options, 0, sizeof(unix_options));
+    unix_options.backlog = backlog;
+
+    xv_listener_t *listener = xv_listener_init(path, 0, listen_fd, handle, &unix_options, 0, on_new_connection);
+    listener->is_unix = 1;
+
+    listener->next = service->listeners;
+    service->listeners = listener;
+
+    return XV_OK;
+}
+
+int xv_service_add_listen_with_options(xv_service_t *service, const char *addr, int port,
+                xv_service_handle_t handle, xv_socket_options_t options)
+{
+    if (strncmp(addr, XV_UNIX_ADDR_PREFIX, strlen(XV_UNIX_ADDR_PREFIX)) == 0) {
+        return xv_service_add_unix_listener(service, addr + strlen(XV_UNIX_ADDR_PREFIX), handle, &options);
+    }
+
+    if (service->config.tcp_nodealy) {
+        options.tcp_nodelay = 1;
+    }
+
+    if (!service->config.reuseport_enable) {
+        // leader io thread accept all connections
+        return xv_service_add_listener(service, addr, port, handle, &options, 0);
+    }
+
+    // one SO_REUSEPORT listener per io thread, kernel spread the connections
+    for (int i = 0; i < service->config.io_thread_count; ++i) {
+        if (xv_service_add_listener(service, addr, port, handle, &options, i) != XV_OK) {
+            return XV_ERR;
+        }
+    }
+
+    return XV_OK;
+}
+
+// one socket per io thread when `reuseport_enable`, kernel spread the peers, else leader io thread own it
+static int xv_service_add_udp_listener(xv_service_t *service, const char *addr, int port,
+                    xv_service_handle_t handle, const xv_socket_options_t *options, int io_thread_idx)
+{
+    int fd = xv_udp_bind(addr, port, service->config.reuseport_enable, options);
+    if (fd < 0) {
+        xv_log_error("udp bind on %s:%d failed!", addr, port);
+        return XV_ERR;
+    }
+    xv_listener_t *listener = xv_listener_init(addr, port, fd, handle, options, io_thread_idx, on_new_connection);
+
+    int batch_size = service->config.udp_batch_size > 0 ? service->config.udp_batch_size : XV_DEFAULT_UDP_BATCH_SIZE;
+    if (batch_size > XV_MAX_UDP_BATCH_SIZE) {
+        batch_size = XV_MAX_UDP_BATCH_SIZE;
+    }
+    int datagram_size = service->config.udp_datagram_size > 0 ? service->config.udp_datagram_size : XV_DEFAULT_UDP_DATAGRAM_SIZE;
+
+    // datagrams go through the same pipeline as a connection, handle is the listener's copy
+    xv_connection_t *conn = xv_connection_init(addr, port, fd, &listener->handle, on_udp_read, on_udp_write);
+    conn->listener = listener;
+    conn->udp = xv_udp_init(batch_size, datagram_size);
+    for (int i = 0; i < batch_size; ++i) {
+        xv_udp_prepare_recv(conn->udp, i);
+    }
+    listener->udp_conn = conn;
+
+    listener->next = service->listeners;
+    service->listeners = listener;
+
+    return XV_OK;
+}
+
+int xv_service_add_udp_listen(xv_service_t *service, const char *addr, int port, xv_service_handle_t handle)
+{
+    xv_socket_options_t options;
+    memset(&options, 0, sizeof(options));
+
+    return xv_service_add_udp_listen_with_options(service, addr, port, handle, options);
+}
+
+int xv_service_add_udp_listen_with_options(xv_service_t *service, const char *addr, int port,
+                xv_service_handle_t handle, xv_socket_options_t options)
+{
+    if (!service->config.reuseport_enable) {
+        return xv_service_add_udp_listener(service, addr, port, handle, &options, 0);
+    }
+    for (int i = 0; i < service->config.io_thread_count; ++i) {
+        if (xv_service_add_udp_listener(service, addr, port, handle, &options, i) != XV_OK) {
+            return XV_ERR;
+        }
+    }
+
+    return XV_OK;
+}
+
+// the same handle is shared by outbound connections, so it don't grow by every connect
+// field by field, padding bytes of a handle on caller's stack may be anything
+static int xv_service_handle_equal(const xv_service_handle_t *a, const xv_service_handle_t *b)
+{
+    return a->decode == b->decode && a->encode == b->encode && a->process == b->process
+        && a->packet_cleanup == b->packet_cleanup && a->on_send_failed == b->on_send_failed
+        && a->on_connect == b->on_connect && a->on_disconnect == b->on_disconnect
+        && a->exec_mode == b->exec_mode && a->exec_hint == b->exec_hint && a->on_reject == b->on_reject;
+}
+
+static xv_service_handle_t *xv_service_get_connect_handle(xv_service_t *service, const xv_service_handle_t *handle)
+{
+    pthread_mutex_lock(&service->connect_handle_mutex);
+    xv_handle_node_t *node = service->connect_handles;
+    while (node && !xv_service_handle_equal(&node->handle, handle)) {
+        node = node->next;
+    }
+    if (!node) {
+        node = (xv_handle_node_t *)xv_malloc(sizeof(xv_handle_node_t));
+        node->handle = *handle;
+        node->next = service->connect_handles;
+        service->connect_handles = node;
+    }
+    pthread_mutex_unlock(&service->connect_handle_mutex);
+
+    return &node->handle;
+}
+
+// connect and hand it to `io_thread`, or a io thread by dispatch policy if NULL, return conn
+// which is only safe to use if `upstream` hold a ref of it
+static xv_connection_t *xv_service_open_connection(xv_service_t *service, const char *addr, int port,
+                    const xv_service_handle_t *handle, xv_io_thread_t *io_thread, xv_upstream_conn_t *upstream,
+                    uint64_t *conn_id)
+{
+    int is_unix = (strncmp(addr, XV_UNIX_ADDR_PREFIX, strlen(XV_UNIX_ADDR_PREFIX)) == 0);
+    int fd = is_unix ? xv_unix_nonblock_connect(addr + strlen(XV_UNIX_ADDR_PREFIX)) : xv_tcp_nonblock_connect(addr, port);
+    if (fd < 0) {
+        xv_log_error("connect to %s:%d failed!", addr, port);
+        return NULL;
+    }
+    if (!is_unix && service->config.tcp_nodealy) {
+        xv_tcp_nodelay(fd);
+    }
+
+    xv_service_handle_t *conn_handle = xv_service_get_connect_handle(service, handle);
+    xv_connection_t *conn = xv_connection_init(is_unix ? XV_UNIX_CONN_ADDR : addr, is_unix ? 0 : port, fd,
+            conn_handle, on_connection_read, on_connection_write);
+    conn->write_lock_enable = service->config.direct_write_enable;
+    // unix connect complete at once, still finish it in io thread as tcp
+    conn->connecting = 1;
+    if (upstream) {
+        // the pool hold a ref, drop it when the connection closed
+        conn->upstream = upstream;
+        xv_connection_incr_ref(conn);
+    }
+
+    if (!io_thread) {
+        io_thread = service->config.io_thread_count == 1 ? service->io_threads[0] : xv_service_dispatch_io_thread(service, conn);
+    }
+    if (xv_service_add_connection(service, conn, io_thread->idx) != XV_OK) {
+        xv_close(fd);
+        xv_connection_destroy(conn);
+        return NULL;
+    }
+    xv_atomic_incr(&io_thread->conn_count);
+    xv_connection_set_io_thread(conn, io_thread);
+
+    // conn may be closed by io thread after push
+    if (conn_id) {
+        *conn_id = conn->id;
+    }
+    xv_concurrent_queue_push(io_thread->conn_queue, conn);
+    xv_async_send(io_thread->async_add_conn);
+
+    return conn;
+}
+
+uint64_t xv_service_connect(xv_service_t *service, const char *addr, int port, xv_service_handle_t handle)
+{
+    uint64_t conn_id = 0;
+    xv_service_open_connection(service, addr, port, &handle, NULL, NULL, &conn_id);
 
-    return XV_OK;
+    return conn_id;
 }
 
-typedef struct xv_service_pool_task_t {
-    int (*cb)(xv_message_t *);
-    xv_message_t *message;
-} xv_service_pool_task_t;
+// ----------------------------------------------------------------------------------------
+// xv_upstream_t, every connection keep its pending requests in owner io thread, requests
+// are appended there in write order, so FIFO responses match them
+// ----------------------------------------------------------------------------------------
+typedef struct xv_upstream_request_t {
+    void *request;                  // encoded & cleaned up in io thread
+    uint64_t id;                    // XV_UPSTREAM_MATCH_ID
+    xv_upstream_cb_t cb;
+    void *ctx;
+    xv_connection_t *conn;          // hold a ref until io thread write it
+    struct xv_upstream_request_t *next;     // pending list of FIFO, or bucket of ID
+} xv_upstream_request_t;
+
+struct xv_upstream_conn_t {
+    xv_upstream_t *upstream;
+    int idx;
+    xv_connection_t *conn;          // pool hold a ref, NULL when closed, protect by `upstream->mutex`
+    int64_t retry_ns;               // reconnect not before it
+    xv_atomic_t pending;            // requests sent and not completed, any thread read it
+
+    // only owner io thread touch them
+    xv_upstream_request_t *head;    // XV_UPSTREAM_MATCH_FIFO
+    xv_upstream_request_t *tail;
+    xv_upstream_request_t **buckets;// XV_UPSTREAM_MATCH_ID, id hash
+};
+
+struct xv_upstream_t {
+    xv_service_t *service;
+    char addr[XV_LISTEN_ADDR_LEN];
+    int port;
+    xv_upstream_config_t config;
+    xv_service_handle_t handle;
+    xv_upstream_conn_t *conns;
+    int conn_count;
+    xv_atomic_t cursor;             // start of least pending scan, spread the ties
+    pthread_mutex_t mutex;
+};
 
-static void thread_pool_task_cb(void *args)
+static void xv_upstream_request_finish(xv_upstream_conn_t *uconn, xv_upstream_request_t *req, int status, void *response)
 {
-    xv_service_pool_task_t *task = (xv_service_pool_task_t *)args;
-    if (task->cb && task->message) {
-        task->cb(task->message);
+    xv_upstream_t *upstream = uconn->upstream;
+    xv_atomic_decr(&uconn->pending);
+    if (req->request && upstream->config.packet_cleanup) {
+        upstream->config.packet_cleanup(req->request);
     }
+    req->cb(status, response, req->ctx);
+    xv_free(req);
+}
 
-    // push message to io thread
-    xv_io_thread_t *io_thread = xv_message_get_connection(task->message)->io_thread;
-    xv_concurrent_queue_push(io_thread->message_queue, task->message);
-    xv_async_send(io_thread->async_return_message);
-
-    xv_free(task);
+static void xv_upstream_conn_push(xv_upstream_conn_t *uconn, xv_upstream_request_t *req)
+{
+    req->next = NULL;
+    if (uconn->buckets) {
+        xv_upstream_request_t **bucket = &uconn->buckets[req->id % XV_UPSTREAM_BUCKET_SIZE];
+        req->next = *bucket;
+        *bucket = req;
+    } else if (uconn->tail) {
+        uconn->tail->next = req;
+        uconn->tail = req;
+    } else {
+        uconn->head = uconn->tail = req;
+    }
 }
 
-static void process_message(xv_loop_t *loop, xv_message_t *message, xv_connection_t *conn, xv_service_handle_t *handle)
+static xv_upstream_request_t *xv_upstream_conn_pop(xv_upstream_conn_t *uconn, void *response)
 {
-    void *response = xv_message_get_response(message);
-    if (!response || !handle->encode) {
-        xv_log_debug("response: %p, handle->encode: %p, cannot process message, return", response, handle->encode);
-        return;
+    if (!uconn->buckets) {
+        xv_upstream_request_t *req = uconn->head;
+        if (req) {
+            uconn->head = req->next;
+            if (!uconn->head) {
+                uconn->tail = NULL;
+            }
+        }
+        return req;
     }
-    handle->encode(conn->write_buffer, response);
-    int want_write_size = xv_buffer_readable_size(conn->write_buffer);
-    if (want_write_size == 0) {
-        return;
+    uint64_t id = uconn->upstream->config.packet_id(response);
+    xv_upstream_request_t **prev = &uconn->buckets[id % XV_UPSTREAM_BUCKET_SIZE];
+    while (*prev && (*prev)->id != id) {
+        prev = &(*prev)->next;
     }
-    int nwritten = write(conn->fd, xv_buffer_read_begin(conn->write_buffer), want_write_size);
-    if (nwritten == -1 && errno != EAGAIN && errno != EINTR) {
-        xv_log_errno_error("xv_write return failed, close connection now, error");
-        xv_connection_close(conn);
-    } else {
-        if (nwritten > 0) {
-            // incr buffer index
-            xv_buffer_incr_read_index(conn->write_buffer, nwritten);
-        }
-        // check write size
-        if (nwritten < want_write_size && conn->status == XV_CONN_OPEN) {
-            // unhappy, kernel socket buffer is full, start write event
-            xv_io_start(loop, conn->write_io);
-        }
+    xv_upstream_request_t *req = *prev;
+    if (req) {
+        *prev = req->next;
     }
+    return req;
 }
 
-static void process_read_buffer(xv_loop_t *loop, xv_connection_t *conn, xv_service_handle_t *handle)
+static void xv_upstream_conn_fail_all(xv_upstream_conn_t *uconn)
 {
-    // do user decode
-    if (!handle->decode || !handle->process) {
-        xv_log_debug("handle->decode: %p, handle->process: %p, read buffer drop and return", handle->decode, handle->process);
-        // clear buffer, drop data and return
-        xv_buffer_clear(conn->read_buffer);
-        return;
+    xv_upstream_request_t *req = uconn->head;
+    uconn->head = uconn->tail = NULL;
+    while (req) {
+        xv_upstream_request_t *next = req->next;
+        xv_upstream_request_finish(uconn, req, XV_ERR, NULL);
+        req = next;
     }
-    void *request = NULL;
-    int ret = handle->decode(conn->read_buffer, &request);
-    if (ret == XV_OK) {
-        //  do user process
-        xv_message_t *message = xv_message_init(conn);
-        xv_message_set_request(message, request);
-
-        xv_thread_pool_t *worker_threads = conn->io_thread->service->worker_threads;
-        if (!worker_threads) {
-            // do process in self io thread
-            handle->process(message);
-            process_message(loop, message, conn, handle);
-            xv_message_destroy(message, handle->packet_cleanup);
-        } else {
-            xv_service_pool_task_t *task = (xv_service_pool_task_t *)xv_malloc(sizeof(xv_service_pool_task_t));
-            task->cb = handle->process;
-            task->message = message;
-            xv_log_debug("we have worker threa pool, now push task");
-            // move message to worker thread pool
-            xv_thread_pool_push_task(worker_threads, thread_pool_task_cb, task, ((uint64_t)task) > 16);
-        }
-    } else if (ret == XV_ERR) {
-        // decode failed! close it
-        xv_connection_close(conn);
+    for (int i = 0; uconn->buckets && i < XV_UPSTREAM_BUCKET_SIZE; ++i) {
+        req = uconn->buckets[i];
+        uconn->buckets[i] = NULL;
+        while (req) {
+            xv_upstream_request_t *next = req->next;
+            xv_upstream_request_finish(uconn, req, XV_ERR, NULL);
+            req = next;
+        }
     }
-
-    // if XV_AGAIN, do nothing...
 }
 
-static void on_connection_read(xv_loop_t *loop, xv_io_t *io)
+// in owner io thread, called by `process_read_buffer`, it close conn if XV_ERR
+static int xv_upstream_conn_response(xv_connection_t *conn, void *response)
 {
-    int fd = xv_io_get_fd(io);
-    xv_connection_t *conn = (xv_connection_t *)xv_io_get_userdata(io);
-    xv_service_handle_t *handle = conn->handle;
-
-    if (conn->status == XV_CONN_CLOSED) {
-        return;
+    xv_upstream_conn_t *uconn = conn->upstream;
+    xv_upstream_request_t *req = xv_upstream_conn_pop(uconn, response);
+    if (!req) {
+        if (uconn->upstream->config.packet_cleanup) {
+            uconn->upstream->config.packet_cleanup(response);
+        }
+        if (!uconn->buckets) {
+            // responses and requests are out of step, nothing can match from now
+            xv_log_error("upstream %s:%d response without request, close connection", conn->addr, conn->port);
+            return XV_ERR;
+        }
+        xv_log_debug("upstream %s:%d response id not found, drop it", conn->addr, conn->port);
+        return XV_OK;
     }
+    xv_upstream_request_finish(uconn, req, XV_OK, response);
 
-    // max read `XV_DEFAULT_READ_SIZE` bytes
-    xv_buffer_ensure_writeable_size(conn->read_buffer, XV_DEFAULT_READ_SIZE);
+    return XV_OK;
+}
 
-    int nread = read(fd, xv_buffer_write_begin(conn->read_buffer), XV_DEFAULT_READ_SIZE);
-    if (nread <= 0) {
-        if (nread == -1 && (errno == EAGAIN || errno == EINTR)) {
-            return;
-        }
-        xv_log_errno_error("xv_read return failed, close connection now, error");
+// in owner io thread, inside `xv_connection_close`
+static void upstream_on_disconnect(xv_connection_t *conn)
+{
+    xv_upstream_conn_t *uconn = conn->upstream;
+    xv_upstream_t *upstream = uconn->upstream;
 
-        // will close it
-        xv_connection_close(conn);
-    } else {
-        xv_log_debug("read from fd: %d, nread: %d", conn->fd, nread);
+    xv_log_debug("upstream %s:%d connection No.%d closed, %d requests fail", upstream->addr, upstream->port,
+            uconn->idx, xv_atomic_get(&uconn->pending));
+    xv_upstream_conn_fail_all(uconn);
 
-        // ret > 0, incr buffer index
-        xv_buffer_incr_write_index(conn->read_buffer, nread);
-        process_read_buffer(loop, conn, handle);
+    pthread_mutex_lock(&upstream->mutex);
+    if (uconn->conn == conn) {
+        uconn->conn = NULL;
+        uconn->retry_ns = xv_service_now_ns() + (int64_t)XV_UPSTREAM_RETRY_MS * 1000000;
     }
+    pthread_mutex_unlock(&upstream->mutex);
+
+    // drop the pool's ref, `xv_connection_close` release conn if it is the last
+    xv_connection_decr_ref(conn);
 }
 
-static void on_connection_write(xv_loop_t *loop, xv_io_t *io)
+// connection No.i always in the same io thread, hold `upstream->mutex`
+static void xv_upstream_connect(xv_upstream_t *upstream, xv_upstream_conn_t *uconn)
 {
-    xv_connection_t *conn = (xv_connection_t *)xv_io_get_userdata(io);
-
-    int buffer_size = xv_buffer_readable_size(conn->write_buffer);
-    if (buffer_size > 0) {
-        int nwritten = write(conn->fd, xv_buffer_read_begin(conn->write_buffer), buffer_size);
-        if (nwritten == 0 || (nwritten == -1 && errno != EAGAIN && errno != EINTR)) {
-            xv_log_errno_error("xv_write return failed, close connection now, error");
+    xv_service_t *service = upstream->service;
+    int first = (service->config.leader_serve_enable || service->config.io_thread_count == 1) ? 0 : 1;
+    xv_io_thread_t *io_thread = service->io_threads[first + uconn->idx % (service->config.io_thread_count - first)];
+
+    uconn->conn = xv_service_open_connection(service, upstream->addr, upstream->port, &upstream->handle,
+            io_thread, uconn, NULL);
+    if (!uconn->conn) {
+        uconn->retry_ns = xv_service_now_ns() + (int64_t)XV_UPSTREAM_RETRY_MS * 1000000;
+    }
+}
 
-            xv_connection_close(conn);
-        } else {
-            if (nwritten > 0) {
-                // incr buffer index
-                xv_buffer_incr_read_index(conn->write_buffer, nwritten);
+// least pending connection, reconnect closed ones on the way, hold `upstream->mutex`
+static xv_upstream_conn_t *xv_upstream_select(xv_upstream_t *upstream)
+{
+    xv_upstream_conn_t *best = NULL;
+    int best_pending = 0;
+    int64_t now_ns = 0;
+    int start = (uint32_t)xv_atomic_incr(&upstream->cursor) % upstream->conn_count;
+    for (int i = 0; i < upstream->conn_count; ++i) {
+        xv_upstream_conn_t *uconn = &upstream->conns[(start + i) % upstream->conn_count];
+        if (!uconn->conn) {
+            now_ns = now_ns ? now_ns : xv_service_now_ns();
+            if (now_ns < uconn->retry_ns) {
+                continue;
             }
-            if (nwritten == buffer_size) {
-                // happy, write all data success, stop write event
-                xv_io_stop(loop, conn->write_io);
+            xv_upstream_connect(upstream, uconn);
+            if (!uconn->conn) {
+                continue;
             }
         }
-    } else {
-        xv_io_stop(loop, conn->write_io);
+        int pending = xv_atomic_get(&uconn->pending);
+        if (upstream->config.max_pending > 0 && pending >= upstream->config.max_pending) {
+            continue;
+        }
+        if (!best || pending < best_pending) {
+            best = uconn;
+            best_pending = pending;
+        }
     }
+    return best;
 }
 
-// just leader io thread call this function
-static void on_new_connection(xv_loop_t *loop, xv_io_t *io)
+xv_upstream_t *xv_upstream_init(xv_service_t *service, const char *addr, int port, xv_upstream_config_t config)
 {
-    int listen_fd = xv_io_get_fd(io);
-
-    char addr[XV_ADDR_LEN];
-    int port;
-    int client_fd = xv_tcp_accept(listen_fd, addr, sizeof(addr), &port);
-    if (client_fd > 0) {
-        xv_log_debug("xv_tcp_accept new connection: %s:%d", addr, port);
-
-        int ret = xv_nonblock(client_fd);
-        if (ret != XV_OK) {
-            xv_close(client_fd);
-            return;
-        }
-        xv_listener_t *listener = (xv_listener_t *)xv_io_get_userdata(io);
-        xv_service_t *service = listener->io_thread->service;
-        if (service->config.tcp_nodealy) {
-            ret = xv_tcp_nodelay(client_fd);
-            if (ret != XV_OK) {
-                xv_close(client_fd);
-                return;
-            }
+    if (!config.encode || !config.decode || (config.match == XV_UPSTREAM_MATCH_ID && !config.packet_id)) {
+        xv_log_error("upstream config.encode & config.decode are required, and config.packet_id for XV_UPSTREAM_MATCH_ID");
+        return NULL;
+    }
+    xv_upstream_t *upstream = (xv_upstream_t *)xv_malloc(sizeof(xv_upstream_t));
+    upstream->service = service;
+    strncpy(upstream->addr, addr, XV_LISTEN_ADDR_LEN - 1);
+    upstream->addr[XV_LISTEN_ADDR_LEN - 1] = '\0';
+    upstream->port = port;
+    upstream->config = config;
+    xv_atomic_set(&upstream->cursor, 0);
+    pthread_mutex_init(&upstream->mutex, NULL);
+
+    memset(&upstream->handle, 0, sizeof(upstream->handle));
+    upstream->handle.decode = config.decode;
+    upstream->handle.encode = config.encode;
+    upstream->handle.packet_cleanup = config.packet_cleanup;
+    upstream->handle.on_disconnect = upstream_on_disconnect;
+
+    upstream->conn_count = config.conn_count > 0 ? config.conn_count : service->config.io_thread_count;
+    upstream->conns = (xv_upstream_conn_t *)xv_malloc(sizeof(xv_upstream_conn_t) * upstream->conn_count);
+
+    pthread_mutex_lock(&upstream->mutex);
+    for (int i = 0; i < upstream->conn_count; ++i) {
+        xv_upstream_conn_t *uconn = &upstream->conns[i];
+        uconn->upstream = upstream;
+        uconn->idx = i;
+        uconn->retry_ns = 0;
+        xv_atomic_set(&uconn->pending, 0);
+        uconn->head = uconn->tail = NULL;
+        uconn->buckets = NULL;
+        if (config.match == XV_UPSTREAM_MATCH_ID) {
+            uconn->buckets = (xv_upstream_request_t **)xv_malloc(sizeof(xv_upstream_request_t *) * XV_UPSTREAM_BUCKET_SIZE);
+            memset(uconn->buckets, 0, sizeof(xv_upstream_request_t *) * XV_UPSTREAM_BUCKET_SIZE);
         }
-        xv_service_handle_t *handle = &listener->handle;
-        xv_connection_t *conn = xv_connection_init(addr, port, client_fd, handle, on_connection_read, on_connection_write);
+        xv_upstream_connect(upstream, uconn);
+    }
+    pthread_mutex_unlock(&upstream->mutex);
 
-        // add conn to service
-        xv_service_add_connection(listener->io_thread->service, conn);
+    return upstream;
+}
 
-        // user on_conn callback
-        if (handle->on_connect) {
-            handle->on_connect(conn);
-        }
+static void io_thread_upstream_send_cb(xv_io_thread_t *io_thread, void *args)
+{
+    xv_upstream_request_t *req = (xv_upstream_request_t *)args;
+    xv_connection_t *conn = req->conn;
+    xv_upstream_conn_t *uconn = conn->upstream;
+    req->conn = NULL;
 
-        int io_thread_count = service->config.io_thread_count;
-        // add conn to myself conn list or send conn to other io thread
-        if (io_thread_count == 1) {
-            conn->io_thread = listener->io_thread;
-            // start socket READ event to myself loop
-            xv_io_start(loop, conn->read_io);
-        } else {
-            // send this conn to other io thread
-            int index = conn->fd % (io_thread_count - 1) + 1;
-            xv_concurrent_queue_push(service->io_threads[index]->conn_queue, conn);
-            xv_async_send(service->io_threads[index]->async_add_conn);
-        }
+    if (conn->status == XV_CONN_CLOSED) {
+        xv_upstream_request_finish(uconn, req, XV_ERR, NULL);
+        xv_connection_release(conn);
+        return;
+    }
+    // wait for the response before write, write may close conn and fail it
+    void *request = req->request;
+    req->request = NULL;
+    xv_upstream_conn_push(uconn, req);
+    xv_connection_write_packet(io_thread->loop, conn, uconn->upstream->config.encode, request);
+    if (uconn->upstream->config.packet_cleanup) {
+        uconn->upstream->config.packet_cleanup(request);
     }
+    xv_connection_release(conn);
 }
 
-static void *io_thread_entry(void *args)
+// fail the request never written, service is stopped
+static void xv_upstream_request_drop(void *args)
 {
-    xv_io_thread_t *io_thread = (xv_io_thread_t *)args;
-    xv_service_t *service = io_thread->service;
+    xv_upstream_request_t *req = (xv_upstream_request_t *)args;
+    xv_connection_t *conn = req->conn;
+    req->conn = NULL;
+    xv_upstream_request_finish(conn->upstream, req, XV_ERR, NULL);
+    xv_connection_decr_ref(conn);
+}
 
-    // start all async
-    xv_async_start(io_thread->loop, io_thread->async_add_conn);
-    xv_async_start(io_thread->loop, io_thread->async_return_message);
+int xv_upstream_send(xv_upstream_t *upstream, void *request, xv_upstream_cb_t cb, void *ctx)
+{
+    pthread_mutex_lock(&upstream->mutex);
+    xv_upstream_conn_t *uconn = xv_upstream_select(upstream);
+    if (!uconn) {
+        pthread_mutex_unlock(&upstream->mutex);
+        xv_log_debug("upstream %s:%d has no connection available", upstream->addr, upstream->port);
+        return XV_ERR;
+    }
+    // hold conn until io thread write it
+    xv_connection_t *conn = uconn->conn;
+    xv_connection_incr_ref(conn);
+    xv_atomic_incr(&uconn->pending);
+    pthread_mutex_unlock(&upstream->mutex);
+
+    xv_upstream_request_t *req = (xv_upstream_request_t *)xv_malloc(sizeof(xv_upstream_request_t));
+    req->request = request;
+    req->id = upstream->config.match == XV_UPSTREAM_MATCH_ID ? upstream->config.packet_id(request) : 0;
+    req->cb = cb;
+    req->ctx = ctx;
+    req->conn = conn;
+    req->next = NULL;
+    xv_io_thread_post_task(xv_connection_io_thread(conn), io_thread_upstream_send_cb, xv_upstream_request_drop, req);
 
-    if (io_thread->idx == 0) {
-        xv_log_debug("I'am leader IO Thread, add all listen fd event");
+    return XV_OK;
+}
 
-        xv_listener_t *listener = service->listeners;
-        while (listener) {
-            xv_log_debug("leader IO Thread add listener, addr: %s:%d", listener->addr, listener->port);
+int xv_upstream_get_pending(xv_upstream_t *upstream)
+{
+    int pending = 0;
+    for (int i = 0; i < upstream->conn_count; ++i) {
+        pending += xv_atomic_get(&upstream->conns[i].pending);
+    }
+    return pending;
+}
 
-            listener->io_thread = io_thread;
-            xv_io_start(io_thread->loop, listener->listen_io);
-            listener = listener->next;
+void xv_upstream_destroy(xv_upstream_t *upstream)
+{
+    // requests still in task queue refer to upstream connections
+    for (int i = 0; i < upstream->service->config.io_thread_count; ++i) {
+        xv_io_thread_drop_tasks(upstream->service->io_threads[i]);
+    }
+    for (int i = 0; i < upstream->conn_count; ++i) {
+        xv_upstream_conn_t *uconn = &upstream->conns[i];
+        // io threads stopped, connections are released by the service
+        xv_upstream_conn_fail_all(uconn);
+        if (uconn->buckets) {
+            xv_free(uconn->buckets);
         }
-    } else {
-        xv_log_debug("I'am follower IO Thread No.%d, wait Leader send xv_connection_t", io_thread->idx);
     }
+    xv_free(upstream->conns);
+    pthread_mutex_destroy(&upstream->mutex);
+    xv_free(upstream);
+}
 
-    // loop run until service stop
-    xv_loop_run_timeout(io_thread->loop, 10);  // 100 times per second
+// any thread call this function, NULL if fd out of table or its chunk not used yet
+static xv_conn_slot_t *xv_service_find_slot(xv_service_t *service, int fd)
+{
+    if (fd < 0 || fd >= service->slot_count) {
+        return NULL;
+    }
+    xv_conn_slot_t *chunk = __atomic_load_n(&service->slot_chunks[fd >> XV_CONN_SLOT_CHUNK_BITS], __ATOMIC_ACQUIRE);
+    if (!chunk) {
+        return NULL;
+    }
 
-    if (io_thread->idx == 0) {
-        xv_log_debug("I'am leader IO Thread, del all listen fd evebt");
+    return &chunk[fd & (XV_CONN_SLOT_CHUNK_SIZE - 1)];
+}
 
-        xv_listener_t *listener = service->listeners;
-        while (listener) {
-            xv_log_debug("leader IO Thread del listener, addr: %s:%d", listener->addr, listener->port);
-            xv_io_stop(io_thread->loop, listener->listen_io);
-            listener->io_thread = NULL;
-            listener = listener->next;
-        }
-        xv_log_debug("leader IO Thread exit");
+// alloc the chunk of fd if it's the first fd in chunk
+static xv_conn_slot_t *xv_service_alloc_slot(xv_service_t *service, int fd)
+{
+    xv_conn_slot_t *slot = xv_service_find_slot(service, fd);
+    if (slot || fd < 0 || fd >= service->slot_count) {
+        return slot;
+    }
 
-    } else {
-        xv_log_debug("follower IO Thread exit");
+    pthread_mutex_lock(&service->slot_mutex);
+    xv_conn_slot_t **chunk = &service->slot_chunks[fd >> XV_CONN_SLOT_CHUNK_BITS];
+    if (!*chunk) {
+        xv_conn_slot_t *new_chunk = (xv_conn_slot_t *)xv_malloc(sizeof(xv_conn_slot_t) * XV_CONN_SLOT_CHUNK_SIZE);
+        if (new_chunk) {
+            memset(new_chunk, 0, sizeof(xv_conn_slot_t) * XV_CONN_SLOT_CHUNK_SIZE);
+            __atomic_store_n(chunk, new_chunk, __ATOMIC_RELEASE);
+        }
     }
+    pthread_mutex_unlock(&service->slot_mutex);
 
-    return NULL;
+    return xv_service_find_slot(service, fd);
 }
 
-xv_service_t *xv_service_init(xv_service_config_t config)
+// io threads call this function concurrently, every fd has its own slot
+static int xv_service_add_connection(xv_service_t *service, xv_connection_t *conn, int owner_idx)
 {
-    if (config.io_thread_count <= 0 || config.worker_thread_count < 0) {
-        xv_log_error("config.io_thread_count must > 0, config.worker_thread_count must >= 0");
-        return NULL;
-    }
-    xv_service_t *service = (xv_service_t *)xv_malloc(sizeof(xv_service_t));
-    service->io_threads = (xv_io_thread_t **)xv_malloc(sizeof(xv_io_thread_t *) * config.io_thread_count);
-    for (int i = 0; i < config.io_thread_count; ++i) {
-        service->io_threads[i] = xv_io_thread_init(i, service);
+    xv_conn_slot_t *slot = xv_service_alloc_slot(service, conn->fd);
+    if (!slot) {
+        xv_log_error("conn->fd: %d, service->slot_count: %d, too many connections, drop it",
+                conn->fd, service->slot_count);
+        return XV_ERR;
     }
-    if (config.worker_thread_count > 0) {
-        service->worker_threads = xv_thread_pool_init(config.worker_thread_count);
-    } else {
-        service->worker_threads = NULL;
+
+    // generation never be 0, so conn id never be 0
+    uint32_t gen = XV_SLOT_GEN(__atomic_load_n(&slot->state, __ATOMIC_RELAXED)) + 1;
+    if (gen == 0) {
+        gen = 1;
     }
-    service->config = config;
-    service->listeners = NULL;
+    conn->id = XV_CONN_ID(gen, conn->fd);
 
-    // init connections set
-    int array_size = sizeof(xv_connection_t *) * XV_DEFAULT_LOOP_SIZE;
-    service->connections = (xv_connection_t **)xv_malloc(array_size);
-    memset(service->connections, 0, array_size);
+    xv_log_debug("add conn[%s:%d, fd: %d, id: %llu] to service", conn->addr, conn->port, conn->fd, (unsigned long long)conn->id);
 
-    service->conn_setsize = XV_DEFAULT_LOOP_SIZE;
-    xv_atomic_set(&service->conn_count, 0);
+    slot->conn = conn;
+    __atomic_store_n(&slot->handle, conn->handle, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->state, XV_SLOT_STATE(gen, owner_idx + 1), __ATOMIC_RELEASE);
 
-    service->start = 0;
+    xv_atomic_incr(&service->conn_count);
 
-    return service;
+    return XV_OK;
 }
 
-int xv_service_add_listen(xv_service_t *service, const char *addr, int port, xv_service_handle_t handle)
+// owner io thread call this function when conn migrate (owner_idx >= 0) or close (XV_ERR)
+static void xv_service_set_connection_owner(xv_service_t *service, xv_connection_t *conn, int owner_idx)
 {
-    int listen_fd = xv_tcp_listen(addr, port, 1024);
-    if (listen_fd < 0) {
-        xv_log_error("listen on %s:%d failed!");
-        return XV_ERR;
-    }
-    int ret = xv_nonblock(listen_fd);
-    if (ret != XV_OK) {
-        xv_close(listen_fd);
+    xv_conn_slot_t *slot = xv_service_find_slot(service, conn->fd);
+    __atomic_store_n(&slot->state, XV_SLOT_STATE(XV_CONN_ID_GEN(conn->id), owner_idx + 1), __ATOMIC_RELEASE);
+}
+
+static int xv_service_del_connection(xv_service_t *service, xv_connection_t *conn)
+{
+    xv_conn_slot_t *slot = xv_service_find_slot(service, conn->fd);
+    if (!slot) {
+        xv_log_error("conn->fd: %d, service->slot_count: %d, del failed, check the code", conn->fd, service->slot_count);
         return XV_ERR;
     }
+    xv_log_debug("del conn[%s:%d, fd: %d] from service", conn->addr, conn->port, conn->fd);
 
-    xv_listener_t *listener = xv_listener_init(addr, port, listen_fd, handle, on_new_connection);
+    // state was set closed by `xv_connection_close`, fd is closed after this
+    slot->conn = NULL;
 
-    // link to service->listeners's head
-    listener->next = service->listeners;
-    service->listeners = listener;
+    xv_atomic_decr(&service->conn_count);
+    xv_atomic_incr(&service->closed_count);
 
     return XV_OK;
 }
 
-// not thread safe, but just leader io call this function
-static void xv_service_add_connection(xv_service_t *service, xv_connection_t *conn)
+// any thread call this function, return owner io thread idx or XV_ERR if conn is gone
+static int xv_service_lookup_connection(xv_service_t *service, uint64_t conn_id, xv_service_handle_t **handle)
 {
-    // resize conn setsize
-    if (conn->fd > service->conn_setsize) {
-        xv_log_debug("conn->fd: %d, service->conn_setsiz: %d, resize the service->conn_setsize to %d",
-                conn->fd, service->conn_setsize, service->conn_setsize * 2);
-
-        service->conn_setsize *= 2;
-        int array_size = sizeof(xv_connection_t *) * service->conn_setsize;
-        service->connections = (xv_connection_t **)xv_realloc(service->connections, array_size);
+    xv_conn_slot_t *slot = xv_service_find_slot(service, XV_CONN_ID_FD(conn_id));
+    if (!slot) {
+        return XV_ERR;
+    }
+    while (1) {
+        uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (XV_SLOT_GEN(state) != XV_CONN_ID_GEN(conn_id) || XV_SLOT_OWNER(state) == 0) {
+            return XV_ERR;
+        }
+        if (!handle) {
+            return XV_SLOT_OWNER(state) - 1;
+        }
+        *handle = __atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE);
+        // state not change, the handle belong to this conn id
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == state) {
+            return XV_SLOT_OWNER(state) - 1;
+        }
     }
-    xv_log_debug("add conn[%s:%d, fd: %d] to service", conn->addr, conn->port, conn->fd);
+}
 
-    service->connections[conn->fd] = conn;
-    xv_memory_barriers();
+static xv_io_thread_t *xv_service_get_io_thread(xv_service_t *service, int idx)
+{
+    return service->io_threads[idx];
+}
 
-    xv_atomic_incr(&service->conn_count);
+// just owner io thread call this function, after `xv_service_lookup_connection`
+static xv_connection_t *xv_service_get_connection(xv_service_t *service, uint64_t conn_id)
+{
+    return xv_service_find_slot(service, XV_CONN_ID_FD(conn_id))->conn;
 }
 
-static int xv_service_del_connection(xv_service_t *service, xv_connection_t *conn)
+int xv_service_get_io_thread_count(xv_service_t *service)
+{
+    return service->config.io_thread_count;
+}
+
+int xv_service_get_io_thread_conn_count(xv_service_t *service, int idx)
 {
-    if (conn->fd < 0 || conn->fd >= service->conn_setsize) {
-        xv_log_error("conn->fd: %d, service->conn_setsiz: %d, del failed, check the code", conn->fd, service->conn_setsize);
+    if (idx < 0 || idx >= service->config.io_thread_count) {
         return XV_ERR;
     }
-    xv_log_debug("del conn[%s:%d, fd: %d] from service", conn->addr, conn->port, conn->fd);
+    return xv_atomic_get(&service->io_threads[idx]->conn_count);
+}
 
-    service->connections[conn->fd] = NULL;
-    xv_memory_barriers();
+int xv_service_get_io_thread_load(xv_service_t *service, int idx)
+{
+    if (idx < 0 || idx >= service->config.io_thread_count) {
+        return XV_ERR;
+    }
+    return xv_loop_get_load(service->io_threads[idx]->loop);
+}
 
-    xv_atomic_decr(&service->conn_count);
+int xv_service_get_pending_requests(xv_service_t *service)
+{
+    return xv_atomic_get(&service->pending_requests);
+}
 
-    return XV_OK;
+int xv_service_get_queued_requests(xv_service_t *service)
+{
+    return xv_atomic_get(&service->queued_requests);
+}
+
+int xv_service_get_concurrency_limit(xv_service_t *service)
+{
+    return __atomic_load_n(&service->concurrency_limit, __ATOMIC_RELAXED);
 }
 
 int xv_service_start(xv_service_t *service)
@@ -772,10 +3599,13 @@ int xv_service_stop(xv_service_t *service)
     }
 
     // stop all connection
-    xv_log_debug("stop all listeners...");
-    for (int i = 0; i < service->conn_setsize; ++i) {
-        if (service->connections[i]) {
-            xv_connection_stop(service->connections[i]->io_thread->loop, service->connections[i]);
+    xv_log_debug("stop all connection...");
+    for (int i = 0; i < service->slot_chunk_count; ++i) {
+        xv_conn_slot_t *chunk = service->slot_chunks[i];
+        for (int j = 0; chunk && j < XV_CONN_SLOT_CHUNK_SIZE; ++j) {
+            if (chunk[j].conn) {
+                xv_connection_stop(chunk[j].conn->io_thread->loop, chunk[j].conn);
+            }
         }
     }
 
@@ -809,14 +3639,24 @@ void xv_service_destroy(xv_service_t *service)
         listener = tmp;
     }
 
+    // tasks left hold refs of connections and frames
+    for (int i = 0; i < service->config.io_thread_count; ++i) {
+        xv_io_thread_drop_tasks(service->io_threads[i]);
+    }
+
     // destory all connection
     xv_log_debug("destory all connection...");
-    for (int i = 0; i < service->conn_setsize; ++i) {
-        if (service->connections[i]) {
-            xv_connection_destroy(service->connections[i]);
+    for (int i = 0; i < service->slot_chunk_count; ++i) {
+        xv_conn_slot_t *chunk = service->slot_chunks[i];
+        for (int j = 0; chunk && j < XV_CONN_SLOT_CHUNK_SIZE; ++j) {
+            if (chunk[j].conn) {
+                xv_connection_destroy(chunk[j].conn);
+            }
         }
+        xv_free(chunk);
     }
-    xv_free(service->connections);
+    xv_free(service->slot_chunks);
+    pthread_mutex_destroy(&service->slot_mutex);
 
     // destroy all io thread
     xv_log_debug("destroy all io thread...");
@@ -830,6 +3670,27 @@ void xv_service_destroy(xv_service_t *service)
     if (service->worker_threads) {
         xv_thread_pool_destroy(service->worker_threads);
     }
+    xv_pool_destroy(service->message_pool);
+
+    // entries of not closed connections
+    for (int i = 0; i < XV_ADDR_LIMIT_BUCKET_SIZE; ++i) {
+        xv_addr_limit_t *limit = service->addr_limits[i];
+        while (limit) {
+            xv_addr_limit_t *next = limit->next;
+            xv_free(limit);
+            limit = next;
+        }
+    }
+    xv_free(service->addr_limits);
+    pthread_mutex_destroy(&service->addr_limit_mutex);
+
+    xv_handle_node_t *node = service->connect_handles;
+    while (node) {
+        xv_handle_node_t *next = node->next;
+        xv_free(node);
+        node = next;
+    }
+    pthread_mutex_destroy(&service->connect_handle_mutex);
 
     xv_free(service);
 }
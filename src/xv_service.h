@@ -24,6 +24,7 @@ extern "C" {
 #include "xv.h"
 #include "xv_atomic.h"
 #include "xv_buffer.h"
+#include "xv_socket.h"
 
 #define XV_ADDR_LEN 32
 
@@ -32,45 +33,172 @@ typedef struct xv_io_thread_t xv_io_thread_t;
 typedef struct xv_listener_t xv_listener_t;
 typedef struct xv_connection_t xv_connection_t;
 typedef struct xv_message_t xv_message_t;
+typedef struct xv_upstream_t xv_upstream_t;
+
+// how the leader io thread distribute new connections to io threads
+typedef enum xv_dispatch_policy_t {
+    XV_DISPATCH_FD_HASH = 0,       // fd % io thread count, default
+    XV_DISPATCH_ROUND_ROBIN = 1,   // one by one
+    XV_DISPATCH_LEAST_CONN = 2,    // io thread with least connections
+    XV_DISPATCH_LEAST_LOAD = 3,    // io thread with least recent loop utilization
+} xv_dispatch_policy_t;
+
+// where to run `process`
+typedef enum xv_exec_mode_t {
+    XV_EXEC_DEFAULT = 0,           // worker thread if have, else io thread
+    XV_EXEC_INLINE = 1,            // io thread, no thread switch
+    XV_EXEC_OFFLOAD = 2,           // worker thread
+    XV_EXEC_ADAPTIVE = 3,          // inline if average process cost is cheap, else offload
+} xv_exec_mode_t;
 
 // service init config
 typedef struct xv_service_config_t {
     int io_thread_count;
     int worker_thread_count;
-    int tcp_nodealy;
+    int tcp_nodealy;         // TCP_NODELAY for all listen ports, more options see `xv_service_add_listen_with_options`
     int io_affinity_enable;  // now support yet
+    int reuseport_enable;    // every io thread accept on its own SO_REUSEPORT listen socket
+    int accept_batch_size;   // max connections accept per listen event, 0 means default
+    xv_dispatch_policy_t dispatch_policy;
+    int leader_serve_enable; // leader io thread also serve connections, not only accept
+    int max_connections;     // max connection fd + 1, slot table grow on demand up to it, 0 means RLIMIT_NOFILE
+    int inline_cost_us;      // XV_EXEC_ADAPTIVE run process inline below this average cost, 0 means default
+    int worker_encode_enable;// encode response in worker thread, io thread just write bytes
+    int direct_write_enable; // worker thread write response to socket if uncontended, imply worker encode
+    int max_pending_requests;// max requests queued or running in worker threads, call `on_reject` when over it,
+                             // 0 means no limit
+    int max_queued_requests; // max requests waiting in worker queues not running yet, call `on_reject` when
+                             // over it, 0 means no limit
+    int adaptive_limit_enable;   // AIMD adjust the limit by request latency, not over `max_pending_requests`
+    int target_latency_us;   // adaptive limit decrease when request latency above it, 0 means default
+    // token bucket rate limit, burst is one second, io thread stop reading until tokens refill, 0 means no limit
+    int conn_request_rate;   // max requests per second per connection
+    int conn_byte_rate;      // max read bytes per second per connection
+    int addr_request_rate;   // max requests per second per client address
+    int addr_byte_rate;      // max read bytes per second per client address
+    int udp_batch_size;      // max datagrams per recvmmsg & sendmmsg of udp listeners, 0 means default 64
+    int udp_datagram_size;   // max request datagram size of udp listeners, bigger ones are dropped, 0 means default 2048
+    int connect_timeout_ms;  // `xv_service_connect` close the connection if not connected in time, 0 means default 3000
 } xv_service_config_t;
 
 // handle for listen port
 typedef struct xv_service_handle_t {
     int (*decode)(xv_buffer_t *, void **);     // user packet decode, origin data read from `xv_buffer_t`
     int (*encode)(xv_buffer_t *, void *);      // user packet encode, write data to `xv_buffer_t`
-    int (*process)(xv_message_t *);            // process request, call `xv_message_get_request()` &  `xv_message_set_response()`
+    int (*process)(xv_message_t *);            // process request, call `xv_message_get_request()` &  `xv_message_set_response()`,
+                                               // return XV_AGAIN to respond later by `xv_message_complete()`
     void (*packet_cleanup)(void *);            // cleanup user's packet
     void (*on_send_failed)(void *);            // when send to connection failed, such as fd closed
     void (*on_connect)(xv_connection_t *);     // when `accept` a new connection
     void (*on_disconnect)(xv_connection_t *);  // when connection will disconnect
+    xv_exec_mode_t exec_mode;                  // where to run `process` for this listen port
+    int (*exec_hint)(void *);                  // optional, choose xv_exec_mode_t per decoded request,
+                                               // return XV_EXEC_DEFAULT to follow `exec_mode`
+    void (*on_reject)(xv_message_t *);         // optional, request rejected by overload, can set a busy response
 } xv_service_handle_t;
 
 // ----------------------------------------------------------------------------------------
 // xv_service_t
 // ----------------------------------------------------------------------------------------
 xv_service_t *xv_service_init(xv_service_config_t config);
+// `addr` "unix:/path/to/sock" (or "unix:@name" abstract) listen on AF_UNIX stream socket, `port` is ignored,
+// such connections' addr is "unix" and port is 0
 int xv_service_add_listen(xv_service_t *service, const char *addr, int port, xv_service_handle_t handle);
+// listen with socket options, `tcp_nodealy` in config still apply
+int xv_service_add_listen_with_options(xv_service_t *service, const char *addr, int port,
+                xv_service_handle_t handle, xv_socket_options_t options);
+// datagram listener, every datagram is decoded, processed & encoded by `handle` like a connection's data,
+// response is sent to the datagram's source, `on_connect` & `on_disconnect` are not called, rate limit don't apply,
+// `reuseport_enable` give every io thread its own socket, only buffer sizes and busy poll in `options` apply
+int xv_service_add_udp_listen(xv_service_t *service, const char *addr, int port, xv_service_handle_t handle);
+int xv_service_add_udp_listen_with_options(xv_service_t *service, const char *addr, int port,
+                xv_service_handle_t handle, xv_socket_options_t options);
+// outbound connection to `addr`:`port` (or "unix:/path/to/sock"), served by a io thread the same as an
+// accepted one, connect complete in the io thread then `on_connect` is called, if it failed or timeout
+// only `on_disconnect` is called; return the connection id at once, 0 if failed, any thread can call it
+uint64_t xv_service_connect(xv_service_t *service, const char *addr, int port, xv_service_handle_t handle);
 int xv_service_start(xv_service_t *service);
 int xv_service_run(xv_service_t *service);
 int xv_service_stop(xv_service_t *service);
 void xv_service_destroy(xv_service_t *service);
 
+// io thread stat, for monitor or rebalance
+int xv_service_get_io_thread_count(xv_service_t *service);
+int xv_service_get_io_thread_conn_count(xv_service_t *service, int idx);
+int xv_service_get_io_thread_load(xv_service_t *service, int idx);
+
+// admission stat
+int xv_service_get_pending_requests(xv_service_t *service);
+int xv_service_get_queued_requests(xv_service_t *service);
+int xv_service_get_concurrency_limit(xv_service_t *service);
+
 // ----------------------------------------------------------------------------------------
 // xv_connection_t
 // ----------------------------------------------------------------------------------------
 const char *xv_connection_get_addr(xv_connection_t *conn);
 int xv_connection_get_port(xv_connection_t *conn);
 int xv_connection_get_fd(xv_connection_t *conn);
+uint64_t xv_connection_get_id(xv_connection_t *conn);  // generation << 32 | fd, never be 0
 void xv_connection_incr_ref(xv_connection_t *conn);
 void xv_connection_decr_ref(xv_connection_t *conn);
+int xv_connection_get_io_thread_idx(xv_connection_t *conn);
 int xv_service_send_message(xv_connection_t *conn, void *package);
+// O(1) and no ref needed, return XV_ERR when the connection is gone, caller still own `package`;
+// if it is gone after return, `on_send_failed` & `packet_cleanup` is called with `package`
+int xv_service_send_message_by_id(xv_service_t *service, uint64_t conn_id, void *package);
+
+// encode `packet` once by `encode`, all io threads share the encoded bytes,
+// caller still own `packet` after return
+int xv_service_broadcast(xv_service_t *service, int (*encode)(xv_buffer_t *, void *), void *packet);
+int xv_service_broadcast_list(xv_service_t *service, xv_connection_t **conns, int count,
+                int (*encode)(xv_buffer_t *, void *), void *packet);
+
+// groups, membership is sharded by io thread, publish encode once and every
+// io thread fan out to its own members without lock
+int xv_service_group_join(xv_connection_t *conn, uint64_t group_id);
+int xv_service_group_leave(xv_connection_t *conn, uint64_t group_id);
+int xv_service_group_publish(xv_service_t *service, uint64_t group_id,
+                int (*encode)(xv_buffer_t *, void *), void *packet);
+
+// move conn with its buffers and in-flight messages to another io thread's loop,
+// any thread can call this function while holding a ref of conn
+int xv_service_migrate_connection(xv_connection_t *conn, int io_thread_idx);
+
+// ----------------------------------------------------------------------------------------
+// xv_upstream_t, pooled outbound connections with pipelined requests
+// ----------------------------------------------------------------------------------------
+
+// how a response find its request on a pipelined connection
+typedef enum xv_upstream_match_t {
+    XV_UPSTREAM_MATCH_FIFO = 0,    // responses come back in request order, default
+    XV_UPSTREAM_MATCH_ID = 1,      // responses come back in any order, match by `packet_id`
+} xv_upstream_match_t;
+
+// `status` is XV_OK with the response which is yours now, or XV_ERR with NULL when
+// the connection failed or closed before the response came back
+typedef void (*xv_upstream_cb_t)(int status, void *response, void *ctx);
+
+typedef struct xv_upstream_config_t {
+    int conn_count;                            // connections to the upstream, spread across io threads,
+                                               // 0 means io thread count
+    xv_upstream_match_t match;
+    int max_pending;                           // max pipelined requests per connection, 0 means no limit
+    int (*encode)(xv_buffer_t *, void *);      // request encode
+    int (*decode)(xv_buffer_t *, void **);     // response decode
+    uint64_t (*packet_id)(void *);             // request or response id, XV_UPSTREAM_MATCH_ID need it
+    void (*packet_cleanup)(void *);            // cleanup request after encode, or response nobody wait for
+} xv_upstream_config_t;
+
+// connect `addr`:`port` (or "unix:/path/to/sock") by `xv_service_connect`, closed ones reconnect
+// on demand after a short delay
+xv_upstream_t *xv_upstream_init(xv_service_t *service, const char *addr, int port, xv_upstream_config_t config);
+// send `request` on the connection with least pending requests, any thread can call it, such as
+// a worker in `process` which return XV_AGAIN and complete the message in `cb`; `cb` is called in
+// a io thread, keep it short; return XV_ERR if no connection available, caller still own `request`
+int xv_upstream_send(xv_upstream_t *upstream, void *request, xv_upstream_cb_t cb, void *ctx);
+int xv_upstream_get_pending(xv_upstream_t *upstream);
+// after the service stopped, pending requests get XV_ERR, requests not written yet are dropped
+void xv_upstream_destroy(xv_upstream_t *upstream);
 
 // ----------------------------------------------------------------------------------------
 // xv_message_t
@@ -80,6 +208,11 @@ void *xv_message_get_request(xv_message_t *message);
 void *xv_message_get_response(xv_message_t *message);
 void xv_message_set_request(xv_message_t *message, void *request);
 void xv_message_set_response(xv_message_t *message, void *response);
+// source address of a udp request, XV_ERR for connection's message
+int xv_message_get_peer_addr(xv_message_t *message, char *addr, int addr_len, int *port);
+// finish a message which `process` returned XV_AGAIN, any thread can call it once,
+// `response` can be NULL if no response, the message is not yours after call
+void xv_message_complete(xv_message_t *message, void *response);
 
 #ifdef __cplusplus
 }
@@ -15,10 +15,12 @@
 
 #define _GNU_SOURCE
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/time.h>
@@ -37,6 +39,15 @@ static int xv_tcp_reuse_addr(int fd) {
     return XV_OK;
 }
 
+static int xv_tcp_reuse_port(int fd) {
+    int val = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0) {
+        xv_log_errno_error("setsockopt failed");
+        return XV_ERR;
+    }
+    return XV_OK;
+}
+
 static int xv_socket() {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
@@ -67,14 +78,17 @@ static int xv_tcp_generic_connect(const char *addr, int port, int nonblock)
 
     sa.sin_family = AF_INET;
     sa.sin_port = htons(port);
-    if (inet_pton(AF_INET, addr, &sa.sin_addr) < 0) {
-        xv_log_errno_error("inet_pton failed");
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) <= 0) {
+        xv_log_error("inet_pton %s failed", addr);
+        xv_close(sock);
         return XV_ERR;
     }
 
+    // nonblock connect complete later, check it by `xv_socket_error` when writable
     int ret = connect(sock, (struct sockaddr *)&sa, sizeof(sa));
-    if (ret < 0) {
+    if (ret < 0 && !(nonblock && errno == EINPROGRESS)) {
         xv_log_errno_error("connect failed");
+        xv_close(sock);
         return XV_ERR;
     }
 
@@ -93,12 +107,65 @@ int xv_tcp_nonblock_connect(const char *addr, int port)
     return xv_tcp_generic_connect(addr, port, 1);
 }
 
-int xv_tcp_listen(const char *addr, int port, int backlog)
+static int xv_setsockopt_int(int fd, int level, int name, int val, const char *name_str)
+{
+    if (setsockopt(fd, level, name, &val, sizeof(val)) < 0) {
+        char errbuf[128];
+        xv_log_error("setsockopt %s to %d failed: %s", name_str, val, xv_strerror(errno, errbuf, sizeof(errbuf)));
+        return XV_ERR;
+    }
+    return XV_OK;
+}
+
+#define XV_SET_OPT(fd, level, name, val) do {\
+    if ((val) && xv_setsockopt_int(fd, level, name, val, #name) != XV_OK) {\
+        return XV_ERR;\
+    }\
+} while(0)
+
+static int xv_tcp_set_listen_options(int fd, const xv_socket_options_t *options)
+{
+    XV_SET_OPT(fd, SOL_SOCKET, SO_SNDBUF, options->send_buffer_size);
+    XV_SET_OPT(fd, SOL_SOCKET, SO_RCVBUF, options->recv_buffer_size);
+    XV_SET_OPT(fd, IPPROTO_TCP, TCP_NODELAY, options->tcp_nodelay);
+    XV_SET_OPT(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options->defer_accept_sec);
+    XV_SET_OPT(fd, IPPROTO_TCP, TCP_FASTOPEN, options->fastopen_queue_len);
+    XV_SET_OPT(fd, SOL_SOCKET, SO_KEEPALIVE, options->keepalive);
+    XV_SET_OPT(fd, IPPROTO_TCP, TCP_KEEPIDLE, options->keepalive_idle_sec);
+    XV_SET_OPT(fd, IPPROTO_TCP, TCP_KEEPINTVL, options->keepalive_interval_sec);
+    XV_SET_OPT(fd, IPPROTO_TCP, TCP_KEEPCNT, options->keepalive_count);
+    XV_SET_OPT(fd, SOL_SOCKET, SO_BUSY_POLL, options->busy_poll_us);
+    XV_SET_OPT(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options->notsent_lowat);
+
+    return XV_OK;
+}
+
+int xv_tcp_set_accepted_options(int fd, const xv_socket_options_t *options)
+{
+    // kernel leave quickack mode by itself, so it is only a hint for the first acks
+    XV_SET_OPT(fd, IPPROTO_TCP, TCP_QUICKACK, options->tcp_quickack);
+
+    return XV_OK;
+}
+
+static int xv_tcp_generic_listen(const char *addr, int port, int backlog, int reuseport,
+        const xv_socket_options_t *options)
 {
     int sock = xv_socket();
     if (sock == XV_ERR) {
         return XV_ERR;
     }
+    if (reuseport) {
+        // must set before bind, every socket in the group need it
+        if (xv_tcp_reuse_port(sock) == XV_ERR) {
+            xv_close(sock);
+            return XV_ERR;
+        }
+    }
+    if (options && xv_tcp_set_listen_options(sock, options) != XV_OK) {
+        xv_close(sock);
+        return XV_ERR;
+    }
 
     struct sockaddr_in sa;
     memset(&sa, 0, sizeof(sa));
@@ -107,37 +174,63 @@ int xv_tcp_listen(const char *addr, int port, int backlog)
     sa.sin_port = htons(port);
     if (inet_pton(AF_INET, addr, &sa.sin_addr) < 0) {
         xv_log_errno_error("inet_pton failed");
+        xv_close(sock);
         return XV_ERR;
     }
 
     if (bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
         xv_log_errno_error("bind failed");
+        xv_close(sock);
         return XV_ERR;
     }
 
     if (listen(sock, backlog) < 0) {
         xv_log_errno_error("listen failed");
+        xv_close(sock);
         return XV_ERR;
     }
 
-    xv_log_debug("listen on %s:%d, backlog is %d", addr, port, backlog);
+    xv_log_debug("listen on %s:%d, backlog is %d, reuseport: %d", addr, port, backlog, reuseport);
 
     return sock;
 }
 
-int xv_tcp_accept(int fd, char *client_ip, int client_ip_len, int *port)
+int xv_tcp_listen(const char *addr, int port, int backlog)
+{
+    return xv_tcp_generic_listen(addr, port, backlog, 0, NULL);
+}
+
+int xv_tcp_listen_with_options(const char *addr, int port, int reuseport, const xv_socket_options_t *options)
+{
+    int backlog = options->backlog > 0 ? options->backlog : XV_DEFAULT_LISTEN_BACKLOG;
+    return xv_tcp_generic_listen(addr, port, backlog, reuseport, options);
+}
+
+static int xv_tcp_generic_accept(int fd, char *client_ip, int client_ip_len, int *port, int nonblock)
 {
     struct sockaddr_in sa;
     socklen_t len = sizeof(sa);
     int cfd = -1;
 
     while (1) {
-        cfd = accept(fd, (struct sockaddr *)&sa, &len);
+        if (nonblock) {
+            // new fd is nonblock & cloexec already, save two fcntl per connection
+            cfd = accept4(fd, (struct sockaddr *)&sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        } else {
+            cfd = accept(fd, (struct sockaddr *)&sa, &len);
+        }
         if (cfd < 0) {
             if (errno == EINTR) {
                 continue;
             }
+            // backlog is empty, not a error, caller check errno
+            if (nonblock && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return XV_ERR;
+            }
+            // keep errno for caller, such as EMFILE
+            int err = errno;
             xv_log_errno_error("accept failed");
+            errno = err;
             return XV_ERR;
         }
         break;
@@ -159,6 +252,188 @@ int xv_tcp_accept(int fd, char *client_ip, int client_ip_len, int *port)
     return cfd;
 }
 
+int xv_tcp_accept(int fd, char *client_ip, int client_ip_len, int *port)
+{
+    return xv_tcp_generic_accept(fd, client_ip, client_ip_len, port, 0);
+}
+
+int xv_tcp_nonblock_accept(int fd, char *client_ip, int client_ip_len, int *port)
+{
+    return xv_tcp_generic_accept(fd, client_ip, client_ip_len, port, 1);
+}
+
+static int xv_udp_set_options(int fd, const xv_socket_options_t *options)
+{
+    XV_SET_OPT(fd, SOL_SOCKET, SO_SNDBUF, options->send_buffer_size);
+    XV_SET_OPT(fd, SOL_SOCKET, SO_RCVBUF, options->recv_buffer_size);
+    XV_SET_OPT(fd, SOL_SOCKET, SO_BUSY_POLL, options->busy_poll_us);
+
+    return XV_OK;
+}
+
+int xv_udp_bind(const char *addr, int port, int reuseport, const xv_socket_options_t *options)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        xv_log_errno_error("socket failed");
+        return XV_ERR;
+    }
+    if (xv_tcp_reuse_addr(sock) == XV_ERR || (reuseport && xv_tcp_reuse_port(sock) == XV_ERR)) {
+        xv_close(sock);
+        return XV_ERR;
+    }
+    if (options && xv_udp_set_options(sock, options) != XV_OK) {
+        xv_close(sock);
+        return XV_ERR;
+    }
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) <= 0) {
+        xv_log_error("inet_pton %s failed", addr);
+        xv_close(sock);
+        return XV_ERR;
+    }
+
+    if (bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        xv_log_errno_error("bind failed");
+        xv_close(sock);
+        return XV_ERR;
+    }
+
+    xv_log_debug("udp bind on %s:%d, reuseport: %d", addr, port, reuseport);
+
+    return sock;
+}
+
+// fill sockaddr_un, return its length
+static int xv_unix_addr(const char *path, struct sockaddr_un *sa)
+{
+    int len = strlen(path);
+    if (len == 0 || len >= (int)sizeof(sa->sun_path)) {
+        xv_log_error("unix socket path: %s is empty or too long", path);
+        return XV_ERR;
+    }
+
+    memset(sa, 0, sizeof(struct sockaddr_un));
+    sa->sun_family = AF_UNIX;
+    memcpy(sa->sun_path, path, len);
+    if (path[0] == '@') {
+        // abstract, no file, name is not NUL terminated
+        sa->sun_path[0] = '\0';
+    }
+
+    return offsetof(struct sockaddr_un, sun_path) + len;
+}
+
+int xv_unix_listen(const char *path, int backlog)
+{
+    struct sockaddr_un sa;
+    int sa_len = xv_unix_addr(path, &sa);
+    if (sa_len < 0) {
+        return XV_ERR;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        xv_log_errno_error("socket failed");
+        return XV_ERR;
+    }
+
+    // socket file left by last run
+    if (path[0] != '@') {
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+    }
+
+    if (bind(sock, (struct sockaddr *)&sa, sa_len) < 0) {
+        xv_log_errno_error("bind failed");
+        xv_close(sock);
+        return XV_ERR;
+    }
+
+    if (listen(sock, backlog) < 0) {
+        xv_log_errno_error("listen failed");
+        xv_close(sock);
+        return XV_ERR;
+    }
+
+    xv_log_debug("listen on unix:%s, backlog is %d", path, backlog);
+
+    return sock;
+}
+
+static int xv_unix_generic_connect(const char *path, int nonblock)
+{
+    struct sockaddr_un sa;
+    int sa_len = xv_unix_addr(path, &sa);
+    if (sa_len < 0) {
+        return XV_ERR;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0), 0);
+    if (sock < 0) {
+        xv_log_errno_error("socket failed");
+        return XV_ERR;
+    }
+
+    // a nonblock unix connect complete at once, or EAGAIN when the backlog is full
+    if (connect(sock, (struct sockaddr *)&sa, sa_len) < 0) {
+        xv_log_errno_error("connect failed");
+        xv_close(sock);
+        return XV_ERR;
+    }
+
+    xv_log_debug("connect to unix:%s", path);
+
+    return sock;
+}
+
+int xv_unix_connect(const char *path)
+{
+    return xv_unix_generic_connect(path, 0);
+}
+
+int xv_unix_nonblock_connect(const char *path)
+{
+    return xv_unix_generic_connect(path, 1);
+}
+
+int xv_unix_nonblock_accept(int fd)
+{
+    while (1) {
+        int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd >= 0) {
+            return cfd;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        // backlog is empty, not a error, caller check errno
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            int err = errno;
+            xv_log_errno_error("accept failed");
+            errno = err;
+        }
+        return XV_ERR;
+    }
+}
+
+int xv_socket_error(int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        return errno;
+    }
+    return err;
+}
+
 int xv_nonblock(int fd)
 {
     int flags = fcntl(fd, F_GETFL);
@@ -20,12 +20,52 @@ extern "C" {
 
 #include "xv_define.h"
 
+#define XV_DEFAULT_LISTEN_BACKLOG 1024
+
+// tcp socket options, 0 means keep system default
+typedef struct xv_socket_options_t {
+    int backlog;                 // listen backlog, 0 means XV_DEFAULT_LISTEN_BACKLOG
+    int send_buffer_size;        // SO_SNDBUF
+    int recv_buffer_size;        // SO_RCVBUF, set before listen so the window scale fits it
+    int tcp_nodelay;             // TCP_NODELAY
+    int tcp_quickack;            // TCP_QUICKACK, not inherited, set on every accepted socket
+    int defer_accept_sec;        // TCP_DEFER_ACCEPT, accept wakeup when data arrived
+    int fastopen_queue_len;      // TCP_FASTOPEN, max pending fast open requests
+    int keepalive;               // SO_KEEPALIVE
+    int keepalive_idle_sec;      // TCP_KEEPIDLE
+    int keepalive_interval_sec;  // TCP_KEEPINTVL
+    int keepalive_count;         // TCP_KEEPCNT
+    int busy_poll_us;            // SO_BUSY_POLL
+    int notsent_lowat;           // TCP_NOTSENT_LOWAT
+} xv_socket_options_t;
+
 int xv_tcp_connect(const char *addr, int port);
+// return the socket with connect in progress, it is writable when connect complete or fail
 int xv_tcp_nonblock_connect(const char *addr, int port);
 
 int xv_tcp_listen(const char *addr, int port, int backlog);
+// set `options` before listen, accepted sockets inherit them except TCP_QUICKACK
+int xv_tcp_listen_with_options(const char *addr, int port, int reuseport, const xv_socket_options_t *options);
+// set options which accepted sockets don't inherit
+int xv_tcp_set_accepted_options(int fd, const xv_socket_options_t *options);
 int xv_tcp_accept(int fd, char *client_ip, int client_ip_len, int *port);
+// accept4 with SOCK_NONBLOCK | SOCK_CLOEXEC, return XV_ERR with errno EAGAIN when backlog is empty
+int xv_tcp_nonblock_accept(int fd, char *client_ip, int client_ip_len, int *port);
+
+// nonblock AF_INET datagram socket, only SO_SNDBUF, SO_RCVBUF and SO_BUSY_POLL in `options` apply
+int xv_udp_bind(const char *addr, int port, int reuseport, const xv_socket_options_t *options);
+
+// AF_UNIX stream socket, `path` starting with '@' means linux abstract namespace,
+// listen remove a stale socket file at `path` first
+#define XV_UNIX_PATH_MAX 108
+int xv_unix_listen(const char *path, int backlog);
+int xv_unix_connect(const char *path);
+int xv_unix_nonblock_connect(const char *path);
+// accept4 with SOCK_NONBLOCK | SOCK_CLOEXEC, return XV_ERR with errno EAGAIN when backlog is empty
+int xv_unix_nonblock_accept(int fd);
 
+// take the pending error of socket, such as the result of a nonblock connect, 0 means no error
+int xv_socket_error(int fd);
 int xv_nonblock(int fd);
 int xv_tcp_nodelay(int fd);
 
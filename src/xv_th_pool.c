@@ -19,12 +19,14 @@
 #include "xv.h"
 #include "xv_log.h"
 #include "xv_queue.h"
+#include "xv_pool.h"
 
 // ----------------------------------------------------------------------------------------
 // xv_worker_thread_t
 // ----------------------------------------------------------------------------------------
 struct xv_worker_thread_t {
     xv_concurrent_queue_t *task_queue;
+    xv_pool_t *task_pool;           // tasks alloc by pusher and free by worker
     xv_loop_t *loop;
     xv_async_t *async;
     pthread_t id;
@@ -48,7 +50,9 @@ static void worker_async_cb(xv_loop_t *loop, xv_async_t *async)
         xv_task_t *task = (xv_task_t *)xv_concurrent_queue_pop(thread->task_queue);
         if (task && task->cb) {
             task->cb(task->args);
-            xv_free(task);
+        }
+        if (task) {
+            xv_pool_free(thread->task_pool, task);
         }
     }
     if (!thread->start) {
@@ -75,6 +79,7 @@ xv_worker_thread_t *xv_worker_thread_init(void)
 
     xv_worker_thread_t *thread = (xv_worker_thread_t *)xv_malloc(sizeof(xv_worker_thread_t));
     thread->task_queue = xv_concurrent_queue_init();
+    thread->task_pool = xv_pool_init(sizeof(xv_task_t), 0);
     thread->loop = xv_loop_init(1024);
     thread->async = xv_async_init(worker_async_cb);
     xv_async_set_userdata(thread->async, thread);
@@ -98,7 +103,11 @@ void xv_worker_thread_destroy(xv_worker_thread_t *thread)
     xv_async_stop(thread->loop, thread->async);
     xv_async_destroy(thread->async);
     xv_loop_destroy(thread->loop);
-    xv_concurrent_queue_destroy(thread->task_queue, xv_free);
+    while (xv_concurrent_queue_size(thread->task_queue) > 0) {
+        xv_pool_free(thread->task_pool, xv_concurrent_queue_pop(thread->task_queue));
+    }
+    xv_concurrent_queue_destroy(thread->task_queue, NULL);
+    xv_pool_destroy(thread->task_pool);
     xv_free(thread);
 }
 
@@ -139,7 +148,7 @@ int xv_worker_thread_stop(xv_worker_thread_t *thread)
 
 int xv_worker_thread_push_task(xv_worker_thread_t *thread, void (*cb)(void *), void *args)
 {
-    xv_task_t *task = (xv_task_t *)xv_malloc(sizeof(xv_task_t));
+    xv_task_t *task = (xv_task_t *)xv_pool_alloc(thread->task_pool);
     task->cb = cb;
     task->args = args;
     xv_concurrent_queue_push(thread->task_queue, task);
@@ -12,4 +12,183 @@
  */
 
 #include "xv.h"
+#include "xv_log.h"
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+    #include <sys/timerfd.h>
+#else
+    // TODO
+#endif
+
+// ----------------------------------------------------------------------------------------
+// xv_timer
+// ----------------------------------------------------------------------------------------
+
+struct xv_timer_t {
+#ifdef __linux__
+    int tfd;
+#endif
+    int timeout_ms;
+    int repeat_ms;
+    int start;
+    xv_timer_cb_t cb;
+    void *userdata;
+    xv_io_t *read_io;
+};
+
+void xv_timer_set_userdata(xv_timer_t *timer, void *data)
+{
+    timer->userdata = data;
+}
+
+void *xv_timer_get_userdata(xv_timer_t *timer)
+{
+    return timer->userdata;
+}
+
+static void common_timer_cb(xv_loop_t *loop, xv_io_t *io)
+{
+#ifdef __linux__
+    uint64_t num = 0;
+    int ret = read(xv_io_get_fd(io), &num, sizeof(num));
+    if (ret < 0) {
+        // disarmed or rearmed after it fired
+        return;
+    }
+    // expirations count, just log debug
+    xv_log_debug("xv_timer_cb read num: %llu", (unsigned long long)num);
+#else
+    // TODO
+#endif
+
+    xv_timer_t *timer = (xv_timer_t *)xv_io_get_userdata(io);
+    if (timer->cb) {
+        timer->cb(loop, timer);
+    }
+}
+
+#ifdef __linux__
+static int xv_timer_arm(xv_timer_t *timer, int timeout_ms, int repeat_ms)
+{
+    struct itimerspec spec;
+    spec.it_value.tv_sec = timeout_ms / 1000;
+    spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    spec.it_interval.tv_sec = repeat_ms / 1000;
+    spec.it_interval.tv_nsec = (repeat_ms % 1000) * 1000000L;
+    if (timeout_ms > 0 && spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+        spec.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(timer->tfd, 0, &spec, NULL) < 0) {
+        xv_log_errno_error("timerfd_settime failed");
+        return XV_ERR;
+    }
+
+    return XV_OK;
+}
+#endif
+
+xv_timer_t *xv_timer_init(xv_timer_cb_t cb, int timeout_ms, int repeat_ms)
+{
+    if (!cb) {
+        xv_log_error("timer cb is NULL!");
+        return NULL;
+    }
+
+    xv_timer_t *timer = (xv_timer_t *)xv_malloc(sizeof(xv_timer_t));
+
+#ifdef __linux__
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        xv_log_errno_error("timerfd_create failed");
+        xv_free(timer);
+        return NULL;
+    }
+
+    xv_log_debug("timer create, timerfd: %d", tfd);
+
+    timer->tfd = tfd;
+    timer->read_io = xv_io_init(timer->tfd, XV_READ, common_timer_cb);
+#else
+    // TODO
+#endif
+
+    timer->timeout_ms = timeout_ms;
+    timer->repeat_ms = repeat_ms;
+    timer->start = 0;
+    timer->cb = cb;
+    timer->userdata = NULL;
+    xv_io_set_userdata(timer->read_io, timer);
+
+    return timer;
+}
+
+int xv_timer_set(xv_timer_t *timer, int timeout_ms, int repeat_ms)
+{
+    timer->timeout_ms = timeout_ms;
+    timer->repeat_ms = repeat_ms;
+    if (!timer->start) {
+        return XV_OK;
+    }
+
+#ifdef __linux__
+    return xv_timer_arm(timer, timeout_ms, repeat_ms);
+#else
+    return XV_ERR;
+#endif
+}
+
+int xv_timer_start(xv_loop_t *loop, xv_timer_t *timer)
+{
+    xv_log_debug("timer_t start: %p, timeout: %d ms, repeat: %d ms",
+            timer, timer->timeout_ms, timer->repeat_ms);
+
+    if (!timer->start && xv_io_start(loop, timer->read_io) != XV_OK) {
+        return XV_ERR;
+    }
+    timer->start = 1;
+
+#ifdef __linux__
+    return xv_timer_arm(timer, timer->timeout_ms, timer->repeat_ms);
+#else
+    return XV_ERR;
+#endif
+}
+
+int xv_timer_stop(xv_loop_t *loop, xv_timer_t *timer)
+{
+    xv_log_debug("timer_t stop: %p", timer);
+
+    if (!timer->start) {
+        return XV_OK;
+    }
+    timer->start = 0;
+
+#ifdef __linux__
+    xv_timer_arm(timer, 0, 0);
+#endif
+
+    return xv_io_stop(loop, timer->read_io);
+}
+
+int xv_timer_destroy(xv_timer_t *timer)
+{
+    xv_log_debug("timer_t destroy: %p", timer);
+    int ret = xv_io_destroy(timer->read_io);
+    if (ret != XV_OK) {
+        xv_log_error("timer_t destroy failed!");
+        return ret;
+    }
+
+#ifdef __linux__
+    close(timer->tfd);
+#else
+    // TODO
+#endif
+    xv_free(timer);
+
+    return XV_OK;
+}
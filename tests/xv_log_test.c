@@ -14,8 +14,252 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
 #include "xv_test.h"
 
+#define TEST_THREAD_COUNT 4
+#define TEST_LOG_COUNT 10000
+
+void *log_fun(void *args)
+{
+    int idx = *(int *)args;
+    for (int i = 0; i < TEST_LOG_COUNT; ++i) {
+        xv_log_info("async log thread %d seq %d", idx, i);
+    }
+
+    return NULL;
+}
+
+void async_log_test(xv_log_overflow_policy_t policy)
+{
+    const char *filename = "xv_log_async_test.log";
+    int ret = xv_set_log_filename(filename);
+    ASSERT(ret == XV_OK);
+
+    // small ring, make it full sometimes
+    ret = xv_log_async_start(16 * 1024, policy);
+    ASSERT(ret == XV_OK);
+
+    pthread_t ids[TEST_THREAD_COUNT];
+    int idxs[TEST_THREAD_COUNT];
+    for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+        idxs[i] = i;
+        ret = pthread_create(&ids[i], NULL, log_fun, &idxs[i]);
+        CHECK(ret == 0, "pthread_create: ");
+    }
+    for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+        pthread_join(ids[i], NULL);
+    }
+    xv_log_flush();
+
+    // every log in order per thread when block, maybe some dropped when drop
+    FILE *fp = fopen(filename, "r");
+    CHECK(fp, "fopen: ");
+    int next_seq[TEST_THREAD_COUNT] = {0};
+    int count = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = strstr(line, "async log thread ");
+        if (!p) {
+            continue;
+        }
+        int idx = 0, seq = 0;
+        ret = sscanf(p, "async log thread %d seq %d", &idx, &seq);
+        ASSERT(ret == 2 && idx >= 0 && idx < TEST_THREAD_COUNT);
+        ASSERT(seq >= next_seq[idx]);
+        if (policy == XV_LOG_OVERFLOW_BLOCK) {
+            ASSERT(seq == next_seq[idx]);
+        }
+        next_seq[idx] = seq + 1;
+        ++count;
+    }
+    fclose(fp);
+    fprintf(stderr, "async log policy %d, %d logs written\n", policy, count);
+    if (policy == XV_LOG_OVERFLOW_BLOCK) {
+        ASSERT(count == TEST_THREAD_COUNT * TEST_LOG_COUNT);
+    }
+
+    xv_log_async_stop();
+}
+
+void binary_log_test()
+{
+    const char *filename = "xv_log_binary_test.bin";
+    int ret = xv_log_binary_start(filename, 0, XV_LOG_OVERFLOW_BLOCK);
+    ASSERT(ret == XV_OK);
+
+    pthread_t ids[TEST_THREAD_COUNT];
+    int idxs[TEST_THREAD_COUNT];
+    for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+        idxs[i] = i;
+        ret = pthread_create(&ids[i], NULL, log_fun, &idxs[i]);
+        CHECK(ret == 0, "pthread_create: ");
+    }
+    for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+        pthread_join(ids[i], NULL);
+    }
+
+    const char *str = "xv";
+    xv_log_info("binary mixed %d %ld %lld %zu %5.2f %Lf %c %s %-4s| %*d %.*s %p %% %x",
+            -1, 2L, -3LL, (size_t)4, 5.5, (long double)6.25, 'x', str, "ab", 3, 7, 1, "yz", (void *)0x10, 255);
+    xv_log_info("binary null %s", (char *)NULL);
+
+    // not terminated buffer end at a guard page, read over precision crash
+    long page = sysconf(_SC_PAGESIZE);
+    char *pages = (char *)mmap(NULL, page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    CHECK(pages != MAP_FAILED, "mmap: ");
+    ret = mprotect(pages + page, page, PROT_NONE);
+    CHECK(ret == 0, "mprotect: ");
+    char *raw = pages + page - 4;
+    memcpy(raw, "abcd", 4);
+    xv_log_info("binary bounded %.*s|%.3s|%.4s|%-6.*s|", 2, raw, raw, raw, -1, "ef");
+    xv_log_info("binary raw text %n", &ret);
+    xv_log(XV_LOG_INFO, __FILE__, __LINE__, __FUNCTION__, "binary direct %d", 8);
+
+    xv_log_async_stop();
+    munmap(pages, page * 2);
+
+    // decode & check
+    FILE *in = fopen(filename, "rb");
+    CHECK(in, "fopen: ");
+    const char *text_filename = "xv_log_binary_test.log";
+    FILE *out = fopen(text_filename, "w");
+    CHECK(out, "fopen: ");
+    ret = xv_log_binary_decode(in, out);
+    ASSERT(ret == XV_OK);
+    fclose(in);
+    fclose(out);
+
+    char expect[256];
+    snprintf(expect, sizeof(expect), "binary mixed %d %ld %lld %zu %5.2f %Lf %c %s %-4s| %*d %.*s %p %% %x",
+            -1, 2L, -3LL, (size_t)4, 5.5, (long double)6.25, 'x', str, "ab", 3, 7, 1, "yz", (void *)0x10, 255);
+
+    in = fopen(text_filename, "r");
+    CHECK(in, "fopen: ");
+    int next_seq[TEST_THREAD_COUNT] = {0};
+    int count = 0, found = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), in)) {
+        char *p = NULL;
+        if ((p = strstr(line, "async log thread "))) {
+            int idx = 0, seq = 0;
+            ret = sscanf(p, "async log thread %d seq %d", &idx, &seq);
+            ASSERT(ret == 2 && idx >= 0 && idx < TEST_THREAD_COUNT);
+            ASSERT(seq == next_seq[idx]);
+            next_seq[idx] = seq + 1;
+            ++count;
+        } else if ((p = strstr(line, "binary mixed "))) {
+            ASSERT(strncmp(p, expect, strlen(expect)) == 0);
+            ++found;
+        } else if (strstr(line, "binary null (null)") || strstr(line, "binary bounded ab|abc|abcd|ef    |")
+                || strstr(line, "binary raw text")
+                || strstr(line, "binary direct 8")) {
+            ++found;
+        }
+    }
+    fclose(in);
+    ASSERT(count == TEST_THREAD_COUNT * TEST_LOG_COUNT);
+    ASSERT(found == 5);
+}
+
+void rate_limit_log_test()
+{
+    const char *filename = "xv_log_rate_test.log";
+    int ret = xv_set_log_filename(filename);
+    ASSERT(ret == XV_OK);
+
+    xv_set_log_rate_limit(10);
+    for (int i = 0; i < 1001; ++i) {
+        // the last one in next window, report suppressed count
+        if (i == 1000) {
+            usleep(1100000);
+        }
+        xv_log_error("rate limit seq %d", i);
+    }
+    xv_set_log_rate_limit(100);
+    xv_log_flush();
+
+    FILE *fp = fopen(filename, "r");
+    CHECK(fp, "fopen: ");
+    int logged = 0, suppressed = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = NULL;
+        int n = 0;
+        if (strstr(line, "rate limit seq ")) {
+            ++logged;
+        } else if ((p = strstr(line, "suppressed ")) && sscanf(p, "suppressed %d messages", &n) == 1) {
+            suppressed += n;
+        }
+    }
+    fclose(fp);
+    fprintf(stderr, "rate limit %d logged, %d suppressed\n", logged, suppressed);
+    ASSERT(logged + suppressed == 1001);
+    ASSERT(logged <= 21 && suppressed > 0);
+}
+
+// count logs of `tag` and suppressed reports in file
+void count_rate_log(const char *filename, const char *tag, int *logged, int *suppressed)
+{
+    FILE *fp = fopen(filename, "r");
+    CHECK(fp, "fopen: ");
+    *logged = 0;
+    *suppressed = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = NULL;
+        int n = 0;
+        if (strstr(line, tag)) {
+            ++*logged;
+        } else if ((p = strstr(line, "suppressed ")) && sscanf(p, "suppressed %d messages", &n) == 1) {
+            *suppressed += n;
+        }
+    }
+    fclose(fp);
+}
+
+// a burst with no more log of the site, the tail is reported too
+void rate_limit_tail_test()
+{
+    const char *filename = "xv_log_rate_tail_test.log";
+    int ret = xv_set_log_filename(filename);
+    ASSERT(ret == XV_OK);
+    xv_set_log_rate_limit(10);
+
+    // sync, report at flush
+    for (int i = 0; i < 100; ++i) {
+        xv_log_error("rate tail seq %d", i);
+    }
+    xv_log_flush();
+
+    int logged = 0, suppressed = 0;
+    count_rate_log(filename, "rate tail seq ", &logged, &suppressed);
+    fprintf(stderr, "rate limit tail %d logged, %d suppressed\n", logged, suppressed);
+    ASSERT(logged + suppressed == 100);
+    ASSERT(suppressed > 0);
+
+    // async, flusher report after the window without flush
+    int sync_suppressed = suppressed;
+    ret = xv_log_async_start(0, XV_LOG_OVERFLOW_BLOCK);
+    ASSERT(ret == XV_OK);
+    for (int i = 0; i < 100; ++i) {
+        xv_log_warn("rate async tail seq %d", i);
+    }
+    usleep(2100000);
+
+    count_rate_log(filename, "rate async tail seq ", &logged, &suppressed);
+    suppressed -= sync_suppressed;
+    fprintf(stderr, "rate limit async tail %d logged, %d suppressed\n", logged, suppressed);
+    ASSERT(logged + suppressed == 100);
+    ASSERT(suppressed > 0);
+
+    xv_log_async_stop();
+    xv_set_log_rate_limit(100);
+}
+
 int main(int argc, char *argv[])
 {
     xv_set_log_level(XV_LOG_DEBUG);
@@ -32,6 +276,15 @@ int main(int argc, char *argv[])
     xv_log_warn("this is a WARN log... %d", 2);
     xv_log_error("this is a ERROR log... %d", 3);
 
+    async_log_test(XV_LOG_OVERFLOW_BLOCK);
+    async_log_test(XV_LOG_OVERFLOW_DROP);
+    binary_log_test();
+    rate_limit_log_test();
+    rate_limit_tail_test();
+
+    // sync again
+    xv_log_info("this is a INFO log after async... %d", 4);
+
     return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,107 @@
+/**
+ * (C) 2007-2019 XiYouF4 Holding Limited
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Version: 1.0: xv_loop_timer_test.c 10/16/2026 $
+ *
+ * Authors:
+ *   hurley25 <liuhuan1992@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "xv_test.h"
+
+#define TEST_TIMEOUT_MS 20
+#define TEST_REPEAT_MS 10
+#define TEST_COUNT 5
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_cb(xv_loop_t *loop, xv_timer_t *timer)
+{
+    ASSERT(xv_timer_get_userdata(timer) == loop);
+
+    static int count = 0;
+    count++;
+    fprintf(stderr, "No.%d timer fired\n", count);
+
+    if (count == TEST_COUNT) {
+        xv_loop_break(loop);
+    }
+}
+
+void once_cb(xv_loop_t *loop, xv_timer_t *timer)
+{
+    int *fired = (int *)xv_timer_get_userdata(timer);
+    (*fired)++;
+    xv_loop_break(loop);
+}
+
+int main(int argc, char *argv[])
+{
+    //xv_set_log_level(XV_LOG_DEBUG);
+
+    xv_loop_t *loop = xv_loop_init(1024);
+
+    // repeat timer
+    xv_timer_t *timer = xv_timer_init(timer_cb, TEST_TIMEOUT_MS, TEST_REPEAT_MS);
+    ASSERT(timer != NULL);
+    xv_timer_set_userdata(timer, loop);
+
+    int64_t begin = now_ms();
+    int ret = xv_timer_start(loop, timer);
+    ASSERT(ret == XV_OK);
+
+    // blockiong here
+    xv_loop_run(loop);
+
+    int64_t cost = now_ms() - begin;
+    fprintf(stderr, "repeat timer cost %lld ms\n", (long long)cost);
+    ASSERT(cost >= TEST_TIMEOUT_MS + (TEST_COUNT - 1) * TEST_REPEAT_MS);
+
+    ret = xv_timer_stop(loop, timer);
+    ASSERT(ret == XV_OK);
+    ret = xv_timer_destroy(timer);
+    ASSERT(ret == XV_OK);
+    xv_loop_destroy(loop);
+
+    // one shot timer, rearm before it fired
+    loop = xv_loop_init(1024);
+    int fired = 0;
+    timer = xv_timer_init(once_cb, 1000, 0);
+    ASSERT(timer != NULL);
+    xv_timer_set_userdata(timer, &fired);
+
+    begin = now_ms();
+    ret = xv_timer_start(loop, timer);
+    ASSERT(ret == XV_OK);
+    ret = xv_timer_set(timer, TEST_TIMEOUT_MS, 0);
+    ASSERT(ret == XV_OK);
+
+    xv_loop_run(loop);
+
+    cost = now_ms() - begin;
+    fprintf(stderr, "one shot timer cost %lld ms\n", (long long)cost);
+    ASSERT(fired == 1);
+    ASSERT(cost >= TEST_TIMEOUT_MS && cost < 1000);
+
+    ret = xv_timer_stop(loop, timer);
+    ASSERT(ret == XV_OK);
+    ret = xv_timer_destroy(timer);
+    ASSERT(ret == XV_OK);
+
+    xv_loop_destroy(loop);
+
+    return EXIT_SUCCESS;
+}
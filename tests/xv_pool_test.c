@@ -0,0 +1,80 @@
+/**
+ * (C) 2007-2019 XiYouF4 Holding Limited
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Version: 1.0: xv_pool_test.c 10/16/2026 $
+ *
+ * Authors:
+ *   hurley25 <liuhuan1992@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "xv_test.h"
+#include "xv_pool.h"
+#include "xv_queue.h"
+
+#define TEST_OBJ_SIZE 64
+#define TEST_CACHE_SIZE 16
+#define TEST_COUNT 100000
+
+xv_pool_t *pool = NULL;
+xv_concurrent_queue_t *queue = NULL;
+
+// alloc in this thread, free in main thread
+void *producer_fun(void *args)
+{
+    for (int i = 0; i < TEST_COUNT; ++i) {
+        char *obj = (char *)xv_pool_alloc(pool);
+        ASSERT(obj != NULL);
+        memset(obj, i & 0xff, TEST_OBJ_SIZE);
+        xv_concurrent_queue_push(queue, obj);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    pool = xv_pool_init(TEST_OBJ_SIZE, TEST_CACHE_SIZE);
+    ASSERT(pool != NULL);
+
+    // freed object is reused in the same thread
+    void *obj = xv_pool_alloc(pool);
+    ASSERT(obj != NULL);
+    xv_pool_free(pool, obj);
+    ASSERT(xv_pool_alloc(pool) == obj);
+    xv_pool_free(pool, obj);
+
+    // ----------------------------------------
+
+    queue = xv_concurrent_queue_init();
+
+    pthread_t id;
+    int ret = pthread_create(&id, NULL, producer_fun, NULL);
+    ASSERT(ret == 0);
+
+    for (int i = 0; i < TEST_COUNT; ++i) {
+        char *obj = NULL;
+        while (!(obj = (char *)xv_concurrent_queue_pop(queue))) {
+            ;
+        }
+        ASSERT(obj[0] == (char)(i & 0xff));
+        ASSERT(obj[TEST_OBJ_SIZE - 1] == (char)(i & 0xff));
+        xv_pool_free(pool, obj);
+    }
+
+    ret = pthread_join(id, NULL);
+    ASSERT(ret == 0);
+
+    xv_concurrent_queue_destroy(queue, NULL);
+    xv_pool_destroy(pool);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,246 @@
+/**
+ * (C) 2007-2019 XiYouF4 Holding Limited
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Version: 1.0: xv_service_connect_test.c 08/13/2019 $
+ *
+ * Authors:
+ *   hurley25 <liuhuan1992@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+
+#include "xv_test.h"
+#include "xv_service.h"
+#include "xv_socket.h"
+
+#define TEST_PORT 12347
+#define TEST_UNIX_PATH "xv_service_connect_test.sock"
+#define TEST_CONN_COUNT 8
+#define TEST_ROUNDS 100
+
+// the service connect to itself, outbound connections ping the echo listeners
+xv_service_t *service = NULL;
+xv_atomic_t connected;
+xv_atomic_t finished;
+xv_atomic_t failed;
+int base_fd_count = 0;
+
+typedef struct packet_t {
+    int len;
+    char buf[0];
+} packet_t;
+
+packet_t *packet_init(const char *buf, int len)
+{
+    packet_t *packet = (packet_t *)xv_malloc(sizeof(int) + len + 1);
+    memcpy(packet->buf, buf, len);
+    packet->buf[len] = '\0';
+    packet->len = len;
+
+    return packet;
+}
+
+int encode(xv_buffer_t *buffer, void *reponse)
+{
+    packet_t *resp = (packet_t *)reponse;
+    xv_buffer_write_data(buffer, resp->buf, resp->len);
+
+    return XV_OK;
+}
+
+void packet_cleanup(void *packet)
+{
+    xv_free(packet);
+}
+
+int fd_count()
+{
+    DIR *dir = opendir("/proc/self/fd");
+    CHECK(dir, "opendir: ");
+    int count = 0;
+    while (readdir(dir)) {
+        ++count;
+    }
+    closedir(dir);
+
+    return count;
+}
+
+void check_finish()
+{
+    if (xv_atomic_get(&finished) == TEST_CONN_COUNT * 2 && xv_atomic_get(&failed) == 1) {
+        // both ends of every connection, connect timers are freed after connected
+        int count = fd_count();
+        fprintf(stderr, "%d fds, %d before connect\n", count, base_fd_count);
+        ASSERT(count == base_fd_count + TEST_CONN_COUNT * 4);
+        kill(getpid(), SIGINT);
+    }
+}
+
+// echo listener, take all bytes
+int echo_decode(xv_buffer_t *buffer, void **request)
+{
+    int size = xv_buffer_readable_size(buffer);
+    *request = packet_init(xv_buffer_read_begin(buffer), size);
+    xv_buffer_incr_read_index(buffer, size);
+
+    return XV_OK;
+}
+
+int echo_process(xv_message_t *message)
+{
+    packet_t *request = (packet_t *)xv_message_get_request(message);
+    xv_message_set_response(message, packet_init(request->buf, request->len));
+
+    return XV_OK;
+}
+
+// outbound connection, one line one packet
+int ping_decode(xv_buffer_t *buffer, void **request)
+{
+    char *begin = xv_buffer_read_begin(buffer);
+    char *end = memchr(begin, '\n', xv_buffer_readable_size(buffer));
+    if (!end) {
+        return XV_AGAIN;
+    }
+    int len = end - begin + 1;
+    *request = packet_init(begin, len);
+    xv_buffer_incr_read_index(buffer, len);
+
+    return XV_OK;
+}
+
+// response of the echo is the next request to it
+int ping_process(xv_message_t *message)
+{
+    packet_t *request = (packet_t *)xv_message_get_request(message);
+    int seq = 0;
+    ASSERT(sscanf(request->buf, "ping %d\n", &seq) == 1);
+    if (seq == TEST_ROUNDS) {
+        xv_atomic_incr(&finished);
+        check_finish();
+        return XV_OK;
+    }
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "ping %d\n", seq + 1);
+    xv_message_set_response(message, packet_init(buf, len));
+
+    return XV_OK;
+}
+
+void ping_on_connect(xv_connection_t *conn)
+{
+    xv_atomic_incr(&connected);
+
+    const char *ping = "ping 0\n";
+    int ret = xv_service_send_message(conn, packet_init(ping, strlen(ping)));
+    ASSERT(ret == XV_OK);
+}
+
+void refused_on_connect(xv_connection_t *conn)
+{
+    ASSERT(0 && "connect to a closed port should fail");
+}
+
+void refused_on_disconnect(xv_connection_t *conn)
+{
+    fprintf(stderr, "connect to %s:%d failed as expected\n", xv_connection_get_addr(conn), xv_connection_get_port(conn));
+    xv_atomic_incr(&failed);
+    check_finish();
+}
+
+void handle_sigint(int sig)
+{
+    if (sig == SIGINT) {
+        fprintf(stderr, "recv sigint, exit now\n");
+        if (service) {
+            xv_service_stop(service);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_sigint);
+
+    xv_service_handle_t echo_handle;
+    bzero(&echo_handle, sizeof(echo_handle));
+    echo_handle.decode = echo_decode;
+    echo_handle.process = echo_process;
+    echo_handle.encode = encode;
+    echo_handle.packet_cleanup = packet_cleanup;
+
+    xv_service_handle_t ping_handle;
+    bzero(&ping_handle, sizeof(ping_handle));
+    ping_handle.decode = ping_decode;
+    ping_handle.process = ping_process;
+    ping_handle.encode = encode;
+    ping_handle.packet_cleanup = packet_cleanup;
+    ping_handle.on_connect = ping_on_connect;
+
+    xv_service_handle_t refused_handle = ping_handle;
+    refused_handle.on_connect = refused_on_connect;
+    refused_handle.on_disconnect = refused_on_disconnect;
+
+    xv_service_config_t config;
+    bzero(&config, sizeof(config));
+    config.io_thread_count = 4;
+    config.worker_thread_count = 4;
+    config.tcp_nodealy = 1;
+
+    // ./xv_service_connect_test [direct_write]
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "direct_write") == 0) {
+            config.direct_write_enable = 1;
+        }
+    }
+
+    xv_atomic_set(&connected, 0);
+    xv_atomic_set(&finished, 0);
+    xv_atomic_set(&failed, 0);
+
+    service = xv_service_init(config);
+    ASSERT(service);
+
+    int ret = xv_service_add_listen(service, "127.0.0.1", TEST_PORT, echo_handle);
+    ASSERT(ret == XV_OK);
+    ret = xv_service_add_listen(service, "unix:" TEST_UNIX_PATH, 0, echo_handle);
+    ASSERT(ret == XV_OK);
+
+    ret = xv_service_start(service);
+    ASSERT(ret == XV_OK);
+
+    base_fd_count = fd_count();
+    for (int i = 0; i < TEST_CONN_COUNT; ++i) {
+        uint64_t conn_id = xv_service_connect(service, "127.0.0.1", TEST_PORT, ping_handle);
+        ASSERT(conn_id != 0);
+        conn_id = xv_service_connect(service, "unix:" TEST_UNIX_PATH, 0, ping_handle);
+        ASSERT(conn_id != 0);
+    }
+
+    // nobody listen on it, connect fail in io thread or at once
+    if (xv_service_connect(service, "127.0.0.1", TEST_PORT + 1, refused_handle) == 0) {
+        xv_atomic_incr(&failed);
+        check_finish();
+    }
+
+    ret = xv_service_run(service);
+    ASSERT(ret == XV_OK);
+
+    fprintf(stderr, "%d connected, %d finished %d rounds\n", xv_atomic_get(&connected), xv_atomic_get(&finished), TEST_ROUNDS);
+    ASSERT(xv_atomic_get(&connected) == TEST_CONN_COUNT * 2);
+
+    xv_service_destroy(service);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+/**
+ * (C) 2007-2019 XiYouF4 Holding Limited
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Version: 1.0: xv_service_emfile_test.c 08/13/2019 $
+ *
+ * Authors:
+ *   hurley25 <liuhuan1992@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "xv_test.h"
+#include "xv_service.h"
+#include "xv_socket.h"
+
+#define SEND_STR "hello xv!"
+#define TEST_PORT 12345
+#define TEST_FREE_FD_COUNT 8
+#define TEST_CONN_COUNT 24
+
+xv_service_t *service = NULL;
+
+// 1 echoed, 0 closed by server
+int echo_once(int fd)
+{
+    struct timeval tv = {3, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    const char *str = SEND_STR;
+    const int len = strlen(str);
+    if (write(fd, str, len) != len) {
+        return 0;
+    }
+
+    char buf[len];
+    int nread = 0;
+    while (nread < len) {
+        int ret = read(fd, buf + nread, len - nread);
+        if (ret == 0 || (ret < 0 && errno == ECONNRESET)) {
+            return 0;
+        }
+        CHECK(ret > 0, "read: ");
+        nread += ret;
+    }
+    CHECK(memcmp(str, buf, len) == 0, "read data != write data");
+
+    return 1;
+}
+
+// run in child process, the server has only a few free fds
+void client_fun()
+{
+    usleep(200000);
+
+    int fds[TEST_CONN_COUNT];
+    for (int i = 0; i < TEST_CONN_COUNT; ++i) {
+        fds[i] = xv_tcp_connect("127.0.0.1", TEST_PORT);
+        CHECK(fds[i] > 0, "xv_tcp_connect: ");
+    }
+
+    // excess connections are closed at once, not hang
+    int echoed = 0, closed = 0;
+    for (int i = 0; i < TEST_CONN_COUNT; ++i) {
+        if (echo_once(fds[i])) {
+            ++echoed;
+        } else {
+            ++closed;
+        }
+    }
+    fprintf(stderr, "%d echoed, %d closed by server\n", echoed, closed);
+    CHECK(echoed > 0 && closed > 0, "no fd exhausted");
+
+    for (int i = 0; i < TEST_CONN_COUNT; ++i) {
+        xv_close(fds[i]);
+    }
+
+    // accept resume when fds released
+    usleep(100000);
+    int fd = xv_tcp_connect("127.0.0.1", TEST_PORT);
+    CHECK(fd > 0, "xv_tcp_connect: ");
+    CHECK(echo_once(fd) == 1, "accept not resume");
+    xv_close(fd);
+
+    kill(getppid(), SIGINT);
+}
+
+typedef struct packet_t {
+    int len;
+    char buf[0];
+} packet_t;
+
+int decode(xv_buffer_t *buffer, void **request)
+{
+    int size = xv_buffer_readable_size(buffer);
+    packet_t *req = (packet_t *)xv_malloc(sizeof(int) + size);
+    req->len = xv_buffer_read_data(buffer, req->buf, size);
+    *request = req;
+
+    return XV_OK;
+}
+
+int process(xv_message_t *message)
+{
+    packet_t *request = (packet_t *)xv_message_get_request(message);
+    packet_t *response = (packet_t *)xv_malloc(sizeof(int) + request->len);
+    memcpy(response->buf, request->buf, request->len);
+    response->len = request->len;
+    xv_message_set_response(message, response);
+
+    return XV_OK;
+}
+
+int encode(xv_buffer_t *buffer, void *reponse)
+{
+    packet_t *resp = (packet_t *)reponse;
+    xv_buffer_write_data(buffer, resp->buf, resp->len);
+
+    return XV_OK;
+}
+
+void packet_cleanup(void *packet)
+{
+    xv_free(packet);
+}
+
+void handle_sigint(int sig)
+{
+    if (sig == SIGINT) {
+        fprintf(stderr, "recv sigint, exit now\n");
+        if (service) {
+            xv_service_stop(service);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // xv_set_log_level(XV_LOG_DEBUG);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_sigint);
+
+    pid_t pid = fork();
+    CHECK(pid >= 0, "fork: ");
+    if (pid == 0) {
+        client_fun();
+        exit(EXIT_SUCCESS);
+    }
+
+    xv_service_handle_t handle;
+    bzero(&handle, sizeof(handle));
+    handle.decode = decode;
+    handle.process = process;
+    handle.encode = encode;
+    handle.packet_cleanup = packet_cleanup;
+
+    xv_service_config_t config;
+    bzero(&config, sizeof(config));
+    config.io_thread_count = 2;
+    config.worker_thread_count = 2;
+    config.tcp_nodealy = 1;
+
+    service = xv_service_init(config);
+    ASSERT(service);
+
+    int ret = xv_service_add_listen(service, "0.0.0.0", TEST_PORT, handle);
+    ASSERT(ret == XV_OK);
+
+    ret = xv_service_start(service);
+    ASSERT(ret == XV_OK);
+
+    // leave only a few free fds
+    int fd = dup(0);
+    CHECK(fd >= 0, "dup: ");
+    xv_close(fd);
+    struct rlimit limit;
+    ret = getrlimit(RLIMIT_NOFILE, &limit);
+    CHECK(ret == 0, "getrlimit: ");
+    limit.rlim_cur = fd + TEST_FREE_FD_COUNT;
+    ret = setrlimit(RLIMIT_NOFILE, &limit);
+    CHECK(ret == 0, "setrlimit: ");
+
+    ret = xv_service_run(service);
+    ASSERT(ret == XV_OK);
+
+    int status = 0;
+    ret = waitpid(pid, &status, 0);
+    CHECK(ret == pid, "waitpid: ");
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+    xv_service_destroy(service);
+
+    return EXIT_SUCCESS;
+}
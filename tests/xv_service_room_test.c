@@ -14,22 +14,66 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/socket.h>
 
 #include "xv_test.h"
 #include "xv_service.h"
 #include "xv_socket.h"
 
+#define SEND_STR "hello room!"
 #define TEST_PORT 12345
 #define TEST_COUNT 10
+#define TEST_ROOM_ID 1
 
-#define MAX_CONN 100
+xv_service_t *service = NULL;
+
+// 0: group publish, 1: broadcast all, 2: broadcast list
+int broadcast_mode = 0;
+
+pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+xv_connection_t *conns[TEST_COUNT];
+int conn_count = 0;
+
+void *client_fun(void *args)
+{
+    int fds[TEST_COUNT];
+    for (int i = 0; i < TEST_COUNT; ++i) {
+        fds[i] = xv_tcp_connect("127.0.0.1", TEST_PORT);
+        CHECK(fds[i] > 0, "xv_tcp_connect: ");
+    }
+    // wait all connections join the room
+    usleep(100000);
+
+    const char *str = SEND_STR;
+    const int len = strlen(str);
+    int ret = xv_block_write(fds[0], str, len);
+    CHECK(ret == len, "write: ");
+
+    // everyone in the room got it
+    for (int i = 0; i < TEST_COUNT; ++i) {
+        char buf[len];
+        ret = xv_block_read(fds[i], buf, len);
+        CHECK(ret == len, "read size != write size");
+        CHECK(memcmp(str, buf, len) == 0, "read data != write data");
+    }
+    // and only once
+    usleep(100000);
+    for (int i = 0; i < TEST_COUNT; ++i) {
+        char buf[1];
+        ret = recv(fds[i], buf, sizeof(buf), MSG_DONTWAIT);
+        CHECK(ret == -1 && errno == EAGAIN, "recv more than once: ");
+        xv_close(fds[i]);
+    }
 
-// just for demo test
-xv_connection_t *conn_array[MAX_CONN];
-pthread_mutex_t mutex;
+    usleep(100000);
+    kill(getpid(), SIGINT);
+
+    return NULL;
+}
 
 typedef struct packet_t {
     int len;
@@ -50,21 +94,24 @@ int decode(xv_buffer_t *buffer, void **request)
     return XV_OK;
 }
 
+int encode(xv_buffer_t *buffer, void *reponse);
+
 int process(xv_message_t *message)
 {
     packet_t *request = (packet_t *)xv_message_get_request(message);
 
-    for (int i = 0; i < MAX_CONN; ++i) {
-        pthread_mutex_lock(&mutex);
-        if (conn_array[i]) {
-            packet_t *response = (packet_t *)xv_malloc(sizeof(int) + request->len);
-            memcpy(response->buf, request->buf, request->len);
-            response->len = request->len;
-
-            xv_service_send_message(conn_array[i], response);
-        }
-        pthread_mutex_unlock(&mutex);
+    // encode once, send to everyone in the room
+    int ret = XV_OK;
+    if (broadcast_mode == 1) {
+        ret = xv_service_broadcast(service, encode, request);
+    } else if (broadcast_mode == 2) {
+        pthread_mutex_lock(&conns_mutex);
+        ret = xv_service_broadcast_list(service, conns, conn_count, encode, request);
+        pthread_mutex_unlock(&conns_mutex);
+    } else {
+        ret = xv_service_group_publish(service, TEST_ROOM_ID, encode, request);
     }
+    ASSERT(ret == XV_OK);
 
     return XV_OK;
 }
@@ -86,35 +133,22 @@ void on_connect(xv_connection_t *conn)
 {
     fprintf(stderr, "new connection: %s:%d\n", xv_connection_get_addr(conn), xv_connection_get_port(conn));
 
-    int fd = xv_connection_get_fd(conn);
-    if (fd > MAX_CONN) {
-        fprintf(stderr, "MAX_CONN to small, fd is %d, exit", fd);
-        exit(-1);
+    if (broadcast_mode) {
+        pthread_mutex_lock(&conns_mutex);
+        ASSERT(conn_count < TEST_COUNT);
+        conns[conn_count++] = conn;
+        pthread_mutex_unlock(&conns_mutex);
+        return;
     }
-
-    pthread_mutex_lock(&mutex);
-
-    xv_connection_incr_ref(conn);
-    conn_array[fd] = conn;
-
-    pthread_mutex_unlock(&mutex);
+    int ret = xv_service_group_join(conn, TEST_ROOM_ID);
+    ASSERT(ret == XV_OK);
 }
 
 void on_disconnect(xv_connection_t *conn)
 {
     fprintf(stderr, "close connection: %s:%d\n", xv_connection_get_addr(conn), xv_connection_get_port(conn));
-
-    int fd = xv_connection_get_fd(conn);
-    pthread_mutex_lock(&mutex);
-
-    conn_array[fd] = NULL;
-    xv_connection_decr_ref(conn);
-
-    pthread_mutex_unlock(&mutex);
 }
 
-xv_service_t *service = NULL;
-
 void handle_sigint(int sig)
 {
     if (sig == SIGINT) {
@@ -129,11 +163,16 @@ int main(int argc, char *argv[])
 {
     // xv_set_log_level(XV_LOG_DEBUG);
 
+    // usage: xv_service_room_test [broadcast|broadcast_list]
+    if (argc > 1 && strcmp(argv[1], "broadcast") == 0) {
+        broadcast_mode = 1;
+    } else if (argc > 1 && strcmp(argv[1], "broadcast_list") == 0) {
+        broadcast_mode = 2;
+    }
+
     signal(SIGPIPE, SIG_IGN);
     signal(SIGINT, handle_sigint);
 
-    pthread_mutex_init(&mutex, NULL);
-
     xv_service_handle_t handle;
     bzero(&handle, sizeof(handle));
     handle.on_connect = on_connect;
@@ -144,6 +183,7 @@ int main(int argc, char *argv[])
     handle.packet_cleanup = packet_cleanup;
 
     xv_service_config_t config;
+    bzero(&config, sizeof(config));
     config.io_thread_count = 4;
     config.worker_thread_count = 4;
     config.tcp_nodealy = 1;
@@ -157,12 +197,17 @@ int main(int argc, char *argv[])
     ret = xv_service_start(service);
     ASSERT(ret == XV_OK);
 
+    pthread_t id;
+    ret = pthread_create(&id, NULL, client_fun, NULL);
+    CHECK(ret == 0, "pthread_create: ");
+
     ret = xv_service_run(service);
     ASSERT(ret == XV_OK);
 
-    xv_service_destroy(service);
+    ret = pthread_join(id, NULL);
+    CHECK(ret == 0, "pthread_join: ");
 
-    pthread_mutex_destroy(&mutex);
+    xv_service_destroy(service);
 
     return EXIT_SUCCESS;
 }
@@ -17,31 +17,85 @@
 #include <unistd.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "xv_test.h"
 #include "xv_service.h"
 #include "xv_socket.h"
+#include "xv_queue.h"
 
 #define SEND_STR "hello xv!"
+#define SPIN_STR "spin!"
+#define BUSY_CHAR '#'
 #define TEST_PORT 12345
+#define TEST_UNIX_PATH "xv_service_test.sock"
 #define TEST_THREAD_COUNT 4
+#define TEST_IO_THREAD_COUNT 4
 #define TEST_COUNT 50
+#define TEST_REQUEST_RATE 200
+
+int unix_enable = 0;
+int reuseport_enable = 0;
+xv_atomic_t accept_count[TEST_IO_THREAD_COUNT];
+int pipeline_enable = 0;
+int test_count = TEST_COUNT;
+int limit_enable = 0;
+int rate_limit_enable = 0;
+xv_atomic_t request_count;
+xv_atomic_t client_done;
+xv_atomic_t reject_count;
+int placement_enable = 0;
+int placement_policy = 0;
+int stale_id_enable = 0;
+volatile int setup_done = 0;
+
+typedef struct packet_t {
+    int len;
+    char buf[0];
+} packet_t;
+
+xv_service_t *service = NULL;
+
+// io thread idx & id of every accepted connection, indexed by client port
+volatile int conn_thread[65536];
+volatile uint64_t conn_ids[65536];
 
 void connect_once()
 {
     const char *str = SEND_STR;
-    int fd = xv_tcp_connect("127.0.0.1", TEST_PORT);
-    CHECK(fd > 0, "xv_tcp_connect: ");
-
-    int ret = xv_tcp_nodelay(fd);
-    CHECK(ret == XV_OK, "xv_tcp_nodelay(fd) failed!");
+    int ret = 0;
+    int fd = 0;
+    if (unix_enable) {
+        fd = xv_unix_connect(TEST_UNIX_PATH);
+        CHECK(fd > 0, "xv_unix_connect: ");
+    } else {
+        fd = xv_tcp_connect("127.0.0.1", TEST_PORT);
+        CHECK(fd > 0, "xv_tcp_connect: ");
+
+        ret = xv_tcp_nodelay(fd);
+        CHECK(ret == XV_OK, "xv_tcp_nodelay(fd) failed!");
+    }
 
     const int len = strlen(str);
-    for (int i = 0; i < len; ++i) {
+    if (pipeline_enable) {
+        // every response must arrive, not hang on the requests left in server's read buffer
+        struct timeval timeout = {5, 0};
+        ret = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        CHECK(ret == 0, "setsockopt: ");
+
+        // every byte is a request, all in one write
+        ret = xv_block_write(fd, str, len);
+        CHECK(ret == len, "write: ");
+    } else {
+        for (int i = 0; i < len; ++i) {
             int ret = xv_block_write(fd, str + i, 1);
             usleep(1000);
             CHECK(ret == 1, "write: ");
         }
+    }
 
     char buf[len + 1];
     ret = xv_block_read(fd, buf, len);
@@ -51,21 +105,209 @@ void connect_once()
     buf[len] = '\0';
     fprintf(stderr, "%s\n", buf);
 
-    CHECK(memcmp(str, buf, ret) == 0, "read data != write data");
+    for (int i = 0; i < ret; ++i) {
+        // every byte is a request, rejected one get a busy response
+        if (limit_enable && buf[i] == BUSY_CHAR) {
+            xv_atomic_incr(&reject_count);
+            continue;
+        }
+        CHECK(buf[i] == str[i], "read data != write data");
+    }
 
     xv_close(fd);
 }
 
+// connect and wait for the server side dispatching, return the io thread idx
+int placement_connect(int *fd)
+{
+    *fd = xv_tcp_connect("127.0.0.1", TEST_PORT);
+    CHECK(*fd > 0, "xv_tcp_connect: ");
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int ret = getsockname(*fd, (struct sockaddr *)&addr, &len);
+    CHECK(ret == 0, "getsockname: ");
+    int port = ntohs(addr.sin_port);
+
+    for (int i = 0; i < 2000 && conn_thread[port] == 0; ++i) {
+        usleep(1000);
+    }
+    ASSERT(conn_thread[port] > 0);
+
+    int idx = conn_thread[port];
+    conn_thread[port] = 0;
+    return idx;
+}
+
+// wait for the closed connections leaving the io threads
+void placement_wait(int c1, int c2, int c3)
+{
+    int expect[4] = { 0, c1, c2, c3 };
+    for (int i = 0; i < 2000; ++i) {
+        int done = 1;
+        for (int j = 1; j < 4; ++j) {
+            if (xv_service_get_io_thread_conn_count(service, j) != expect[j]) {
+                done = 0;
+            }
+        }
+        if (done) {
+            return;
+        }
+        usleep(1000);
+    }
+    ASSERT(0);
+}
+
+// 4 io threads and leader don't serve, connections go to io thread 1 ~ 3
+void placement_least_conn()
+{
+    int fds[3][2];
+    for (int i = 0; i < 2; ++i) {
+        for (int j = 1; j < 4; ++j) {
+            ASSERT(placement_connect(&fds[j - 1][i]) == j);
+        }
+    }
+    placement_wait(2, 2, 2);
+
+    // skewed lifetimes, new connections fill the threads with least connections
+    xv_close(fds[2][0]);
+    xv_close(fds[2][1]);
+    xv_close(fds[1][0]);
+    placement_wait(2, 1, 0);
+
+    ASSERT(placement_connect(&fds[2][0]) == 3);
+    ASSERT(placement_connect(&fds[1][0]) == 2);
+    ASSERT(placement_connect(&fds[2][1]) == 3);
+    placement_wait(2, 2, 2);
+
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 2; ++j) {
+            xv_close(fds[i][j]);
+        }
+    }
+    placement_wait(0, 0, 0);
+}
+
+// inline mode, a spin request keeps its io thread busy
+void placement_least_load()
+{
+    int fds[3];
+    int busy_fd = 0;
+    int busy_idx = placement_connect(&busy_fd);
+
+    const char *str = SPIN_STR;
+    const int len = strlen(str);
+    int ret = xv_block_write(busy_fd, str, len);
+    CHECK(ret == len, "write: ");
+    char buf[len];
+    ret = xv_block_read(busy_fd, buf, len);
+    CHECK(ret == len, "read: ");
+
+    // fewest connections but most busy, new connections avoid it
+    for (int i = 0; i < 3; ++i) {
+        ASSERT(placement_connect(&fds[i]) != busy_idx);
+    }
+
+    xv_close(busy_fd);
+    for (int i = 0; i < 3; ++i) {
+        xv_close(fds[i]);
+    }
+    placement_wait(0, 0, 0);
+}
+
+// connect and wait for the server side connection id
+uint64_t stale_id_connect(int *fd)
+{
+    *fd = xv_tcp_connect("127.0.0.1", TEST_PORT);
+    CHECK(*fd > 0, "xv_tcp_connect: ");
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int ret = getsockname(*fd, (struct sockaddr *)&addr, &len);
+    CHECK(ret == 0, "getsockname: ");
+    int port = ntohs(addr.sin_port);
+
+    for (int i = 0; i < 2000 && conn_ids[port] == 0; ++i) {
+        usleep(1000);
+    }
+    ASSERT(conn_ids[port] != 0);
+
+    uint64_t conn_id = conn_ids[port];
+    conn_ids[port] = 0;
+    return conn_id;
+}
+
+// id of a closed connection don't reach the new one which reuse its fd
+void stale_id_check()
+{
+    int fd = 0;
+    uint64_t old_id = stale_id_connect(&fd);
+    xv_close(fd);
+
+    uint64_t new_id = 0;
+    for (int i = 0; i < 100; ++i) {
+        new_id = stale_id_connect(&fd);
+        if ((uint32_t)new_id == (uint32_t)old_id) {
+            break;
+        }
+        // server side fd not closed yet
+        xv_close(fd);
+        usleep(10000);
+    }
+    ASSERT((uint32_t)new_id == (uint32_t)old_id);
+    ASSERT(new_id != old_id);
+
+    packet_t *packet = (packet_t *)xv_malloc(sizeof(int) + 1);
+    packet->buf[0] = 'x';
+    packet->len = 1;
+    ASSERT(xv_service_send_message_by_id(service, old_id, packet) == XV_ERR);
+
+    packet->buf[0] = 'y';
+    ASSERT(xv_service_send_message_by_id(service, new_id, packet) == XV_OK);
+    char c = 0;
+    int ret = xv_block_read(fd, &c, 1);
+    CHECK(ret == 1, "read: ");
+    ASSERT(c == 'y');
+
+    xv_close(fd);
+}
+
+void *setup_fun(void *args)
+{
+    (void)args;
+
+    if (stale_id_enable) {
+        stale_id_check();
+    }
+    if (placement_enable && placement_policy == XV_DISPATCH_LEAST_CONN) {
+        placement_least_conn();
+    } else if (placement_enable) {
+        placement_least_load();
+    }
+    setup_done = 1;
+
+    return NULL;
+}
+
 void *client_fun(void *args)
 {
     int idx = *(int *)args;
     xv_free(args);
 
-    for (int i = 0; i < TEST_COUNT; ++i) {
+    while ((placement_enable || stale_id_enable) && !setup_done) {
+        usleep(1000);
+    }
+
+    for (int i = 0; i < test_count; ++i) {
         connect_once();
     }
 
+    // stop the service after all clients got their responses
+    xv_atomic_incr(&client_done);
     if (idx == 0) {
+        while (xv_atomic_get(&client_done) < TEST_THREAD_COUNT) {
+            usleep(1000);
+        }
         usleep(100000);
         kill(getpid(), SIGINT);
     }
@@ -73,37 +315,105 @@ void *client_fun(void *args)
     return NULL;
 }
 
-typedef struct packet_t {
-    int len;
-    char buf[0];
-} packet_t;
-
 int decode(xv_buffer_t *buffer, void **request)
 {
     int size = xv_buffer_readable_size(buffer);
+    if (pipeline_enable) {
+        // one byte one request, the rest stay in buffer
+        size = 1;
+    }
     packet_t *req = (packet_t *)xv_malloc(sizeof(int) + size);
     int readn = xv_buffer_read_data(buffer, req->buf, size);
     req->len = readn;
     *request = req;
 
     ASSERT(readn == size);
-    ASSERT(xv_buffer_readable_size(buffer) == 0);
+    ASSERT(pipeline_enable || xv_buffer_readable_size(buffer) == 0);
 
     return XV_OK;
 }
 
+int sockopt_enable = 0;
+int migrate_enable = 0;
+int send_by_id_enable = 0;
+int deferred_enable = 0;
+xv_concurrent_queue_t *deferred_queue = NULL;
+
+// complete deferred messages in other thread, as a downstream service reply
+void *deferred_fun(void *args)
+{
+    while (1) {
+        xv_message_t *message = (xv_message_t *)xv_concurrent_queue_pop(deferred_queue);
+        if (!message) {
+            usleep(1000);
+            continue;
+        }
+        packet_t *request = (packet_t *)xv_message_get_request(message);
+        packet_t *response = (packet_t *)xv_malloc(sizeof(int) + request->len);
+        memcpy(response->buf, request->buf, request->len);
+        response->len = request->len;
+
+        xv_message_complete(message, response);
+    }
+
+    return NULL;
+}
+
 int process(xv_message_t *message)
 {
+    if (migrate_enable) {
+        // move the connection to next io thread every request
+        xv_connection_t *conn = xv_message_get_connection(message);
+        int idx = xv_connection_get_io_thread_idx(conn) + 1;
+        int ret = xv_service_migrate_connection(conn, idx % xv_service_get_io_thread_count(service));
+        ASSERT(ret == XV_OK);
+    }
+
+    if (deferred_enable) {
+        xv_concurrent_queue_push(deferred_queue, message);
+        return XV_AGAIN;
+    }
+
     packet_t *request = (packet_t *)xv_message_get_request(message);
+    if (rate_limit_enable) {
+        xv_atomic_incr(&request_count);
+    }
+    if (limit_enable) {
+        // slow request, keep the limit busy
+        usleep(2000);
+    }
+    if (placement_enable && request->len == (int)strlen(SPIN_STR) && memcmp(request->buf, SPIN_STR, request->len) == 0) {
+        usleep(200000);
+    }
     packet_t *response = (packet_t *)xv_malloc(sizeof(int) + request->len);
     memcpy(response->buf, request->buf, request->len);
     response->len = request->len;
 
+    if (send_by_id_enable) {
+        // reply by connection id, as a thread which don't hold the connection
+        uint64_t conn_id = xv_connection_get_id(xv_message_get_connection(message));
+        ASSERT(conn_id != 0);
+        if (xv_service_send_message_by_id(service, conn_id, response) != XV_OK) {
+            xv_free(response);
+        }
+        return XV_OK;
+    }
     xv_message_set_response(message, response);
 
     return XV_OK;
 }
 
+// busy response, same size as the request for the client check
+void on_reject(xv_message_t *message)
+{
+    packet_t *request = (packet_t *)xv_message_get_request(message);
+    packet_t *response = (packet_t *)xv_malloc(sizeof(int) + request->len);
+    memset(response->buf, BUSY_CHAR, request->len);
+    response->len = request->len;
+
+    xv_message_set_response(message, response);
+}
+
 int encode(xv_buffer_t *buffer, void *reponse)
 {
     packet_t *resp = (packet_t *)reponse;
@@ -117,8 +427,37 @@ void packet_cleanup(void *packet)
     xv_free(packet);
 }
 
+int get_sockopt(int fd, int level, int name)
+{
+    int val = 0;
+    socklen_t len = sizeof(val);
+    int ret = getsockopt(fd, level, name, &val, &len);
+    CHECK(ret == 0, "getsockopt: ");
+
+    return val;
+}
+
 void on_connect(xv_connection_t *conn)
 {
+    if (sockopt_enable) {
+        // inherited from the listen socket
+        int fd = xv_connection_get_fd(conn);
+        ASSERT(get_sockopt(fd, SOL_SOCKET, SO_KEEPALIVE) == 1);
+        ASSERT(get_sockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE) == 30);
+        ASSERT(get_sockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL) == 5);
+        ASSERT(get_sockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT) == 16384);
+        ASSERT(get_sockopt(fd, IPPROTO_TCP, TCP_NODELAY) == 1);
+    }
+    if (placement_enable) {
+        conn_thread[xv_connection_get_port(conn)] = xv_connection_get_io_thread_idx(conn);
+    }
+    if (stale_id_enable) {
+        conn_ids[xv_connection_get_port(conn)] = xv_connection_get_id(conn);
+    }
+    if (reuseport_enable) {
+        // every io thread accept on its own socket, no dispatch
+        xv_atomic_incr(&accept_count[xv_connection_get_io_thread_idx(conn)]);
+    }
     fprintf(stderr, "new connection: %s:%d\n",
             xv_connection_get_addr(conn), xv_connection_get_port(conn));
 }
@@ -129,8 +468,6 @@ void on_disconnect(xv_connection_t *conn)
             xv_connection_get_addr(conn), xv_connection_get_port(conn));
 }
 
-xv_service_t *service = NULL;
-
 void handle_sigint(int sig)
 {
     if (sig == SIGINT) {
@@ -158,19 +495,108 @@ int main(int argc, char *argv[])
     handle.packet_cleanup = packet_cleanup;
 
     xv_service_config_t config;
-    config.io_thread_count = 4;
+    bzero(&config, sizeof(config));
+    config.io_thread_count = TEST_IO_THREAD_COUNT;
     config.worker_thread_count = 4;
     config.tcp_nodealy = 1;
 
+    xv_socket_options_t options;
+    bzero(&options, sizeof(options));
+
+    // ./xv_service_test [unix] [sockopt] [reuseport] [round_robin|least_conn|least_load] [leader_serve] [migrate] [send_by_id] [deferred] [inline|adaptive] [worker_encode] [direct_write] [limit] [queue_limit] [rate_limit] [pipeline]
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "unix") == 0) {
+            unix_enable = 1;
+        } else if (strcmp(argv[i], "sockopt") == 0) {
+            sockopt_enable = 1;
+            options.backlog = 128;
+            options.recv_buffer_size = 65536;
+            options.tcp_quickack = 1;
+            options.defer_accept_sec = 1;
+            options.keepalive = 1;
+            options.keepalive_idle_sec = 30;
+            options.keepalive_interval_sec = 5;
+            options.keepalive_count = 3;
+            options.notsent_lowat = 16384;
+        } else if (strcmp(argv[i], "reuseport") == 0) {
+            reuseport_enable = 1;
+            config.reuseport_enable = 1;
+        } else if (strcmp(argv[i], "round_robin") == 0) {
+            config.dispatch_policy = XV_DISPATCH_ROUND_ROBIN;
+        } else if (strcmp(argv[i], "least_conn") == 0) {
+            config.dispatch_policy = XV_DISPATCH_LEAST_CONN;
+            placement_enable = 1;
+            placement_policy = config.dispatch_policy;
+        } else if (strcmp(argv[i], "least_load") == 0) {
+            config.dispatch_policy = XV_DISPATCH_LEAST_LOAD;
+            placement_enable = 1;
+            placement_policy = config.dispatch_policy;
+        } else if (strcmp(argv[i], "leader_serve") == 0) {
+            config.leader_serve_enable = 1;
+        } else if (strcmp(argv[i], "migrate") == 0) {
+            migrate_enable = 1;
+        } else if (strcmp(argv[i], "send_by_id") == 0) {
+            send_by_id_enable = 1;
+            stale_id_enable = 1;
+        } else if (strcmp(argv[i], "deferred") == 0) {
+            deferred_enable = 1;
+        } else if (strcmp(argv[i], "inline") == 0) {
+            handle.exec_mode = XV_EXEC_INLINE;
+        } else if (strcmp(argv[i], "adaptive") == 0) {
+            handle.exec_mode = XV_EXEC_ADAPTIVE;
+        } else if (strcmp(argv[i], "worker_encode") == 0) {
+            config.worker_encode_enable = 1;
+        } else if (strcmp(argv[i], "direct_write") == 0) {
+            config.direct_write_enable = 1;
+        } else if (strcmp(argv[i], "limit") == 0) {
+            limit_enable = 1;
+            config.max_pending_requests = 2;
+            config.adaptive_limit_enable = 1;
+            handle.on_reject = on_reject;
+        } else if (strcmp(argv[i], "queue_limit") == 0) {
+            // one worker, only the queue cap reject requests
+            limit_enable = 1;
+            config.worker_thread_count = 1;
+            config.max_queued_requests = 1;
+            handle.on_reject = on_reject;
+        } else if (strcmp(argv[i], "pipeline") == 0) {
+            // requests wait in read buffer, less connections for the rate limit
+            pipeline_enable = 1;
+            test_count = TEST_COUNT / 5;
+        } else if (strcmp(argv[i], "rate_limit") == 0) {
+            // all clients from 127.0.0.1, address limit pause them sometimes
+            rate_limit_enable = 1;
+            config.conn_byte_rate = 1000;
+            config.addr_request_rate = TEST_REQUEST_RATE;
+        }
+    }
+
+    if (deferred_enable) {
+        deferred_queue = xv_concurrent_queue_init();
+        pthread_t deferred_id;
+        int ret = pthread_create(&deferred_id, NULL, deferred_fun, NULL);
+        ASSERT(ret == 0);
+        pthread_detach(deferred_id);
+    }
+
     service = xv_service_init(config);
     ASSERT(service);
 
-    int ret = xv_service_add_listen(service, "0.0.0.0", TEST_PORT, handle);
+    int ret = xv_service_add_listen_with_options(service, unix_enable ? "unix:" TEST_UNIX_PATH : "0.0.0.0",
+            TEST_PORT, handle, options);
     ASSERT(ret == XV_OK);
 
     ret = xv_service_start(service);
     ASSERT(ret == XV_OK);
 
+    // checks before the echo clients start
+    if (placement_enable || stale_id_enable) {
+        pthread_t setup_id;
+        ret = pthread_create(&setup_id, NULL, setup_fun, NULL);
+        CHECK(ret == 0, "pthread_create: ");
+        pthread_detach(setup_id);
+    }
+
     pthread_t ids[TEST_THREAD_COUNT];
     for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
         int *pi = (int *)xv_malloc(sizeof(int));
@@ -179,6 +605,9 @@ int main(int argc, char *argv[])
         CHECK(ret == 0, "pthread_create: ");
     }
 
+    struct timeval begin;
+    gettimeofday(&begin, NULL);
+
     ret = xv_service_run(service);
     ASSERT(ret == XV_OK);
 
@@ -187,6 +616,34 @@ int main(int argc, char *argv[])
         CHECK(ret == 0, "pthread_create: ");
     }
 
+    if (rate_limit_enable) {
+        // one second burst, then no more than the rate, a little slack for the timer
+        struct timeval end;
+        gettimeofday(&end, NULL);
+        int64_t elapsed_ms = (end.tv_sec - begin.tv_sec) * 1000 + (end.tv_usec - begin.tv_usec) / 1000;
+        int count = xv_atomic_get(&request_count);
+        fprintf(stderr, "%d requests in %lld ms\n", count, (long long)elapsed_ms);
+        ASSERT(count > TEST_REQUEST_RATE);
+        ASSERT(count <= TEST_REQUEST_RATE + TEST_REQUEST_RATE * elapsed_ms / 1000 + TEST_REQUEST_RATE / 10);
+    }
+
+    if (reuseport_enable && !unix_enable) {
+        // kernel spread the connections to the reuseport group
+        int accept_threads = 0;
+        for (int i = 0; i < TEST_IO_THREAD_COUNT; ++i) {
+            fprintf(stderr, "IO Thread No.%d accepted %d connections\n", i, xv_atomic_get(&accept_count[i]));
+            if (xv_atomic_get(&accept_count[i]) > 0) {
+                ++accept_threads;
+            }
+        }
+        ASSERT(accept_threads > 1);
+    }
+
+    if (limit_enable) {
+        fprintf(stderr, "rejected requests: %d\n", xv_atomic_get(&reject_count));
+        ASSERT(xv_atomic_get(&reject_count) > 0);
+    }
+
     xv_service_destroy(service);
 
     return EXIT_SUCCESS;
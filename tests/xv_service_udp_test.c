@@ -0,0 +1,224 @@
+/**
+ * (C) 2007-2019 XiYouF4 Holding Limited
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Version: 1.0: xv_service_udp_test.c 08/13/2019 $
+ *
+ * Authors:
+ *   hurley25 <liuhuan1992@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "xv_test.h"
+#include "xv_service.h"
+#include "xv_socket.h"
+
+#define TEST_PORT 12346
+#define TEST_THREAD_COUNT 4
+#define TEST_COUNT 2000
+#define TEST_WINDOW 16
+#define TEST_DATAGRAM_SIZE 256
+
+xv_service_t *service = NULL;
+
+typedef struct packet_t {
+    int len;
+    char buf[0];
+} packet_t;
+
+int client_socket()
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK(fd > 0, "socket: ");
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(TEST_PORT);
+    inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+    int ret = connect(fd, (struct sockaddr *)&sa, sizeof(sa));
+    CHECK(ret == 0, "connect: ");
+
+    // lost reply fail the test rather than hang
+    struct timeval tv = {2, 0};
+    ret = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    CHECK(ret == 0, "setsockopt: ");
+
+    return fd;
+}
+
+void *client_fun(void *args)
+{
+    int idx = *(int *)args;
+    int fd = client_socket();
+
+    // over `udp_datagram_size`, server drop it without reply
+    char big[TEST_DATAGRAM_SIZE * 2];
+    memset(big, 'x', sizeof(big));
+    int ret = send(fd, big, sizeof(big), 0);
+    CHECK(ret == sizeof(big), "send: ");
+
+    // keep a window of datagrams in flight, replies of one peer come back in order
+    char buf[64];
+    int sent = 0, recved = 0;
+    while (recved < TEST_COUNT) {
+        while (sent < TEST_COUNT && sent - recved < TEST_WINDOW) {
+            int len = snprintf(buf, sizeof(buf), "client %d seq %d", idx, sent);
+            ret = send(fd, buf, len, 0);
+            CHECK(ret == len, "send: ");
+            ++sent;
+        }
+        char expect[64];
+        int len = snprintf(expect, sizeof(expect), "client %d seq %d", idx, recved);
+        ret = recv(fd, buf, sizeof(buf), 0);
+        CHECK(ret > 0, "recv: ");
+        ASSERT(ret == len && memcmp(buf, expect, len) == 0);
+        ++recved;
+    }
+    xv_close(fd);
+
+    return NULL;
+}
+
+void *control_fun(void *args)
+{
+    pthread_t ids[TEST_THREAD_COUNT];
+    int idxs[TEST_THREAD_COUNT];
+    for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+        idxs[i] = i;
+        int ret = pthread_create(&ids[i], NULL, client_fun, &idxs[i]);
+        CHECK(ret == 0, "pthread_create: ");
+    }
+    for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+        pthread_join(ids[i], NULL);
+    }
+    fprintf(stderr, "%d clients, %d datagrams echoed\n", TEST_THREAD_COUNT, TEST_THREAD_COUNT * TEST_COUNT);
+    kill(getpid(), SIGINT);
+
+    return NULL;
+}
+
+int decode(xv_buffer_t *buffer, void **request)
+{
+    int size = xv_buffer_readable_size(buffer);
+    ASSERT(size <= TEST_DATAGRAM_SIZE);
+
+    packet_t *req = (packet_t *)xv_malloc(sizeof(int) + size);
+    req->len = xv_buffer_read_data(buffer, req->buf, size);
+    *request = req;
+
+    return XV_OK;
+}
+
+int process(xv_message_t *message)
+{
+    char addr[XV_ADDR_LEN];
+    int port = 0;
+    int ret = xv_message_get_peer_addr(message, addr, sizeof(addr), &port);
+    ASSERT(ret == XV_OK && strcmp(addr, "127.0.0.1") == 0 && port > 0);
+
+    // not a real connection
+    xv_connection_t *conn = xv_message_get_connection(message);
+    ASSERT(xv_service_migrate_connection(conn, 0) == XV_ERR);
+
+    packet_t *request = (packet_t *)xv_message_get_request(message);
+    packet_t *response = (packet_t *)xv_malloc(sizeof(int) + request->len);
+    memcpy(response->buf, request->buf, request->len);
+    response->len = request->len;
+    xv_message_set_response(message, response);
+
+    return XV_OK;
+}
+
+int encode(xv_buffer_t *buffer, void *reponse)
+{
+    packet_t *resp = (packet_t *)reponse;
+    xv_buffer_write_data(buffer, resp->buf, resp->len);
+
+    return XV_OK;
+}
+
+void packet_cleanup(void *packet)
+{
+    xv_free(packet);
+}
+
+void handle_sigint(int sig)
+{
+    if (sig == SIGINT) {
+        fprintf(stderr, "recv sigint, exit now\n");
+        if (service) {
+            xv_service_stop(service);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGINT, handle_sigint);
+
+    xv_service_handle_t handle;
+    bzero(&handle, sizeof(handle));
+    handle.decode = decode;
+    handle.process = process;
+    handle.encode = encode;
+    handle.packet_cleanup = packet_cleanup;
+
+    xv_service_config_t config;
+    bzero(&config, sizeof(config));
+    config.io_thread_count = 4;
+    config.worker_thread_count = 4;
+    // small batch, fill it up sometimes
+    config.udp_batch_size = 8;
+    config.udp_datagram_size = TEST_DATAGRAM_SIZE;
+
+    // ./xv_service_udp_test [reuseport] [inline] [worker_encode]
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "reuseport") == 0) {
+            config.reuseport_enable = 1;
+        } else if (strcmp(argv[i], "inline") == 0) {
+            handle.exec_mode = XV_EXEC_INLINE;
+        } else if (strcmp(argv[i], "worker_encode") == 0) {
+            config.worker_encode_enable = 1;
+            config.direct_write_enable = 1;
+        }
+    }
+
+    service = xv_service_init(config);
+    ASSERT(service);
+
+    xv_socket_options_t options;
+    bzero(&options, sizeof(options));
+    options.recv_buffer_size = 1 << 20;
+
+    int ret = xv_service_add_udp_listen_with_options(service, "127.0.0.1", TEST_PORT, handle, options);
+    ASSERT(ret == XV_OK);
+
+    ret = xv_service_start(service);
+    ASSERT(ret == XV_OK);
+
+    pthread_t control_id;
+    ret = pthread_create(&control_id, NULL, control_fun, NULL);
+    CHECK(ret == 0, "pthread_create: ");
+
+    ret = xv_service_run(service);
+    ASSERT(ret == XV_OK);
+
+    pthread_join(control_id, NULL);
+    xv_service_destroy(service);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,242 @@
+/**
+ * (C) 2007-2019 XiYouF4 Holding Limited
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Version: 1.0: xv_service_upstream_test.c 08/13/2019 $
+ *
+ * Authors:
+ *   hurley25 <liuhuan1992@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "xv_test.h"
+#include "xv_service.h"
+#include "xv_socket.h"
+#include "xv_queue.h"
+
+#define TEST_PORT 12348
+#define TEST_THREAD_COUNT 4
+#define TEST_COUNT 2000
+#define TEST_BATCH 8
+
+// the service is its own upstream, the pool pipeline requests to the echo listener
+xv_service_t *service = NULL;
+xv_upstream_t *upstream = NULL;
+xv_atomic_t finished;
+int id_enable = 0;
+xv_concurrent_queue_t *deferred_queue = NULL;
+
+typedef struct packet_t {
+    uint64_t id;
+    int len;
+    char buf[0];
+} packet_t;
+
+packet_t *packet_init(const char *buf, int len)
+{
+    packet_t *packet = (packet_t *)xv_malloc(sizeof(packet_t) + len + 1);
+    memcpy(packet->buf, buf, len);
+    packet->buf[len] = '\0';
+    packet->len = len;
+    packet->id = strtoull(packet->buf + strlen("req "), NULL, 10);
+
+    return packet;
+}
+
+// one line one packet, both sides
+int decode(xv_buffer_t *buffer, void **request)
+{
+    char *begin = xv_buffer_read_begin(buffer);
+    char *end = memchr(begin, '\n', xv_buffer_readable_size(buffer));
+    if (!end) {
+        return XV_AGAIN;
+    }
+    int len = end - begin + 1;
+    *request = packet_init(begin, len);
+    xv_buffer_incr_read_index(buffer, len);
+
+    return XV_OK;
+}
+
+int encode(xv_buffer_t *buffer, void *packet)
+{
+    packet_t *p = (packet_t *)packet;
+    xv_buffer_write_data(buffer, p->buf, p->len);
+
+    return XV_OK;
+}
+
+void packet_cleanup(void *packet)
+{
+    xv_free(packet);
+}
+
+uint64_t packet_id(void *packet)
+{
+    return ((packet_t *)packet)->id;
+}
+
+// complete a batch in reverse order, responses come back out of order
+void *deferred_fun(void *args)
+{
+    while (1) {
+        xv_message_t *messages[TEST_BATCH];
+        int count = 0;
+        while (count < TEST_BATCH && (messages[count] = xv_concurrent_queue_pop(deferred_queue))) {
+            ++count;
+        }
+        if (count == 0) {
+            usleep(1000);
+            continue;
+        }
+        while (count > 0) {
+            xv_message_t *message = messages[--count];
+            packet_t *request = (packet_t *)xv_message_get_request(message);
+            xv_message_complete(message, packet_init(request->buf, request->len));
+        }
+    }
+
+    return NULL;
+}
+
+int echo_process(xv_message_t *message)
+{
+    if (id_enable) {
+        xv_concurrent_queue_push(deferred_queue, message);
+        return XV_AGAIN;
+    }
+    packet_t *request = (packet_t *)xv_message_get_request(message);
+    xv_message_set_response(message, packet_init(request->buf, request->len));
+
+    return XV_OK;
+}
+
+void on_response(int status, void *response, void *ctx)
+{
+    ASSERT(status == XV_OK);
+    packet_t *resp = (packet_t *)response;
+    ASSERT(resp->id == (uint64_t)(uintptr_t)ctx);
+    xv_free(resp);
+
+    if (xv_atomic_incr(&finished) == TEST_THREAD_COUNT * TEST_COUNT) {
+        kill(getpid(), SIGINT);
+    }
+}
+
+void *client_fun(void *args)
+{
+    int idx = *(int *)args;
+
+    char buf[64];
+    for (int i = 0; i < TEST_COUNT; ++i) {
+        uint64_t id = (uint64_t)idx * TEST_COUNT + i + 1;
+        int len = snprintf(buf, sizeof(buf), "req %lu\n", id);
+        packet_t *request = packet_init(buf, len);
+        // connecting, or all connections are full
+        while (xv_upstream_send(upstream, request, on_response, (void *)(uintptr_t)id) != XV_OK) {
+            usleep(1000);
+        }
+    }
+
+    return NULL;
+}
+
+void handle_sigint(int sig)
+{
+    if (sig == SIGINT) {
+        fprintf(stderr, "recv sigint, exit now\n");
+        if (service) {
+            xv_service_stop(service);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_sigint);
+
+    xv_service_handle_t echo_handle;
+    bzero(&echo_handle, sizeof(echo_handle));
+    echo_handle.decode = decode;
+    echo_handle.process = echo_process;
+    echo_handle.encode = encode;
+    echo_handle.packet_cleanup = packet_cleanup;
+
+    xv_service_config_t config;
+    bzero(&config, sizeof(config));
+    config.io_thread_count = 4;
+    config.worker_thread_count = 4;
+    config.tcp_nodealy = 1;
+
+    xv_upstream_config_t upstream_config;
+    bzero(&upstream_config, sizeof(upstream_config));
+    upstream_config.decode = decode;
+    upstream_config.encode = encode;
+    upstream_config.packet_cleanup = packet_cleanup;
+
+    // ./xv_service_upstream_test [id]
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "id") == 0) {
+            id_enable = 1;
+            upstream_config.match = XV_UPSTREAM_MATCH_ID;
+            upstream_config.packet_id = packet_id;
+            upstream_config.conn_count = 2;
+            upstream_config.max_pending = 32;
+        }
+    }
+
+    if (id_enable) {
+        deferred_queue = xv_concurrent_queue_init();
+        pthread_t deferred_id;
+        int ret = pthread_create(&deferred_id, NULL, deferred_fun, NULL);
+        ASSERT(ret == 0);
+        pthread_detach(deferred_id);
+    }
+
+    xv_atomic_set(&finished, 0);
+
+    service = xv_service_init(config);
+    ASSERT(service);
+
+    int ret = xv_service_add_listen(service, "127.0.0.1", TEST_PORT, echo_handle);
+    ASSERT(ret == XV_OK);
+
+    ret = xv_service_start(service);
+    ASSERT(ret == XV_OK);
+
+    upstream = xv_upstream_init(service, "127.0.0.1", TEST_PORT, upstream_config);
+    ASSERT(upstream);
+
+    pthread_t ids[TEST_THREAD_COUNT];
+    int idxs[TEST_THREAD_COUNT];
+    for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+        idxs[i] = i;
+        ret = pthread_create(&ids[i], NULL, client_fun, &idxs[i]);
+        CHECK(ret == 0, "pthread_create: ");
+    }
+
+    ret = xv_service_run(service);
+    ASSERT(ret == XV_OK);
+
+    for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+        pthread_join(ids[i], NULL);
+    }
+    fprintf(stderr, "%d requests finished\n", xv_atomic_get(&finished));
+    ASSERT(xv_atomic_get(&finished) == TEST_THREAD_COUNT * TEST_COUNT);
+    ASSERT(xv_upstream_get_pending(upstream) == 0);
+
+    xv_upstream_destroy(upstream);
+    xv_service_destroy(service);
+
+    return EXIT_SUCCESS;
+}